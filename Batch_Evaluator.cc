@@ -0,0 +1,253 @@
+/*
+ * Batch_Evaluator.cc
+ */
+#include "Batch_Evaluator.h"
+#include "Compiled_Expression.h"
+#include "Expression.h"
+#include "Expression_Tree.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define BATCH_SIMD 1
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+using namespace std;
+
+namespace
+{
+  // Antal rader som behandlas per block; stacken rymmer max_depth_ block.
+  constexpr size_t block_size{ 256 };
+
+  // Operationerna, med en skalär variant och varianter för varje
+  // instruktionsuppsättning. Kärnorna nedan beräknar a[i] = a[i] op b[i].
+  struct Add
+  {
+    static double scalar(double a, double b) { return a + b; }
+#ifdef BATCH_SIMD
+    TARGET("avx2") static __m256d avx2(__m256d a, __m256d b) { return _mm256_add_pd(a, b); }
+    TARGET("avx512f") static __m512d avx512(__m512d a, __m512d b) { return _mm512_add_pd(a, b); }
+#endif
+  };
+
+  struct Subtract
+  {
+    static double scalar(double a, double b) { return a - b; }
+#ifdef BATCH_SIMD
+    TARGET("avx2") static __m256d avx2(__m256d a, __m256d b) { return _mm256_sub_pd(a, b); }
+    TARGET("avx512f") static __m512d avx512(__m512d a, __m512d b) { return _mm512_sub_pd(a, b); }
+#endif
+  };
+
+  struct Multiply
+  {
+    static double scalar(double a, double b) { return a * b; }
+#ifdef BATCH_SIMD
+    TARGET("avx2") static __m256d avx2(__m256d a, __m256d b) { return _mm256_mul_pd(a, b); }
+    TARGET("avx512f") static __m512d avx512(__m512d a, __m512d b) { return _mm512_mul_pd(a, b); }
+#endif
+  };
+
+  struct Divide_Op
+  {
+    static double scalar(double a, double b) { return a / b; }
+#ifdef BATCH_SIMD
+    TARGET("avx2") static __m256d avx2(__m256d a, __m256d b) { return _mm256_div_pd(a, b); }
+    TARGET("avx512f") static __m512d avx512(__m512d a, __m512d b) { return _mm512_div_pd(a, b); }
+#endif
+  };
+
+  // Power har ingen vektorvariant; se Kernels::power.
+  struct Power_Op
+  {
+    static double scalar(double a, double b) { return pow(a, b); }
+  };
+
+  using kernel = void (*)(double* a, const double* b, size_t n);
+
+  template <typename Op>
+  void scalar_kernel(double* a, const double* b, size_t n)
+  {
+    for (size_t i = 0; i < n; ++i)
+      a[i] = Op::scalar(a[i], b[i]);
+  }
+
+#ifdef BATCH_SIMD
+  template <typename Op>
+  TARGET("avx2") void avx2_kernel(double* a, const double* b, size_t n)
+  {
+    size_t i{ 0 };
+    for (; i + 4 <= n; i += 4)
+      _mm256_storeu_pd(a + i, Op::avx2(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    for (; i < n; ++i)
+      a[i] = Op::scalar(a[i], b[i]);
+  }
+
+  template <typename Op>
+  TARGET("avx512f") void avx512_kernel(double* a, const double* b, size_t n)
+  {
+    size_t i{ 0 };
+    for (; i + 8 <= n; i += 8)
+      _mm512_storeu_pd(a + i, Op::avx512(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i)));
+    for (; i < n; ++i)
+      a[i] = Op::scalar(a[i], b[i]);
+  }
+#endif
+
+  struct Kernels
+  {
+    const char* name;
+    kernel      add;
+    kernel      subtract;
+    kernel      multiply;
+    kernel      divide;
+    // power är den skalära kärnan i alla uppsättningar.
+    kernel      power;
+  };
+
+  // select_kernels() väljer kärnor efter processorns egenskaper, en gång.
+  const Kernels& select_kernels()
+  {
+    static const Kernels kernels = []
+      {
+#ifdef BATCH_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+	  return Kernels{ "avx512f", avx512_kernel<Add>, avx512_kernel<Subtract>,
+			  avx512_kernel<Multiply>, avx512_kernel<Divide_Op>,
+			  scalar_kernel<Power_Op> };
+	if (__builtin_cpu_supports("avx2"))
+	  return Kernels{ "avx2", avx2_kernel<Add>, avx2_kernel<Subtract>,
+			  avx2_kernel<Multiply>, avx2_kernel<Divide_Op>,
+			  scalar_kernel<Power_Op> };
+#endif
+	return Kernels{ "scalar", scalar_kernel<Add>, scalar_kernel<Subtract>,
+			scalar_kernel<Multiply>, scalar_kernel<Divide_Op>,
+			scalar_kernel<Power_Op> };
+      }();
+    return kernels;
+  }
+
+  bool contains_zero(const double* b, size_t n)
+  {
+    return any_of(b, b + n, [](double x) { return x == 0; });
+  }
+}
+
+/*
+ * Konstruktorn kompilerar uttrycket och avgör för varje läsning av en
+ * variabel om den kommer efter en tilldelning av samma variabel.
+ */
+Batch_Evaluator::Batch_Evaluator(const Expression& expression)
+  : program_(expression.compile()), assigned_(program_.code_.size(), false)
+{
+  vector<bool> stored(program_.slots_, false);
+  for (size_t i = 0; i < program_.code_.size(); ++i)
+    {
+      const Instruction& instruction = program_.code_[i];
+      if (instruction.op == Opcode::Store)
+	stored[instruction.arg] = true;
+      else if (instruction.op == Opcode::Load)
+	assigned_[i] = stored[instruction.arg];
+    }
+}
+
+/*
+ * evaluate() kör bytekoden block för block. Varje plats på värdestacken är
+ * ett helt block, så en instruktion blir en slinga över blockets rader.
+ * Tilldelade variabler har ett eget block.
+ */
+void Batch_Evaluator::evaluate(const vector<const double*>& columns,
+			       double* out, size_t n) const
+{
+  const Kernels& kernels = select_kernels();
+
+  for (size_t i = 0; i < program_.code_.size(); ++i)
+    {
+      const Instruction& instruction = program_.code_[i];
+      if (instruction.op == Opcode::Load && !assigned_[i] &&
+	  (instruction.arg >= columns.size() || columns[instruction.arg] == nullptr))
+	{
+	  throw expression_tree_error("Kolumn saknas för variabeln " +
+				      string{ Symbol_Table::name(instruction.arg) });
+	}
+    }
+
+  vector<double> stack(program_.max_depth_ * block_size);
+  vector<double> temporaries(program_.temporaries_ * block_size);
+  vector<double> variables(program_.stored_.empty() ? 0 : program_.slots_ * block_size);
+
+  for (size_t first = 0; first < n; first += block_size)
+    {
+      const size_t rows = min(block_size, n - first);
+      double* top = stack.data() - block_size;
+
+      for (size_t i = 0; i < program_.code_.size(); ++i)
+	{
+	  const Instruction& instruction = program_.code_[i];
+	  switch (instruction.op)
+	    {
+	    case Opcode::Constant:
+	      top += block_size;
+	      fill(top, top + rows, static_cast<double>(program_.constants_[instruction.arg]));
+	      break;
+	    case Opcode::Load:
+	      top += block_size;
+	      if (assigned_[i])
+		memcpy(top, &variables[instruction.arg * block_size], rows * sizeof(double));
+	      else
+		memcpy(top, columns[instruction.arg] + first, rows * sizeof(double));
+	      break;
+	    case Opcode::Store:
+	      memcpy(&variables[instruction.arg * block_size], top, rows * sizeof(double));
+	      break;
+	    case Opcode::Add:
+	      kernels.add(top - block_size, top, rows);
+	      top -= block_size;
+	      break;
+	    case Opcode::Subtract:
+	      kernels.subtract(top - block_size, top, rows);
+	      top -= block_size;
+	      break;
+	    case Opcode::Multiply:
+	      kernels.multiply(top - block_size, top, rows);
+	      top -= block_size;
+	      break;
+	    case Opcode::Divide:
+	      if (contains_zero(top, rows))
+		throw expression_tree_error("Division med 0");
+	      kernels.divide(top - block_size, top, rows);
+	      top -= block_size;
+	      break;
+	    case Opcode::Power:
+	      kernels.power(top - block_size, top, rows);
+	      top -= block_size;
+	      break;
+	    case Opcode::Save:
+	      memcpy(&temporaries[instruction.arg * block_size], top, rows * sizeof(double));
+	      break;
+	    case Opcode::Recall:
+	      top += block_size;
+	      memcpy(top, &temporaries[instruction.arg * block_size], rows * sizeof(double));
+	      break;
+	    case Opcode::Fail:
+	      throw expression_tree_error(program_.errors_[instruction.arg]);
+	    }
+	}
+      memcpy(out + first, top, rows * sizeof(double));
+    }
+}
+
+void evaluate_batch(const Expression& expression,
+		    const vector<const double*>& columns,
+		    double* out, size_t n)
+{
+  Batch_Evaluator{ expression }.evaluate(columns, out, n);
+}
+
+const char* batch_instruction_set()
+{
+  return select_kernels().name;
+}
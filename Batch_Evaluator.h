@@ -0,0 +1,55 @@
+/*
+ * Batch_Evaluator.h
+ */
+#ifndef BATCH_EVALUATOR_H
+#define BATCH_EVALUATOR_H
+#include "Compiled_Expression.h"
+#include <cstddef>
+#include <vector>
+
+class Expression;
+
+/**
+ * Batch_Evaluator evaluerar ett uttryck för n rader av variabelvärden på en
+ * gång. Uttrycket kompileras till bytekod en gång, i konstruktorn.
+ * columns innehåller en kolumn med n värden per variabel, indexerad med
+ * variabelns slot (se Symbol_Table); slots som uttrycket inte läser får
+ * vara nullptr. Resultatet för rad i skrivs till out[i].
+ *
+ * Varje operator utförs som en vektoriserad kärna över ett block av rader,
+ * med AVX-512 eller AVX2 om processorn har det och annars skalärt. Potens
+ * har ingen vektorinstruktion och beräknas med pow, rad för rad, med alla
+ * instruktionsuppsättningar. En tilldelning skriver inte till kolumnerna,
+ * men senare läsningar av variabeln i samma rad ger det tilldelade värdet,
+ * som i trädet.
+ */
+class Batch_Evaluator
+{
+ public:
+  explicit Batch_Evaluator(const Expression& expression);
+
+  void evaluate(const std::vector<const double*>& columns,
+                double* out, std::size_t n) const;
+
+ private:
+  Compiled_Expression program_;
+  // assigned_[i] är sant om instruktion i läser en variabel som redan har
+  // tilldelats, och alltså inte kolumnen.
+  std::vector<bool>   assigned_;
+};
+
+/**
+ * evaluate_batch() evaluerar expression en gång med en tillfällig
+ * Batch_Evaluator.
+ */
+void evaluate_batch(const Expression& expression,
+                    const std::vector<const double*>& columns,
+                    double* out, std::size_t n);
+
+/**
+ * batch_instruction_set() anger vilka kärnor evaluate_batch() använder:
+ * "avx512f", "avx2" eller "scalar".
+ */
+const char* batch_instruction_set();
+
+#endif
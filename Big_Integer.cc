@@ -0,0 +1,302 @@
+/*
+ * Big_Integer.cc
+ */
+#include "Big_Integer.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+using namespace std;
+
+namespace
+{
+  // magnitude() är absolutbeloppet av ett int64_t, även för det minsta.
+  uint64_t magnitude(int64_t value)
+  {
+    return value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+  }
+
+  unsigned bits(uint64_t value)
+  {
+    return value == 0 ? 0 : 64 - __builtin_clzll(value);
+  }
+}
+
+bool Big_Integer::negative() const
+{
+  return small() ? small_ < 0 : negative_;
+}
+
+size_t Big_Integer::bit_length() const
+{
+  if (small())
+    return bits(magnitude(small_));
+  return 32 * (magnitude_.size() - 1) + bits(magnitude_.back());
+}
+
+/*
+ * to_long_double() tar de 128 mest signifikanta bitarna som två exakta
+ * long double och adderar dem, så att avrundningen sker en gång.
+ */
+long double Big_Integer::to_long_double() const
+{
+  if (small())
+    return static_cast<long double>(small_);
+
+  // window() ger de 64 bitarna från och med bit position; bitar under 0
+  // räknas som 0.
+  auto window = [this](long position)
+    {
+      uint64_t result{ 0 };
+      for (int i = 0; i < 64; ++i)
+	{
+	  const long bit = position + i;
+	  if (bit < 0)
+	    continue;
+	  const size_t digit = static_cast<size_t>(bit) / 32;
+	  if (digit < magnitude_.size() && (magnitude_[digit] >> (bit % 32) & 1))
+	    result |= uint64_t{ 1 } << i;
+	}
+      return result;
+    };
+
+  const long shift = static_cast<long>(bit_length()) - 64;
+  const long double high = static_cast<long double>(window(shift));
+  const long double low = ldexp(static_cast<long double>(window(shift - 64)), -64);
+  const long double result = ldexp(high + low, static_cast<int>(min(shift, 100000L)));
+  return negative_ ? -result : result;
+}
+
+/*
+ * str() ger talet decimalt. Stora tal delas upprepat med 10^9.
+ */
+string Big_Integer::str() const
+{
+  if (small())
+    return to_string(small_);
+
+  Digits rest = magnitude_;
+  vector<uint32_t> groups;
+  while (!rest.empty())
+    {
+      uint64_t remainder{ 0 };
+      for (size_t i = rest.size(); i-- > 0;)
+	{
+	  const uint64_t current = remainder << 32 | rest[i];
+	  rest[i] = static_cast<uint32_t>(current / 1000000000);
+	  remainder = current % 1000000000;
+	}
+      groups.push_back(static_cast<uint32_t>(remainder));
+      while (!rest.empty() && rest.back() == 0)
+	rest.pop_back();
+    }
+
+  string result{ negative_ ? "-" : "" };
+  result += to_string(groups.back());
+  for (size_t i = groups.size() - 1; i-- > 0;)
+    {
+      const string group = to_string(groups[i]);
+      result.append(9 - group.size(), '0');
+      result += group;
+    }
+  return result;
+}
+
+Big_Integer operator+(const Big_Integer& left, const Big_Integer& right)
+{
+  int64_t sum;
+  if (left.small() && right.small() && !__builtin_add_overflow(left.small_, right.small_, &sum))
+    return Big_Integer{ sum };
+  return Big_Integer::signed_add(left.negative(), left.digits(),
+				 right.negative(), right.digits());
+}
+
+Big_Integer operator-(const Big_Integer& left, const Big_Integer& right)
+{
+  int64_t difference;
+  if (left.small() && right.small() &&
+      !__builtin_sub_overflow(left.small_, right.small_, &difference))
+    return Big_Integer{ difference };
+  return Big_Integer::signed_add(left.negative(), left.digits(),
+				 !right.negative(), right.digits());
+}
+
+Big_Integer operator*(const Big_Integer& left, const Big_Integer& right)
+{
+  int64_t product;
+  if (left.small() && right.small() &&
+      !__builtin_mul_overflow(left.small_, right.small_, &product))
+    return Big_Integer{ product };
+  return Big_Integer::make(left.negative() != right.negative(),
+			   Big_Integer::multiply(left.digits(), right.digits()));
+}
+
+bool operator==(const Big_Integer& left, const Big_Integer& right)
+{
+  if (left.small() || right.small())
+    return left.small() && right.small() && left.small_ == right.small_;
+  return left.negative_ == right.negative_ && left.magnitude_ == right.magnitude_;
+}
+
+bool operator!=(const Big_Integer& left, const Big_Integer& right)
+{
+  return !(left == right);
+}
+
+Big_Integer Big_Integer::power(Big_Integer base, uint64_t exponent)
+{
+  Big_Integer result{ 1 };
+  while (exponent > 0)
+    {
+      if (exponent & 1)
+	result = result * base;
+      exponent >>= 1;
+      if (exponent > 0)
+	base = base * base;
+    }
+  return result;
+}
+
+/*
+ * parse() läser nio siffror i taget: magnituden multipliceras med 10^9 och
+ * gruppen läggs till, direkt i vektorn.
+ */
+Big_Integer Big_Integer::parse(string_view digits)
+{
+  Digits result;
+  for (size_t first = 0; first < digits.size();)
+    {
+      const size_t size = min<size_t>(9, digits.size() - first);
+      uint64_t carry{ 0 };
+      uint64_t scale{ 1 };
+      for (size_t i = 0; i < size; ++i)
+	{
+	  carry = 10 * carry + static_cast<uint64_t>(digits[first + i] - '0');
+	  scale *= 10;
+	}
+      first += size;
+
+      for (uint32_t& digit : result)
+	{
+	  carry += digit * scale;
+	  digit = static_cast<uint32_t>(carry);
+	  carry >>= 32;
+	}
+      if (carry != 0)
+	result.push_back(static_cast<uint32_t>(carry));
+    }
+  return make(false, std::move(result));
+}
+
+Big_Integer::Digits Big_Integer::digits() const
+{
+  if (!small())
+    return magnitude_;
+
+  const uint64_t value = magnitude(small_);
+  Digits result;
+  if (value != 0)
+    result.push_back(static_cast<uint32_t>(value));
+  if (value >> 32 != 0)
+    result.push_back(static_cast<uint32_t>(value >> 32));
+  return result;
+}
+
+/*
+ * make() normaliserar: inledande nollor tas bort och värden som ryms i
+ * int64_t flyttas till small_.
+ */
+Big_Integer Big_Integer::make(bool negative, Digits magnitude)
+{
+  while (!magnitude.empty() && magnitude.back() == 0)
+    magnitude.pop_back();
+
+  if (magnitude.size() <= 2)
+    {
+      uint64_t value{ 0 };
+      for (size_t i = magnitude.size(); i-- > 0;)
+	value = value << 32 | magnitude[i];
+      constexpr uint64_t limit = uint64_t{ 1 } << 63;
+      if (!negative && value < limit)
+	return Big_Integer{ static_cast<int64_t>(value) };
+      if (negative && value <= limit)
+	return Big_Integer{ value == limit ? numeric_limits<int64_t>::min()
+			                   : -static_cast<int64_t>(value) };
+    }
+
+  Big_Integer result;
+  result.negative_ = negative;
+  result.magnitude_ = std::move(magnitude);
+  return result;
+}
+
+int Big_Integer::compare(const Digits& left, const Digits& right)
+{
+  if (left.size() != right.size())
+    return left.size() < right.size() ? -1 : 1;
+  for (size_t i = left.size(); i-- > 0;)
+    if (left[i] != right[i])
+      return left[i] < right[i] ? -1 : 1;
+  return 0;
+}
+
+Big_Integer::Digits Big_Integer::add(const Digits& left, const Digits& right)
+{
+  const Digits& longer = left.size() >= right.size() ? left : right;
+  const Digits& shorter = left.size() >= right.size() ? right : left;
+  Digits result(longer.size() + 1);
+  uint64_t carry{ 0 };
+  for (size_t i = 0; i < longer.size(); ++i)
+    {
+      carry += longer[i];
+      if (i < shorter.size())
+	carry += shorter[i];
+      result[i] = static_cast<uint32_t>(carry);
+      carry >>= 32;
+    }
+  result.back() = static_cast<uint32_t>(carry);
+  return result;
+}
+
+// subtract() förutsätter att left >= right.
+Big_Integer::Digits Big_Integer::subtract(const Digits& left, const Digits& right)
+{
+  Digits result(left.size());
+  int64_t borrow{ 0 };
+  for (size_t i = 0; i < left.size(); ++i)
+    {
+      int64_t current = static_cast<int64_t>(left[i]) - borrow;
+      if (i < right.size())
+	current -= right[i];
+      borrow = current < 0;
+      result[i] = static_cast<uint32_t>(current + (borrow << 32));
+    }
+  return result;
+}
+
+Big_Integer::Digits Big_Integer::multiply(const Digits& left, const Digits& right)
+{
+  Digits result(left.size() + right.size());
+  for (size_t i = 0; i < left.size(); ++i)
+    {
+      uint64_t carry{ 0 };
+      for (size_t j = 0; j < right.size(); ++j)
+	{
+	  carry += static_cast<uint64_t>(left[i]) * right[j] + result[i + j];
+	  result[i + j] = static_cast<uint32_t>(carry);
+	  carry >>= 32;
+	}
+      result[i + right.size()] = static_cast<uint32_t>(carry);
+    }
+  return result;
+}
+
+Big_Integer Big_Integer::signed_add(bool left_negative, const Digits& left,
+				    bool right_negative, const Digits& right)
+{
+  if (left_negative == right_negative)
+    return make(left_negative, add(left, right));
+  if (compare(left, right) >= 0)
+    return make(left_negative, subtract(left, right));
+  return make(right_negative, subtract(right, left));
+}
@@ -0,0 +1,66 @@
+/*
+ * Big_Integer.h
+ */
+#ifndef BIG_INTEGER_H
+#define BIG_INTEGER_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Big_Integer är ett heltal med godtycklig storlek. Värden som ryms i
+ * int64_t lagras direkt och räknas med maskinens heltal, med kontroll av
+ * spill; först när ett resultat inte längre ryms används en vektor av
+ * 32-bitars siffror. Används för exakt evaluering av deluttryck med bara
+ * heltal, se Expression_Tree::exact_value().
+ */
+class Big_Integer
+{
+ public:
+  explicit Big_Integer(std::int64_t value = 0) : small_(value) {}
+
+  // small() är sant om värdet ryms i int64_t; då ger to_int64() det.
+  bool          small() const { return magnitude_.empty(); }
+  std::int64_t  to_int64() const { return small_; }
+  bool          negative() const;
+  // bit_length() är antalet bitar i absolutbeloppet.
+  std::size_t   bit_length() const;
+  // to_long_double() avrundar till närmaste long double.
+  long double   to_long_double() const;
+  std::string   str() const;
+
+  friend Big_Integer operator+(const Big_Integer& left, const Big_Integer& right);
+  friend Big_Integer operator-(const Big_Integer& left, const Big_Integer& right);
+  friend Big_Integer operator*(const Big_Integer& left, const Big_Integer& right);
+  friend bool        operator==(const Big_Integer& left, const Big_Integer& right);
+
+  // power() beräknar base upphöjt till exponent med upprepad kvadrering.
+  static Big_Integer power(Big_Integer base, std::uint64_t exponent);
+  // parse() läser ett tal med bara decimala siffror, som str() skriver det
+  // utan tecken.
+  static Big_Integer parse(std::string_view digits);
+
+ private:
+  using Digits = std::vector<std::uint32_t>;
+
+  // magnitude_ är absolutbeloppet med minst signifikant siffra först, och
+  // tom när värdet ligger i small_.
+  std::int64_t small_{ 0 };
+  bool         negative_{ false };
+  Digits       magnitude_;
+
+  Digits             digits() const;
+  static Big_Integer make(bool negative, Digits magnitude);
+  static int         compare(const Digits& left, const Digits& right);
+  static Digits      add(const Digits& left, const Digits& right);
+  static Digits      subtract(const Digits& left, const Digits& right);
+  static Digits      multiply(const Digits& left, const Digits& right);
+  static Big_Integer signed_add(bool left_negative, const Digits& left,
+                                bool right_negative, const Digits& right);
+};
+
+bool operator!=(const Big_Integer& left, const Big_Integer& right);
+
+#endif
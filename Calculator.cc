@@ -3,14 +3,22 @@
  */
 #include "Calculator.h"
 #include "Expression.h"
+#include "Expression_Archive.h"
+#include "Expression_File.h"
+#include "Metrics.h"
+#include "Parallel_Evaluator.h"
 #include <cctype>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 using namespace std;
 
-const string Calculator::valid_command_("?HUBPTSRANIL");
+const string Calculator::valid_command_("?HUBPTSRANILOEFWGMXD");
 
 
 /**
@@ -22,14 +30,14 @@ Calculator::
 run()
 {
   cout << "Välkommen till Kalkylatorn!\n\n";
-  print_help();
+  print_help(cout);
 
   do 
     {
       try 
 	{
 	  get_command();
-	  if (valid_command()) execute_command();
+	  if (valid_command(cout)) execute_command(cout);
 	}
       catch (const exception& e) 
 	{
@@ -41,28 +49,53 @@ run()
 }
 
 /**
- * print_help() skriver ut kommandorepertoaren.
+ * set_precision() väljer precisionen för de lagrade uttrycken och för alla
+ * som läses in eller skapas senare.
  */
 void
 Calculator::
-print_help() const
+set_precision(Expression::Precision precision)
 {
-  cout << "  H, ?  Skriv ut denna information\n";
-  cout << "  A n   Gör utryck n till aktuellt uttryck\n";
-  cout << "  U     Mata in ett nytt uttryck\n";
-  cout << "  B     Beräkna aktuellt uttryck\n";
-  cout << "  B n   Beräkna uttryck n\n";
-  cout << "  I     Visa aktuellt uttryck som infix\n";
-  cout << "  I n   Visa uttryck n som infix\n";
-  cout << "  L     Lista alla uttryck som infix\n";
-  cout << "  N     Visa antal lagrade uttryck\n"; 
-  cout << "  P     Visa aktuellt uttryck som postfix\n";
-  cout << "  P n   Visa uttryck n som postfix\n";
-  cout << "  R     Radera aktuellt uttryck\n";
-  cout << "  R n   Radera uttryck n\n";
-  cout << "  T     Visa aktuellt uttryck som träd\n";
-  cout << "  T n   Visa uttryck n som ett träd\n";
-  cout << "  S     Avsluta kalkylatorn\n";
+  precision_ = precision;
+  for (auto& expression : expression_)
+    expression.set_precision(precision);
+}
+
+/**
+ * print_help() skriver ut kommandorepertoaren till os.
+ */
+void
+Calculator::
+print_help(ostream& os) const
+{
+  os << "  H, ?  Skriv ut denna information\n";
+  os << "  A n   Gör utryck n till aktuellt uttryck\n";
+  os << "  U     Mata in ett nytt uttryck\n";
+  os << "  B     Beräkna aktuellt uttryck\n";
+  os << "  B n   Beräkna uttryck n\n";
+  os << "  X     Beräkna aktuellt heltalsuttryck exakt\n";
+  os << "  X n   Beräkna heltalsuttryck n exakt\n";
+  os << "  E     Beräkna alla uttryck parallellt\n";
+  os << "  F fil Läs in ett uttryck per rad från filen fil\n";
+  os << "  W fil Skriv alla uttryck binärt till filen fil\n";
+  os << "  G fil Ersätt alla uttryck med dem i den binära filen fil\n";
+  os << "  M     Visa mätvärden för faser och kommandon\n";
+  os << "  M fil Skriv mätvärdena i Prometheus-format till filen fil\n";
+  os << "  I     Visa aktuellt uttryck som infix\n";
+  os << "  I n   Visa uttryck n som infix\n";
+  os << "  L     Lista alla uttryck som infix\n";
+  os << "  N     Visa antal lagrade uttryck\n"; 
+  os << "  O     Optimera aktuellt uttryck och lagra som nytt uttryck\n";
+  os << "  O n   Optimera uttryck n och lagra som nytt uttryck\n";
+  os << "  D x   Derivera aktuellt uttryck m.a.p. x och lagra som nytt uttryck\n";
+  os << "  D n x Derivera uttryck n m.a.p. x och lagra som nytt uttryck\n";
+  os << "  P     Visa aktuellt uttryck som postfix\n";
+  os << "  P n   Visa uttryck n som postfix\n";
+  os << "  R     Radera aktuellt uttryck\n";
+  os << "  R n   Radera uttryck n\n";
+  os << "  T     Visa aktuellt uttryck som träd\n";
+  os << "  T n   Visa uttryck n som ett träd\n";
+  os << "  S     Avsluta kalkylatorn\n";
 }
 
 /**
@@ -77,7 +110,32 @@ get_command()
   cout << ">> ";
   cin >> command_;
   command_ = toupper(command_);
-  const string no_argz("?HLNSU");
+  if (command_ == 'F' || command_ == 'W' || command_ == 'G')
+    {
+      argz = false;
+      cin >> ws;
+      getline(cin, file_name_);
+      return;
+    }
+  if (command_ == 'M')
+    {
+      argz = false;
+      getline(cin, file_name_);
+      file_name_.erase(0, file_name_.find_first_not_of(" \t"));
+      return;
+    }
+  if (command_ == 'D')
+    {
+      cin >> ws;
+      argz = isdigit(cin.peek());
+      if (argz)
+	cin >> num;
+      cin >> ws;
+      getline(cin, variable_);
+      variable_.erase(variable_.find_last_not_of(" \t") + 1);
+      return;
+    }
+  const string no_argz("?HLNSUE");
   if(no_argz.find(command_) != string::npos) argz = false;
   else
     if(cin.peek() != '\n')
@@ -102,23 +160,23 @@ get_command()
  */
 bool
 Calculator::
-valid_command() const
+valid_command(ostream& os) const
 {
   if (valid_command_.find(command_) == string::npos)
     {
-      cout << "Otillåtet kommando: " << command_ << endl;
+      os << "Otillåtet kommando: " << command_ << '\n';
       return false;
     }
-  const string yes_argz{"ABILPRT"};
+  const string yes_argz{"ABILOPRTXD"};
   if(expression_.empty() && yes_argz.find(command_) != string::npos)
     {
-      cout << command_ << " Vectorn är tom, var god och lägg in värden" << endl;
+      os << command_ << " Vectorn är tom, var god och lägg in värden" << '\n';
       return false;
     }
   if(argz){
     if(!(num <= expression_.size()))
       {
-	cout << "Kalkylatorn har endast: " << expression_.size() << " st sparade uttryck" << endl;
+	os << "Kalkylatorn har endast: " << expression_.size() << " st sparade uttryck" << '\n';
 	return false;
       }
   }
@@ -128,13 +186,14 @@ valid_command() const
 /**
  * execute_command() utför kommandot som finns i medlemmen command_. Kommandot
  * förutsätts ha kontrollerats med valid_command() och alltså är ett giltigt 
- * kommando.
+ * kommando. Utskrifterna går till os.
  */
 
 void
 Calculator::
-execute_command()
+execute_command(ostream& os)
 {
+  METRICS_COMMAND(command_);
   int counter = 1;
   int index = curr;
   if(argz)
@@ -143,30 +202,101 @@ execute_command()
 
   switch(command_){
 
-  case 'H' || '?': print_help();
+  case 'H':
+  case '?': print_help(os);
     break;
                        
   case 'U' : read_expression(cin);
     break;
                        
-  case 'B' : cout << expression_.at(index).evaluate() << endl;
+  case 'B' : os << expression_.at(index).evaluate_incremental(environment_) << '\n';
     break;
                        
-  case 'P' : cout << expression_.at(index).get_postfix() << endl;
+  case 'X' : os << expression_.at(index).evaluate_exact().str() << '\n';
+    break;
+
+  case 'P' :
+    expression_.at(index).write_postfix(os);
+    os << '\n';
     break;
                        
-  case 'I' : cout << expression_.at(index).get_infix() << endl;
+  case 'I' :
+    expression_.at(index).write_infix(os);
+    os << '\n';
     break;
                        
-  case 'N' : cout <<" Det finns " << expression_.size()
+  case 'N' : os <<" Det finns " << expression_.size()
 		  <<" sparade utryck\n";
     break;
   case 'A' : curr = index;                      
     break;
 
+  case 'O' :
+    expression_.push_back(expression_.at(index).optimize());
+    curr = expression_.size() - 1;
+    not_last_spot = false;
+    break;
+
+  case 'D' :
+    expression_.push_back(derive(expression_.at(index), variable_));
+    curr = expression_.size() - 1;
+    not_last_spot = false;
+    break;
+
+  case 'E' :
+    {
+      const auto results = evaluate_all(expression_, environment_);
+      for (const auto& result : results)
+	{
+	  os << counter++ << ":  ";
+	  if (result.ok())
+	    os << result.value << '\n';
+	  else
+	    os << "fel " << result.error << (result.error.back() == '\n' ? "" : "\n");
+	}
+    }
+    break;
+
+  case 'F' : load_file(os);
+    break;
+
+  case 'W' :
+    Expression_Archive::write_file(file_name_, expression_);
+    os << "Skrev " << expression_.size() << " uttryck till " << file_name_ << '\n';
+    break;
+
+  case 'G' :
+    {
+      auto restored = Expression_Archive::read_file(file_name_);
+      for (auto& expression : restored)
+	expression.set_precision(precision_);
+      expression_.swap(restored);
+      curr = expression_.empty() ? 0 : expression_.size() - 1;
+      not_last_spot = false;
+      os << "Läste " << expression_.size() << " uttryck från " << file_name_ << '\n';
+    }
+    break;
+
+  case 'M' :
+    if (file_name_.empty())
+      Metrics::report(os);
+    else
+      {
+	ofstream file{ file_name_ };
+	if (!file)
+	  throw runtime_error("Kan inte öppna " + file_name_);
+	Metrics::write_prometheus(file);
+	os << "Skrev mätvärden till " << file_name_ << '\n';
+      }
+    break;
+
   case 'L' : 
     for(const auto & i: expression_)
-      cout << counter++ << ":  " << i.get_infix() << endl;
+      {
+	os << counter++ << ":  ";
+	i.write_infix(os);
+	os << '\n';
+      }
     break;
                        
   case 'R' :
@@ -181,13 +311,13 @@ execute_command()
     }
     break;
                        
-  case 'T' : expression_.at(index).print_tree(cout);
+  case 'T' : expression_.at(index).print_tree(os);
     break;
                        
-  case 'S' : cout << "Kalkylatorn avlutas, välkommen åter!\n";
+  case 'S' : os << "Kalkylatorn avlutas, välkommen åter!\n";
     break;
                 
-  default: cout << "Skall inte hända!"<< endl;
+  default: os << "Skall inte hända!"<< '\n';
     break;                  
   }
 }
@@ -206,9 +336,7 @@ read_expression(istream& is)
 
   if (getline(is, infix))
     {
-      expression_.push_back( make_expression(infix));
-      curr=expression_.size()-1;
-      not_last_spot=false;
+      store_expression(infix);
     }
   else
     {
@@ -216,5 +344,190 @@ read_expression(istream& is)
     }
 }
 
+/**
+ * store_expression() skapar ett uttryck av infix och lagrar det som aktuellt
+ * uttryck.
+ */
+void
+Calculator::
+store_expression(string_view infix)
+{
+  expression_.push_back( make_expression(infix));
+  expression_.back().set_precision(precision_);
+  curr=expression_.size()-1;
+  not_last_spot=false;
+}
+
+/**
+ * load_file() läser in alla uttryck i filen file_name_ och skriver hur
+ * snabbt det gick. Det sista inlästa uttrycket blir aktuellt.
+ */
+void
+Calculator::
+load_file(ostream& os)
+{
+  const size_t first = expression_.size();
+  const Load_Report report = load_expressions(file_name_, expression_);
+  for (size_t i = first; i < expression_.size(); ++i)
+    expression_[i].set_precision(precision_);
+  if (report.expressions > 0)
+    {
+      curr = expression_.size() - 1;
+      not_last_spot = false;
+    }
+
+  os << "Läste " << report.expressions << " uttryck (" << report.bytes
+     << " byte) på " << report.seconds << " s: "
+     << report.bytes_per_second() / 1e6 << " MB/s, "
+     << report.expressions_per_second() << " uttryck/s\n";
+
+  constexpr size_t shown = 10;
+  for (size_t i = 0; i < report.failures.size() && i < shown; ++i)
+    os << "fel rad " << report.failures[i].first << ": "
+       << report.failures[i].second << '\n';
+  if (report.failures.size() > shown)
+    os << "... och " << report.failures.size() - shown << " fel till\n";
+}
+
+/**
+ * run_batch() kör kalkylatorn utan dialog. Indata läses i stora block och
+ * delas i rader utan kopiering; utdata samlas i en stor buffert. Varje rad
+ * är antingen ett kommando (en versal eller '?', eventuellt följd av ett
+ * nummer) eller ett infixuttryck, som lagras och beräknas. Tomma rader
+ * hoppas över. För ett uttryck skrivs "ok <värde>"; ett fel skrivs som
+ * "fel <radnummer>: <meddelande>" och körningen fortsätter. H och ? ger
+ * ett fel, eftersom hjälptexten hör till dialogen. S avslutar.
+ */
+void
+Calculator::
+run_batch(istream& is, ostream& os)
+{
+  constexpr size_t block_size = 1 << 20;
+  vector<char> block(block_size);
+  string pending;
+  string output;
+  output.reserve(2 * block_size);
+  size_t number = 0;
+
+  auto flush = [&]()
+    {
+      os.write(output.data(), static_cast<streamsize>(output.size()));
+      output.clear();
+    };
+
+  command_ = '\0';
+  while (command_ != 'S' && is)
+    {
+      is.read(block.data(), block_size);
+      string_view text{ block.data(), static_cast<size_t>(is.gcount()) };
+
+      while (command_ != 'S')
+	{
+	  const size_t end = text.find('\n');
+	  if (end == string_view::npos)
+	    {
+	      pending.append(text);
+	      break;
+	    }
+	  if (pending.empty())
+	    batch_line(text.substr(0, end), ++number, output);
+	  else
+	    {
+	      pending.append(text.substr(0, end));
+	      batch_line(pending, ++number, output);
+	      pending.clear();
+	    }
+	  text.remove_prefix(end + 1);
+	}
+
+      if (output.size() >= block_size)
+	flush();
+    }
+
+  if (command_ != 'S' && !pending.empty())
+    batch_line(pending, ++number, output);
+  flush();
+  os.flush();
+}
+
+/**
+ * batch_line() utför en rad i run_batch() och lägger resultatet i output.
+ */
+void
+Calculator::
+batch_line(string_view line, size_t number, string& output)
+{
+  while (!line.empty() && isspace(static_cast<unsigned char>(line.front())))
+    line.remove_prefix(1);
+  while (!line.empty() && isspace(static_cast<unsigned char>(line.back())))
+    line.remove_suffix(1);
+  if (line.empty())
+    return;
+
+  const char first = line.front();
+  try
+    {
+      if (isupper(static_cast<unsigned char>(first)) || first == '?')
+	{
+	  command_ = first;
+	  line.remove_prefix(1);
+	  while (!line.empty() && isspace(static_cast<unsigned char>(line.front())))
+	    line.remove_prefix(1);
+
+	  // Hjälptexten hör till dialogen och ges inte i batchläge.
+	  if (command_ == 'H' || command_ == '?')
+	    {
+	      output += "fel " + to_string(number) + ": Ingen hjälp i batchläge\n";
+	      return;
+	    }
+	  // U följs av uttrycket och F, W, G och M av filnamnet på samma rad.
+	  if (command_ == 'U')
+	    {
+	      store_expression(line);
+	      output += "ok\n";
+	      return;
+	    }
+	  if (command_ == 'F' || command_ == 'W' || command_ == 'G' || command_ == 'M')
+	    {
+	      file_name_ = line;
+	      argz = false;
+	    }
+	  else
+	    {
+	      argz = !line.empty() && isdigit(static_cast<unsigned char>(line.front()));
+	      if (argz)
+		num = static_cast<unsigned>(stoul(string{ line }));
+	      // D har variabeln sist, efter ett eventuellt uttrycksnummer.
+	      if (command_ == 'D')
+		{
+		  const size_t start = line.find_first_not_of("0123456789 \t");
+		  variable_ = start == string_view::npos ? "" : string{ line.substr(start) };
+		}
+	    }
+
+	  ostringstream result;
+	  if (valid_command(result))
+	    execute_command(result);
+	  else
+	    output += "fel " + to_string(number) + ": ";
+	  output += result.str();
+	  return;
+	}
+
+      store_expression(line);
+      char value[64];
+      snprintf(value, sizeof value, "ok %.6Lg\n",
+	       expression_.back().evaluate(environment_));
+      output += value;
+    }
+  catch (const exception& e)
+    {
+      string message{ e.what() };
+      if (!message.empty() && message.back() == '\n')
+	message.pop_back();
+      output += "fel " + to_string(number) + ": " + message + '\n';
+    }
+}
+
 
 
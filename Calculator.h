@@ -5,6 +5,8 @@
 #define CALCULATOR_H
 #include "Expression.h"
 #include <iosfwd>
+#include <string>
+#include <string_view>
 #include <vector>
 /**
  * Calculator r en klass fr hantering av enkla aritmetiska uttryck.
@@ -18,27 +20,38 @@ class Calculator
   Calculator& operator=(const Calculator&) = delete;
 
   void run();
+  void run_batch(std::istream& is, std::ostream& os);
+  // set_precision() anger precisionen for alla uttryck som lagras.
+  void set_precision(Expression::Precision precision);
 
  private:
 
   static const std::string valid_command_;
   std:: vector <Expression> expression_; 
+  Environment environment_;
+  Expression::Precision precision_{ Expression::Precision::Long_Double };
 
   bool argz = false;
   bool not_last_spot;
-  bool valid_command() const;
+  bool valid_command(std::ostream& os) const;
 
   char command_;
   unsigned  curr = 0;
   unsigned num=0;
+  std::string file_name_;
+  // variable_ ar variabeln i kommandot D.
+  std::string variable_;
 
-  void print_help() const;
+  void print_help(std::ostream& os) const;
   void get_command();
-  void execute_command();
+  void execute_command(std::ostream& os);
 
 
 
   void read_expression(std::istream&);
+  void store_expression(std::string_view infix);
+  void load_file(std::ostream& os);
+  void batch_line(std::string_view line, std::size_t number, std::string& output);
 };
 
 #endif
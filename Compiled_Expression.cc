@@ -0,0 +1,248 @@
+/*
+ * Compiled_Expression.cc
+ */
+#include "Compiled_Expression.h"
+#include "Environment.h"
+#include "Expression_Tree.h"
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+using namespace std;
+
+long double Compiled_Expression::evaluate() const
+{
+  return evaluate(Environment::global());
+}
+
+/*
+ * evaluate() tolkar bytekoden mot en värdestack. Stacken är trådlokal och
+ * återanvänds mellan anropen.
+ */
+long double Compiled_Expression::evaluate(Environment& environment) const
+{
+  if (empty())
+    throw expression_tree_error("Kan inte evaluera en tom bytekod");
+
+  thread_local vector<long double> stack;
+  thread_local vector<long double> temporaries;
+  if (stack.size() < max_depth_)
+    stack.resize(max_depth_);
+  if (temporaries.size() < temporaries_)
+    temporaries.resize(temporaries_);
+
+  environment.resize(slots_);
+  for (size_t slot : stored_)
+    environment.touch(slot);
+  long double* const variables = environment.data();
+  long double* top = stack.data() - 1;
+
+  for (const Instruction& instruction : code_)
+    {
+      switch (instruction.op)
+	{
+	case Opcode::Constant:
+	  *++top = constants_[instruction.arg];
+	  break;
+	case Opcode::Load:
+	  *++top = variables[instruction.arg];
+	  break;
+	case Opcode::Store:
+	  variables[instruction.arg] = *top;
+	  break;
+	case Opcode::Add:
+	  top[-1] += top[0];
+	  --top;
+	  break;
+	case Opcode::Subtract:
+	  top[-1] -= top[0];
+	  --top;
+	  break;
+	case Opcode::Multiply:
+	  top[-1] *= top[0];
+	  --top;
+	  break;
+	case Opcode::Divide:
+	  if (top[0] == 0)
+	    throw expression_tree_error("Division med 0");
+	  top[-1] /= top[0];
+	  --top;
+	  break;
+	case Opcode::Power:
+	  top[-1] = pow(top[-1], top[0]);
+	  --top;
+	  break;
+	case Opcode::Save:
+	  temporaries[instruction.arg] = *top;
+	  break;
+	case Opcode::Recall:
+	  *++top = temporaries[instruction.arg];
+	  break;
+	case Opcode::Fail:
+	  throw expression_tree_error(errors_[instruction.arg]);
+	}
+    }
+  return *top;
+}
+
+bool Compiled_Expression::empty() const
+{
+  return code_.empty();
+}
+
+size_t Compiled_Expression::size() const
+{
+  return code_.size();
+}
+
+/*
+ * emit_root() kompilerar ett helt uttryck. Delade deluttryck återanvänds
+ * bara om inga tilldelningar kan ändra dem, se Expression_Tree::reusable().
+ */
+void Compiled_Expression::emit_root(const Expression_Tree* root)
+{
+  reuse_ = root->reusable();
+  emit_tree(root);
+}
+
+/*
+ * emit_tree() kompilerar ett deluttryck i postordning med en egen stack.
+ * Ett delat deluttryck kompileras bara första gången; därefter hämtas det
+ * sparade värdet. Deluttryck med bara heltal beräknas exakt redan här och
+ * blir en konstant, som i trädet.
+ */
+void Compiled_Expression::emit_tree(const Expression_Tree* root)
+{
+  // Ett steg är 0 före vänster barn, 1 före höger och 2 efter.
+  struct Frame
+  {
+    const Binary_Operator* node;
+    int                    step;
+  };
+  vector<Frame> frames;
+
+  // save() sparar värdet av ett delat deluttryck för senare användning.
+  auto save = [this](const Expression_Tree* node)
+    {
+      if (reuse_ && node->shared())
+	{
+	  const auto temporary = static_cast<uint32_t>(temporaries_++);
+	  push(Opcode::Save, temporary);
+	  saved_.emplace(node, temporary);
+	}
+    };
+
+  auto enter = [&](const Expression_Tree* node)
+    {
+      if (node->kind() < Node_Kind::Plus)
+	{
+	  node->compile(*this);
+	  return;
+	}
+      if (reuse_ && node->shared())
+	{
+	  auto it = saved_.find(node);
+	  if (it != saved_.end())
+	    {
+	      push(Opcode::Recall, it->second);
+	      return;
+	    }
+	}
+      if (node->integral())
+	{
+	  emit_constant(node->exact_value<long double>());
+	  save(node);
+	  return;
+	}
+      auto binary = static_cast<const Binary_Operator*>(node);
+      if (node->kind() == Node_Kind::Assign && binary->left()->kind() != Node_Kind::Variable)
+	{
+	  emit_error(Assign::invalid_target);
+	  return;
+	}
+      // Vänsterledet i en tilldelning kompileras inte.
+      frames.push_back({ binary, node->kind() == Node_Kind::Assign ? 1 : 0 });
+    };
+
+  enter(root);
+  while (!frames.empty())
+    {
+      const Binary_Operator* node = frames.back().node;
+      const int step = frames.back().step++;
+      if (step < 2)
+	{
+	  enter(step == 0 ? node->left() : node->right());
+	  continue;
+	}
+      frames.pop_back();
+
+      switch (node->kind())
+	{
+	case Node_Kind::Plus:   emit_operator(Opcode::Add);      break;
+	case Node_Kind::Minus:  emit_operator(Opcode::Subtract); break;
+	case Node_Kind::Times:  emit_operator(Opcode::Multiply); break;
+	case Node_Kind::Divide: emit_operator(Opcode::Divide);   break;
+	case Node_Kind::Power:  emit_operator(Opcode::Power);    break;
+	default:
+	  emit_store(static_cast<const Variable*>(node->left())->get_slot());
+	  break;
+	}
+
+      save(node);
+    }
+}
+
+void Compiled_Expression::emit_constant(long double value)
+{
+  push(Opcode::Constant, constants_.size());
+  constants_.push_back(value);
+}
+
+void Compiled_Expression::emit_load(size_t slot)
+{
+  push(Opcode::Load, slot);
+  slots_ = max(slots_, slot + 1);
+}
+
+void Compiled_Expression::emit_store(size_t slot)
+{
+  push(Opcode::Store, slot);
+  slots_ = max(slots_, slot + 1);
+  stored_.push_back(slot);
+}
+
+void Compiled_Expression::emit_operator(Opcode op)
+{
+  push(op, 0);
+}
+
+/*
+ * emit_error() lägger in ett fel som kastas först när koden evalueras,
+ * precis som i trädevalueringen. Felet tar stackens plats för ett värde.
+ */
+void Compiled_Expression::emit_error(const string& message)
+{
+  push(Opcode::Fail, errors_.size());
+  errors_.push_back(message);
+}
+
+void Compiled_Expression::push(Opcode op, size_t arg)
+{
+  code_.push_back({ op, static_cast<uint32_t>(arg) });
+
+  switch (op)
+    {
+    case Opcode::Constant:
+    case Opcode::Load:
+    case Opcode::Recall:
+    case Opcode::Fail:
+      max_depth_ = max(max_depth_, ++depth_);
+      break;
+    case Opcode::Store:
+    case Opcode::Save:
+      break;
+    default:
+      --depth_;
+      break;
+    }
+}
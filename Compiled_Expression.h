@@ -0,0 +1,84 @@
+/*
+ * Compiled_Expression.h
+ */
+#ifndef COMPILED_EXPRESSION_H
+#define COMPILED_EXPRESSION_H
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Environment;
+class Expression;
+class Expression_Tree;
+
+/**
+ * Opcode anger instruktionerna i den linjära bytekoden. Alla instruktioner
+ * arbetar mot en värdestack; binära operationer tar två värden och lägger
+ * tillbaka resultatet.
+ */
+enum class Opcode : std::uint8_t
+{
+  Constant,   // push constants_[arg]
+  Load,       // push värdet av variabeln på slot arg
+  Store,      // tilldela variabeln på slot arg stackens topp, som ligger kvar
+  Add,
+  Subtract,
+  Multiply,
+  Divide,
+  Power,
+  Save,       // spara stackens topp, som ligger kvar, i temporär arg
+  Recall,     // push temporär arg
+  Fail        // kasta expression_tree_error(errors_[arg])
+};
+
+struct Instruction
+{
+  Opcode        op;
+  std::uint32_t arg;
+};
+
+/**
+ * Compiled_Expression är ett uttrycksträd översatt till bytekod i postfix-
+ * ordning, som evalueras i en enda slinga utan rekursion och virtuella anrop.
+ * Variabler läses och skrivs direkt i en Environment via sina slots.
+ * Delade deluttryck beräknas en gång och sparas i en temporär.
+ */
+class Compiled_Expression
+{
+ public:
+  Compiled_Expression() = default;
+
+  long double evaluate() const;
+  long double evaluate(Environment& environment) const;
+  bool        empty() const;
+  std::size_t size() const;
+
+  // Används av Expression och av noderna i Expression_Tree vid kompileringen.
+  void emit_root(const Expression_Tree* root);
+  void emit_tree(const Expression_Tree* node);
+  void emit_constant(long double value);
+  void emit_load(std::size_t slot);
+  void emit_store(std::size_t slot);
+  void emit_operator(Opcode op);
+  void emit_error(const std::string& message);
+
+ private:
+  friend class Jit_Expression;
+  friend class Batch_Evaluator;
+
+  std::vector<Instruction>     code_;
+  std::vector<long double>     constants_;
+  std::vector<std::string>     errors_;
+  std::unordered_map<const Expression_Tree*, std::uint32_t> saved_;
+  std::vector<std::size_t>     stored_;
+  bool        reuse_{ true };
+  std::size_t slots_{ 0 };
+  std::size_t temporaries_{ 0 };
+  std::size_t depth_{ 0 };
+  std::size_t max_depth_{ 0 };
+
+  void push(Opcode op, std::size_t arg);
+};
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ * Environment.cc
+ */
+#include "Environment.h"
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+using namespace std;
+
+namespace
+{
+  // Namnen lagras i en deque så att referenser till dem aldrig flyttas.
+  struct Symbols
+  {
+    mutex                                  lock;
+    deque<string>                          names;
+    unordered_map<string_view, size_t>     slots;
+  };
+
+  Symbols& symbols()
+  {
+    static Symbols instance;
+    return instance;
+  }
+
+  uint64_t next_environment_id()
+  {
+    static atomic<uint64_t> next{ 1 };
+    return next.fetch_add(1, memory_order_relaxed);
+  }
+}
+
+/*
+ * intern() returnerar namnets slot och lägger till namnet om det är nytt.
+ */
+size_t Symbol_Table::intern(string_view name)
+{
+  auto& table = symbols();
+  lock_guard<mutex> guard{ table.lock };
+
+  auto it = table.slots.find(name);
+  if (it != table.slots.end())
+    return it->second;
+
+  table.names.emplace_back(name);
+  const size_t slot = table.names.size() - 1;
+  table.slots.emplace(table.names.back(), slot);
+  return slot;
+}
+
+string_view Symbol_Table::name(size_t slot)
+{
+  auto& table = symbols();
+  lock_guard<mutex> guard{ table.lock };
+  return table.names.at(slot);
+}
+
+size_t Symbol_Table::size()
+{
+  auto& table = symbols();
+  lock_guard<mutex> guard{ table.lock };
+  return table.names.size();
+}
+
+Environment::Environment()
+  : id_(next_environment_id())
+{
+}
+
+/*
+ * En kopia får ett nytt id, så att delresultat som sparats för originalet
+ * inte används för kopian.
+ */
+Environment::Environment(const Environment& other)
+  : values_(other.values_), id_(next_environment_id()),
+    clock_(other.clock_), last_group_(other.last_group_), changed_(other.changed_)
+{
+}
+
+Environment& Environment::operator=(const Environment& other)
+{
+  values_ = other.values_;
+  id_ = next_environment_id();
+  clock_ = other.clock_;
+  last_group_ = other.last_group_;
+  changed_ = other.changed_;
+  return *this;
+}
+
+long double Environment::get(size_t slot) const
+{
+  return slot < values_.size() ? values_[slot] : 0.0L;
+}
+
+void Environment::set(size_t slot, long double value)
+{
+  if (slot >= values_.size())
+    values_.resize(slot + 1);
+  values_[slot] = value;
+  touch(slot);
+}
+
+long double Environment::get(string_view name) const
+{
+  return get(Symbol_Table::intern(name));
+}
+
+void Environment::set(string_view name, long double value)
+{
+  set(Symbol_Table::intern(name), value);
+}
+
+/*
+ * resize() ser till att minst slots värden finns, så att data() kan
+ * indexeras direkt med varje slot under slots.
+ */
+void Environment::resize(size_t slots)
+{
+  if (slots > values_.size())
+    values_.resize(slots);
+}
+
+size_t Environment::size() const
+{
+  return values_.size();
+}
+
+long double* Environment::data()
+{
+  return values_.data();
+}
+
+void Environment::touch(size_t slot)
+{
+  last_group_ = slot % changed_.size();
+  changed_[last_group_] = ++clock_;
+}
+
+uint64_t Environment::id() const
+{
+  return id_;
+}
+
+uint64_t Environment::clock() const
+{
+  return clock_;
+}
+
+bool Environment::unchanged_since(uint64_t stamp, uint64_t mask) const
+{
+  if (clock_ == stamp)
+    return true;
+  // Oftast har bara en variabel ändrats sedan förra evalueringen.
+  if ((mask & (uint64_t{ 1 } << last_group_)) != 0)
+    return false;
+  for (; mask != 0; mask &= mask - 1)
+    if (changed_[__builtin_ctzll(mask)] > stamp)
+      return false;
+  return true;
+}
+
+uint64_t Environment::mask(size_t slot)
+{
+  return uint64_t{ 1 } << (slot % 64);
+}
+
+/*
+ * global() är den miljö som används när ingen anges.
+ */
+Environment& Environment::global()
+{
+  static Environment instance;
+  return instance;
+}
@@ -0,0 +1,73 @@
+/*
+ * Environment.h
+ */
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Symbol_Table översätter variabelnamn till heltalsindex (slots). Tabellen
+ * är gemensam för hela programmet, så samma namn får samma slot i alla
+ * uttryck. Operationerna är trådsäkra.
+ */
+class Symbol_Table
+{
+ public:
+  Symbol_Table() = delete;
+
+  static std::size_t      intern(std::string_view name);
+  static std::string_view name(std::size_t slot);
+  static std::size_t      size();
+};
+
+/**
+ * Environment är en uppsättning variabelvärden, indexerade med slot.
+ * Variabler som aldrig tilldelats har värdet 0. Olika Environment-objekt
+ * kan användas för att evaluera samma uttryck med olika värden.
+ *
+ * Miljön räknar sina ändringar, så att inkrementell evaluering kan se om
+ * ett sparat delresultat fortfarande gäller. Varje slot hör till en av 64
+ * grupper (slot % 64); för varje grupp sparas när någon av dess variabler
+ * senast ändrades. Varje miljö har ett eget id, även en kopia.
+ */
+class Environment
+{
+ public:
+  Environment();
+  Environment(const Environment& other);
+  Environment& operator=(const Environment& other);
+
+  long double get(std::size_t slot) const;
+  void        set(std::size_t slot, long double value);
+  long double get(std::string_view name) const;
+  void        set(std::string_view name, long double value);
+
+  void         resize(std::size_t slots);
+  std::size_t  size() const;
+  // Den som skriver direkt via data() ska anropa touch() för varje slot.
+  long double* data();
+  void         touch(std::size_t slot);
+
+  std::uint64_t id() const;
+  std::uint64_t clock() const;
+  // unchanged_since() är sant om ingen variabel i någon av grupperna i
+  // mask har ändrats efter tidpunkten stamp (ett tidigare värde på clock()).
+  bool          unchanged_since(std::uint64_t stamp, std::uint64_t mask) const;
+
+  static std::uint64_t mask(std::size_t slot);
+  static Environment&  global();
+
+ private:
+  std::vector<long double>       values_;
+  std::uint64_t                  id_;
+  std::uint64_t                  clock_{ 0 };
+  std::size_t                    last_group_{ 0 };
+  std::array<std::uint64_t, 64>  changed_{};
+};
+
+#endif
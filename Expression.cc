@@ -2,16 +2,19 @@
  * Expression.cc
  */
 #include "Expression.h"
+#include "Expression_Archive.h"
 #include "Expression_Tree.h"
-#include <algorithm>
-#include <cstdlib>
+#include "Flat_Expression.h"
+#include "Metrics.h"
+#include "Node_Pool.h"
+#include "Parse_Cache.h"
+#include <cctype>
+#include <charconv>
 #include <iostream>
-#include <iterator>
-#include <map>
-#include <sstream>
-#include <stack>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 using namespace std;
 
@@ -20,29 +23,28 @@ class expression_error : public std::logic_error
 public:
   explicit expression_error(const std::string& what_arg) 
     :   logic_error(what_arg) 
-  {}
+  {
+    METRICS_COUNT(Exceptions);
+  }
 
   explicit expression_error(const char* what_arg) noexcept
     :   logic_error(what_arg) 
-  {}
+  {
+    METRICS_COUNT(Exceptions);
+  }
 };
 /*
- *kopieringskonstruktor 
+ *kopieringskonstruktor. Noderna ändras aldrig efter att de skapats, så
+ *kopian delar träd och pool med originalet och kostar bara en referens.
  */
 Expression::Expression(const Expression & other)
+  : pool_(other.pool_), root_(other.root_), precision_(other.precision_)
 {
-  if (!other.empty()) {
-    root_ = other.root_->clone();
-  }
 }
 /*kopieringstilldelning */
 Expression & Expression::operator=(const Expression & right) & 
 {
-  if(this != &right) 
-  {
-  	delete root_;
-    root_ = right.root_->clone();         
-  }
+  Expression{right}.swap(*this);
   return *this;
 }
 /*flyttkonstruktor */
@@ -59,49 +61,334 @@ Expression & Expression::operator=( Expression && right) & noexcept
   return *this;
 }
 
-Expression::~Expression()
-{
-  delete root_;
-}
+/*
+ * Noderna ligger i pool_ och frigörs med den, utan rekursion.
+ */
+Expression::~Expression() = default;
 
 void Expression:: clear() & noexcept
 {
-  delete root_;
+  pool_.reset();
   root_ = nullptr;
 }
 
 /*
- * evaluate()
+ * evaluate() använder den globala miljön för variablernas värden.
  */
 long double Expression::evaluate() const
 {
-   
+  return evaluate(Environment::global());
+}
+
+/*
+ * evaluate(environment) räknar i uttryckets precision, se set_precision().
+ */
+long double Expression::evaluate(Environment& environment) const
+{
+  switch (precision_)
+    {
+    case Precision::Float:
+      return evaluate<float>(environment);
+    case Precision::Double:
+      return evaluate<double>(environment);
+    default:
+      return evaluate<long double>(environment);
+    }
+}
+
+template <typename T>
+T Expression::evaluate() const
+{
+  return evaluate<T>(Environment::global());
+}
+
+template <typename T>
+T Expression::evaluate(Environment& environment) const
+{
+  if (empty()) {
+    throw expression_error("Kan inte evaluera ett tomt uttryck");
+  }
+
+  METRICS_TIME(Evaluate);
+  Evaluation_Scope scope{ root_->reusable() ? Evaluation_Scope::Mode::Memoized
+                                             : Evaluation_Scope::Mode::Direct };
+  return root_->value<T>(environment);
+}
+
+template float       Expression::evaluate<float>() const;
+template double      Expression::evaluate<double>() const;
+template long double Expression::evaluate<long double>() const;
+template float       Expression::evaluate<float>(Environment&) const;
+template double      Expression::evaluate<double>(Environment&) const;
+template long double Expression::evaluate<long double>(Environment&) const;
+
+/*
+ * evaluate_exact() räknar med Big_Integer, utan avrundning. Uttrycket får
+ * inte ha variabler, reella tal eller division, och varje exponent måste
+ * vara icke-negativ.
+ */
+Big_Integer Expression::evaluate_exact() const
+{
+  if (empty()) {
+    throw expression_error("Kan inte evaluera ett tomt uttryck");
+  }
+
+  METRICS_TIME(Evaluate);
+  Big_Integer result;
+  if (!root_->exact(result)) {
+    throw expression_error("Uttrycket har inget exakt heltalsvärde");
+  }
+  return result;
+}
+
+Expression::Precision Expression::precision() const
+{
+  return precision_;
+}
+
+/*
+ * set_precision() väljer typen för evaluate() och evaluate_incremental().
+ * compile() och Jit_Expression räknar alltid i long double.
+ */
+void Expression::set_precision(Precision precision)
+{
+  precision_ = precision;
+}
+
+/*
+ * evaluate_incremental() återanvänder delresultat från förra evalueringen
+ * i samma miljö för deluttryck vars variabler inte har ändrats sedan dess.
+ * När en variabel ändras beräknas bara vägen från den till roten om.
+ * Delresultaten sparas i noderna, så två trådar får inte evaluera
+ * inkrementellt samtidigt i uttryck som delar pool. Delresultaten är
+ * long double, så med lägre precision evalueras hela uttrycket.
+ */
+long double Expression::evaluate_incremental(Environment& environment) const
+{
+  if (precision_ != Precision::Long_Double)
+    return evaluate(environment);
   if (empty()) {
     throw expression_error("Kan inte evaluera ett tomt uttryck");
   }
 
-  return root_->evaluate();
+  METRICS_TIME(Evaluate);
+  Evaluation_Scope scope{ Evaluation_Scope::Mode::Incremental };
+  return root_->value(environment);
+}
+
+/*
+ * compile() översätter trädet till bytekod, se Compiled_Expression.
+ */
+Compiled_Expression Expression::compile() const
+{
+  if (empty()) {
+    throw expression_error("Kan inte kompilera ett tomt uttryck");
+  }
+
+  METRICS_TIME(Compile);
+  Compiled_Expression program;
+  program.emit_root(root_);
+  return program;
+}
+
+Expression::Tape::Tape() = default;
+Expression::Tape::~Tape() = default;
+Expression::Tape::Tape(Tape&&) noexcept = default;
+Expression::Tape& Expression::Tape::operator=(Tape&&) noexcept = default;
+
+long double Expression::gradient(Environment& environment,
+                                 vector<long double>& partials) const
+{
+  Tape tape;
+  return gradient(environment, partials, tape);
+}
+
+/*
+ * gradient() använder uttryckets Flat_Expression som band. Bandet känner
+ * igen uttrycket på roten och poolen; poolen hålls med en weak_ptr, så att
+ * bandet inte håller den vid liv, och en ny pool på samma adress har ett
+ * annat kontrollblock och känns inte igen.
+ */
+long double Expression::gradient(Environment& environment,
+                                 vector<long double>& partials, Tape& tape) const
+{
+  if (empty()) {
+    throw expression_error("Kan inte derivera ett tomt uttryck");
+  }
+
+  METRICS_TIME(Evaluate);
+  if (!tape.flat_ || tape.root_ != root_ ||
+      tape.pool_.owner_before(pool_) || pool_.owner_before(tape.pool_))
+    {
+      tape.flat_ = make_unique<Flat_Expression>(flatten());
+      tape.pool_ = pool_;
+      tape.root_ = root_;
+    }
+  return tape.flat_->gradient(environment, partials);
+}
+
+/*
+ * flatten() lägger trädet i en sammanhängande nodvektor, se Flat_Expression.
+ */
+Flat_Expression Expression::flatten() const
+{
+  if (empty()) {
+    throw expression_error("Kan inte platta till ett tomt uttryck");
+  }
+
+  Flat_Expression flat;
+  flat.build(root_);
+  return flat;
+}
+
+/*
+ * optimize() returnerar ett nytt uttryck där konstanta deluttryck är
+ * beräknade och triviala operationer (x + 0, x * 1, x ^ 1 ...) borttagna.
+ * Det ursprungliga uttrycket lämnas orört; det nya delar dess pool och
+ * därmed alla noder som inte ändrats.
+ */
+Expression Expression::optimize() const
+{
+  if (empty()) {
+    throw expression_error("Kan inte optimera ett tomt uttryck");
+  }
+
+  Expression result;
+  result.pool_ = pool_;
+  result.precision_ = precision_;
+  auto lock = pool_->lock();
+  result.root_ = root_->optimize(*pool_);
+  return result;
+}
+
+Expression Expression::rebalance() const
+{
+  if (empty()) {
+    throw expression_error("Kan inte balansera ett tomt uttryck");
+  }
+
+  Expression result;
+  result.pool_ = pool_;
+  result.precision_ = precision_;
+  auto lock = pool_->lock();
+  result.root_ = root_->rebalance(*pool_);
+  pool_->mark_shared(result.root_);
+  return result;
+}
+
+/*
+ * derive() deriverar uttrycket, eller högerledet om roten är en
+ * tilldelning; derivatan tilldelas inget. Andra tilldelningar kan ändra
+ * en variabel mitt i uttrycket och ger fel.
+ */
+Expression derive(const Expression& expression, const string& variable)
+{
+  if (expression.empty()) {
+    throw expression_error("Kan inte derivera ett tomt uttryck");
+  }
+  if (variable.empty() || variable.find_first_not_of("abcdefghijklmnopqrstuvwxyz") != string::npos) {
+    throw expression_error("Ogiltigt variabelnamn: " + variable);
+  }
+
+  const Expression_Tree* root = expression.root_;
+  if (root->kind() == Node_Kind::Assign)
+    root = static_cast<const Binary_Operator*>(root)->right();
+  if (!root->pure()) {
+    throw expression_error("Kan inte derivera ett uttryck med tilldelningar");
+  }
+
+  Expression result;
+  result.pool_ = expression.pool_;
+  result.precision_ = expression.precision_;
+  auto lock = expression.pool_->lock();
+  result.root_ = root->derive(Symbol_Table::intern(variable), *expression.pool_);
+  expression.pool_->mark_shared(result.root_);
+  return result;
 }
 
 /*
  * get_postfix()
  */
 string Expression::get_postfix() const
+{
+  string result;
+  write_postfix(result);
+  return result;
+}
+
+string Expression::get_infix() const
+{
+  string result;
+  write_infix(result);
+  return result;
+}
+
+void Expression::write_postfix(string& out) const
 {
   if (empty()) {
     throw expression_error("Kan inte hämta postfix för ett tomt uttryck");
   }
 
-  return root_->get_postfix();
+  METRICS_TIME(Render);
+  root_->write_postfix(out);
 }
 
-string Expression::get_infix() const
+void Expression::write_postfix(ostream& os) const
+{
+  if (empty()) {
+    throw expression_error("Kan inte hämta postfix för ett tomt uttryck");
+  }
+
+  METRICS_TIME(Render);
+  root_->write_postfix(os);
+}
+
+void Expression::write_infix(string& out) const
+{
+  if (empty()) {
+    throw expression_error("Kan inte hämta infix för ett tomt uttryck");
+  }
+
+  METRICS_TIME(Render);
+  root_->write_infix(out);
+}
+
+void Expression::write_infix(ostream& os) const
 {
   if (empty()) {
     throw expression_error("Kan inte hämta infix för ett tomt uttryck");
   }
 
-  return root_->get_infix();
+  METRICS_TIME(Render);
+  root_->write_infix(os);
+}
+
+/*
+ * hash() är trädets strukturella hash, som lagras i noderna när de skapas.
+ */
+size_t Expression::hash() const
+{
+  return empty() ? 0 : root_->hash();
+}
+
+/*
+ * equal() jämför uttrycken strukturellt, se Node_Pool::equivalent().
+ */
+bool Expression::equal(const Expression& other) const
+{
+  if (empty() || other.empty())
+    return empty() && other.empty();
+  return Node_Pool::equivalent(root_, other.root_);
+}
+
+bool operator==(const Expression& left, const Expression& right)
+{
+  return left.equal(right);
+}
+
+bool operator!=(const Expression& left, const Expression& right)
+{
+  return !left.equal(right);
 }
 
 /*
@@ -112,6 +399,14 @@ bool Expression::empty() const
   return root_ == nullptr;
 }
 
+/*
+ * pure() är sant om uttrycket inte innehåller någon tilldelning.
+ */
+bool Expression::pure() const
+{
+  return empty() || root_->pure();
+}
+
 /*
  * print_tree()
  */
@@ -119,8 +414,17 @@ void Expression::print_tree(std::ostream& os) const
 {
   if (empty())
     throw expression_error("Trädet är tomt");
-  else
-    root_->print(os);
+
+  METRICS_TIME(Render);
+  root_->print(os);
+}
+
+/*
+ * save()
+ */
+void Expression::save(std::ostream& os) const
+{
+  Expression_Archive::write(os, *this);
 }
 
 /*
@@ -128,7 +432,9 @@ void Expression::print_tree(std::ostream& os) const
  */
 void Expression::swap(Expression& other) noexcept
 {
+  pool_.swap(other.pool_);
   std::swap(root_, other.root_);
+  std::swap(precision_, other.precision_);
 }
 
 /*
@@ -140,332 +446,445 @@ void swap(Expression& left, Expression& right) noexcept
 }
 
 // make_expression() definieras efter namnrymden nedan.
-Expression make_expression(const string& infix);
+Expression make_expression(std::string_view infix);
 
-// Namrymden nedan innehaller intern kod for infix-till-postfix-omvandling
-// och generering av uttryckstrad. En anonym namnrymd begransar anvandningen
+// Namrymden nedan innehaller intern kod for tokenisering och parsning av
+// infixuttryck till uttryckstrad. En anonym namnrymd begransar anvandningen
 // av medlemmarna till denna fil.
 namespace
 {
-  using std::vector;
-  using std::map;
-  using std::make_pair;
-  using std::string;
-
-  // Teckenuppsattningar for operander. Anvands av make_expression_tree().
-  const string letters{"abcdefghijklmnopqrstuvwxyz"};
-  const string digits{"0123456789"};
-  const string integer_chars{digits};
-  const string real_chars{digits + '.'};
-  const string variable_chars{letters};
-  const string operand_chars{letters + digits + '.'};
-
-  // Tillatna operatorer. Anvands av make_postfix() och make_expression_tree().
-  // Prioritetstabeller, en for inkommandeprioritet och en for stackprioritet. 
-  // Hogre varde inom input_prio respektive stack_prio anger inbordes prioritetsordning.
-  // Hogre varde i input_prio jamfört med motsvarande position i stack_prio innebar
-  // högerassociativitet, det motsatta vansterassociativitet. Anvands av make_postfix(). 
-  using priority_table = map<string, int>;
-
-  const vector<string> operators{ "^", "*", "/", "+", "-", "=" };
-  const priority_table input_priority{ {"^", 8}, {"*", 5}, {"/", 5}, {"+", 3}, {"-", 3}, {"=", 2} };
-  const priority_table stack_priority{ {"^", 7}, {"*", 6}, {"/", 6}, {"+", 4}, {"-", 4}, {"=", 1} };
-
-  // Hjalpfunktioner för att kategorisera lexikala element.
-  bool is_operator(char token)
-  {
-    return find(begin(operators), end(operators), string{token}) != end(operators);
-  }
-
-  bool is_operator(const string& token)
-  {
-    return find(begin(operators), end(operators), token) != end(operators);
-  }
+  using std::string_view;
 
-  bool is_operand(const string& token)
+  // Hjalpfunktioner för att kategorisera tecken.
+  bool is_operator(char c)
   {
-    return token.find_first_not_of(operand_chars) == string::npos;
+    switch (c)
+      {
+      case '^': case '*': case '/': case '+': case '-': case '=':
+	return true;
+      default:
+	return false;
+      }
   }
 
-  bool is_integer(const string& token)
+  bool is_separator(char c)
   {
-    return token.find_first_not_of(integer_chars) == string::npos;
+    return is_operator(c) || c == '(' || c == ')' ||
+      std::isspace(static_cast<unsigned char>(c));
   }
 
-  bool is_real(const string& token)
-  {
-    return token.find_first_not_of(real_chars) == string::npos;
-  }
+  bool is_letter(char c)  { return c >= 'a' && c <= 'z'; }
+  bool is_digit(char c)   { return c >= '0' && c <= '9'; }
 
-  bool is_identifier(const string& token)
+  // Prioritetsfunktioner, en for inkommandeprioritet och en for stackprioritet.
+  // Hogre varde anger inbordes prioritetsordning. Hogre varde i input_priority
+  // an i stack_priority for samma operator innebar hogerassociativitet, det
+  // motsatta vansterassociativitet.
+  int input_priority(char op)
   {
-    return token.find_first_not_of(letters) == string::npos;
+    switch (op)
+      {
+      case '^': return 8;
+      case '*': case '/': return 5;
+      case '+': case '-': return 3;
+      default: return 2;   // '='
+      }
   }
 
-  // format_infix tar en strang med ett infixuttryck och formaterar med ett
-  // mellanrum mellan varje symbol; underlattar vid bearbetningen i make_postfix.
-  std::string format_infix(const std::string& infix)
+  int stack_priority(char op)
   {
-    auto bos = begin(infix);
-    auto eos = end(infix);
-    string formated;
-
-    for (auto it = bos; it != eos; ++it)
+    switch (op)
       {
-	if (is_operator(*it) || *it == '(' || *it == ')')
-	  {
-            // Se till att det ar ett mellanrum före en operator eller parentes
-            if (it != bos && *(it - 1) != ' ' && *(formated.end() - 1) != ' ')
-	      formated.append(1, ' ');
-            formated.append(1, *it);
-            // Se till att det ar ett mellanrum efter en operator eller parentes
-            if ((it + 1) != eos && *(it + 1) != ' ')
-	      formated.append(1, ' ');
-	  }
-	else
-	  {
-            if (*it != ' ')
-	      formated.append(1, *it);
-            else if (it != bos && *(it - 1) != ' ')
-	      formated.append(1, *it);
-	  }
+      case '^': return 7;
+      case '*': case '/': return 6;
+      case '+': case '-': return 4;
+      default: return 1;   // '='
       }
-    return formated;
   }
 
-  // make_postfix() tar en infixstrang och returnerar motsvarande postfixstrang.
+  // Lexikala element. En operand ar en maximal folj av tecken som inte ar
+  // operator, parentes eller blanktecken; innehaller den andra tecken an
+  // a-z, 0-9 och '.' ar den en otillaten symbol.
+  enum class Token_Kind { End, Operand, Operator, Left_Paren, Right_Paren, Invalid };
 
-  std::string make_postfix(const std::string& infix)
+  struct Token
   {
-    using std::stack;
-    using std::string;
-    using std::istringstream;
-    using std::find;
-
-    stack<string> operator_stack;
-    string        token;
-    string        previous_token{ "" };
-    bool          last_was_operand{ false };
-    bool          assignment{false};
-    int           paren_count{ 0 };
-
-    istringstream is{ format_infix(infix) };
-    string        postfix;
-
-    while (is >> token)
-      {
-	if (is_operator(token))
-	  {
-            if (!last_was_operand || postfix.empty() || previous_token == "(")
-	      {
-		throw expression_error("operator dar operand forvantades\n");
-	      }
-
-            if (token == "=")
-	      {
-		if (assignment)
-		  {
-		    throw expression_error("multipel tilldelning\n");
-		  }
-		else
-                  assignment = true;
-	      }
-
-            while (!operator_stack.empty() && operator_stack.top() != "(" &&
-                   input_priority.find(token)->second <=
-                   stack_priority.find(operator_stack.top())->second)
-	      {
-		postfix += operator_stack.top() + ' ';
-		operator_stack.pop();
-	      }
-            operator_stack.push(token);
-            last_was_operand = false;
-	  }
-	else if (token == "(")
-	  {
-            operator_stack.push(token);
-            ++paren_count;
-	  }
-	else if (token == ")")
-	  {
-            if (paren_count == 0)
-	      {
-		throw expression_error("vansterparentes saknas\n");
-	      }
-
-            if (previous_token == "(" && !postfix.empty())
-	      {
-		throw expression_error("tom parentes\n");
-	      }
-
-            while (!operator_stack.empty() && operator_stack.top() != "(")
-	      {
-		postfix += operator_stack.top() + ' ';
-		operator_stack.pop();
-	      }
-
-            if (operator_stack.empty())
-	      {
-		throw expression_error("hogerparentes saknar matchande vansterparentes\n");
-	      }
-            // Det finns en vansterparentes pa stacken
-            operator_stack.pop();
-            --paren_count;
-	  }
-	else if (is_operand(token))
-	  {
-            if (last_was_operand || previous_token == ")")
-	      {
-		throw expression_error("operand dar operator forvantades\n");
-	      }
+    Token_Kind  kind;
+    string_view text;
+  };
 
-            postfix += token + ' ';
-            last_was_operand = true;
-	  }
-	else
-	  {
-            throw expression_error ("otillaten symbol\n");
-	  }
+  // Lexer delar upp infixtexten i lexikala element utan att kopiera den.
+  class Lexer
+  {
+  public:
+    explicit Lexer(string_view infix) : text_(infix) {}
+
+    Token next()
+    {
+      while (pos_ < text_.size() &&
+	     std::isspace(static_cast<unsigned char>(text_[pos_])))
+	++pos_;
+
+      if (pos_ == text_.size())
+	return { Token_Kind::End, {} };
+
+      const char c = text_[pos_];
+      if (is_operator(c))
+	return { Token_Kind::Operator, text_.substr(pos_++, 1) };
+      if (c == '(')
+	return { Token_Kind::Left_Paren, text_.substr(pos_++, 1) };
+      if (c == ')')
+	return { Token_Kind::Right_Paren, text_.substr(pos_++, 1) };
+
+      const auto start = pos_;
+      bool valid{ true };
+      while (pos_ < text_.size() && !is_separator(text_[pos_]))
+	{
+	  const char d = text_[pos_++];
+	  if (!is_letter(d) && !is_digit(d) && d != '.')
+	    valid = false;
+	}
+      return { valid ? Token_Kind::Operand : Token_Kind::Invalid,
+	       text_.substr(start, pos_ - start) };
+    }
 
-	previous_token = token;
-      }
+  private:
+    string_view text_;
+    std::size_t pos_{ 0 };
+  };
 
-    if (postfix == "")
-      {
-	throw expression_error("tomt infixuttryck!\n");
-      }
+  // Parser bygger ett uttryckstrad direkt fran infixtexten med
+  // prioritetsklattring (precedence climbing), i ett enda pass. Noderna
+  // skapas i pool.
+  class Parser
+  {
+  public:
+    Parser(string_view infix, Node_Pool& pool)
+      : lexer_(infix), pool_(pool)
+    {
+      advance();
+    }
 
-    if ((!last_was_operand) && (!postfix.empty()))
-      {
-	throw expression_error("operator avslutar\n");
-      }
+    Expression_Tree* parse()
+    {
+      auto tree = parse_expression(0);
 
-    if (paren_count > 0)
-      {
-	throw expression_error ("hogerparentes saknas\n");
-      }
+      if (current_.kind == Token_Kind::Right_Paren)
+	{
+	  throw expression_error("vansterparentes saknas\n");
+	}
+      if (current_.kind != Token_Kind::End)
+	{
+	  unexpected_after_operand();
+	}
+      // Felaktiga operander rapporteras forst nar syntaxen ar kontrollerad,
+      // precis som nar tradet byggdes i ett separat steg.
+      if (bad_operand_)
+	{
+	  throw expression_tree_error("Error ..");
+	}
+      return tree;
+    }
 
-    while (!operator_stack.empty())
-      {
-	postfix += operator_stack.top() + ' ';
-	operator_stack.pop();
-      }
+  private:
+    Lexer       lexer_;
+    Node_Pool&  pool_;
+    Token current_{ Token_Kind::End, {} };
+    Token previous_{ Token_Kind::End, {} };
+    bool  operand_seen_{ false };
+    bool  assignment_{ false };
+    bool  bad_operand_{ false };
+
+    void advance()
+    {
+      previous_ = current_;
+      current_ = lexer_.next();
+    }
 
-    if (!postfix.empty())
+    // parse_expression() laser en operand foljd av operatorer vars
+    // inkommandeprioritet ar hogre an limit. Parsningen anvander en egen
+    // stack i stallet for rekursion: varje niva ar antingen ett deluttryck
+    // med sin grans, sitt vansterled och en vantande operator, eller en
+    // oppen parentes.
+    Expression_Tree* parse_expression(int limit)
+    {
+      struct Level
       {
-	postfix.erase(postfix.size() - 1);
-      }
-
-    return postfix;
-  }
-
-  // make_expression_tree() tar en postfixstrang och returnerar ett motsvarande 
-  // lankat trad av Expression_Tree-noder. Tank pa minneslackage...
+	int              limit;
+	char             op;
+	Expression_Tree* lhs;
+	bool             paren;
+      };
+      std::vector<Level> levels{ { limit, 0, nullptr, false } };
+      Expression_Tree* tree{ nullptr };
+
+      for (;;)
+	{
+	  // Las en operand; en vansterparentes oppnar ett nytt deluttryck.
+	  while (current_.kind == Token_Kind::Left_Paren)
+	    {
+	      advance();
+	      levels.push_back({ 0, 0, nullptr, true });
+	      levels.push_back({ 0, 0, nullptr, false });
+	    }
+	  tree = parse_operand();
 
-  Expression_Tree* make_expression_tree(const std::string& postfix)
-  {
-    using std::stack;
-    using std::string;
-    using std::istringstream;
-
-    stack<Expression_Tree*> tree_stack;
-    string                  token;
-    istringstream           ps{ postfix };
-
-    try {
-      while (ps >> token)
-        {
-	  if (is_operator(token))
+	  // Lamna tree till nivaerna ovanfor tills en operator ska lasas.
+	  for (;;)
 	    {
-              if (tree_stack.empty()) 
+	      Level& level = levels.back();
+	      if (level.paren)
 		{
-		  throw expression_error("felaktig postfix\n");
+		  close_paren();
+		  levels.pop_back();
+		  continue;
 		}
-              Expression_Tree* rhs = tree_stack.top();
-              tree_stack.pop();
 
-              if (tree_stack.empty()) 
+	      level.lhs = level.op == 0 ? tree : make_binary(level.op, level.lhs, tree);
+	      level.op = 0;
+	      if (current_.kind == Token_Kind::Operator &&
+		  input_priority(current_.text.front()) > level.limit)
 		{
-		  throw expression_error("felaktig postfix\n");
-
+		  const char op = current_.text.front();
+		  if (op == '=')
+		    {
+		      if (assignment_)
+			{
+			  throw expression_error("multipel tilldelning\n");
+			}
+		      assignment_ = true;
+		    }
+		  advance();
+		  level.op = op;
+		  levels.push_back({ stack_priority(op), 0, nullptr, false });
+		  break;
 		}
-              Expression_Tree* lhs = tree_stack.top();
-              tree_stack.pop();
 
-              if (token == "^")
-		{
-		  tree_stack.push(new Power{lhs, rhs});
-		}
-              else if (token == "*")
-		{
-		  tree_stack.push(new Times{lhs, rhs});
-		}
-              else if (token == "/")
-		{
-		  tree_stack.push(new Divide{lhs, rhs});
-		}
-              else if (token == "+")
-		{
-		  tree_stack.push(new Plus{lhs, rhs});
-		}
-              else if (token == "-")
-		{
-		  tree_stack.push(new Minus{lhs, rhs});
-		}
-              else if (token == "=")
-		{
-		  tree_stack.push(new Assign{lhs, rhs});
-		}
-	    }
-	  else if (is_integer(token))
-	    {
-              tree_stack.push(new Integer{std::stoi(token)});
+	      tree = level.lhs;
+	      levels.pop_back();
+	      if (levels.empty())
+		return tree;
 	    }
-	  else if (is_real(token))
+	}
+    }
+
+    // close_paren() kontrollerar slutet av ett parentesuttryck.
+    void close_paren()
+    {
+      if (current_.kind == Token_Kind::End)
+	{
+	  throw expression_error("hogerparentes saknas\n");
+	}
+      if (current_.kind != Token_Kind::Right_Paren)
+	{
+	  unexpected_after_operand();
+	}
+      advance();
+      if (current_.kind == Token_Kind::Operand ||
+	  current_.kind == Token_Kind::Left_Paren)
+	{
+	  throw expression_error("operand dar operator forvantades\n");
+	}
+    }
+
+    // parse_operand() laser ett lov. Parenteser hanteras av parse_expression().
+    Expression_Tree* parse_operand()
+    {
+      switch (current_.kind)
+	{
+	case Token_Kind::Operand:
+	  {
+	    auto leaf = make_operand(current_.text);
+	    operand_seen_ = true;
+	    advance();
+	    if (current_.kind == Token_Kind::Operand ||
+		current_.kind == Token_Kind::Left_Paren)
+	      {
+		unexpected_after_operand();
+	      }
+	    return leaf;
+	  }
+	case Token_Kind::Operator:
+	  throw expression_error("operator dar operand forvantades\n");
+	case Token_Kind::Right_Paren:
+	  if (previous_.kind == Token_Kind::Left_Paren && operand_seen_)
 	    {
-              tree_stack.push(new Real{std::stold(token)});
+	      throw expression_error("tom parentes\n");
 	    }
-	  else if (is_identifier(token))
+	  if (previous_.kind == Token_Kind::Operator)
 	    {
-              tree_stack.push(new Variable{token});
+	      throw expression_error("operator avslutar\n");
 	    }
-	  else
+	  throw expression_error("tomt infixuttryck!\n");
+	case Token_Kind::Invalid:
+	  throw expression_error("otillaten symbol\n");
+	case Token_Kind::End:
+	default:
+	  if (!operand_seen_)
 	    {
-              throw expression_error("felaktig postfix\n");
+	      throw expression_error("tomt infixuttryck!\n");
 	    }
-        }
-    } catch (...) {
-      while (!tree_stack.empty())
+	  throw expression_error("operator avslutar\n");
+	}
+    }
+
+    [[noreturn]] void unexpected_after_operand() const
+    {
+      if (current_.kind == Token_Kind::Invalid)
 	{
-	  delete tree_stack.top();
-	  tree_stack.pop();
+	  throw expression_error("otillaten symbol\n");
 	}
-      throw expression_tree_error("Error ..");
+      throw expression_error("operand dar operator forvantades\n");
     }
-    // Det ska bara finnas ett trad pa stacken om postfixen ar korrekt.
 
-    if (tree_stack.empty())
-      {
-	throw expression_error ("ingen postfix given\n");
-      }
-         
-    if (tree_stack.size() > 1)
-      {
-	while (!tree_stack.empty())
-	  {
-            delete tree_stack.top();
-            tree_stack.pop();
-	  }
-	throw expression_error( "felaktig postfix\n");
-      }
-    return tree_stack.top();
-  }
+    // make_operand() skapar ett lov. Operander som inte ar heltal, reella tal
+    // eller identifierare markeras och rapporteras efter parsningen.
+    Expression_Tree* make_operand(string_view token)
+    {
+      bool letters{ true };
+      bool digits{ true };
+      bool reals{ true };
+      for (char c : token)
+	{
+	  letters = letters && is_letter(c);
+	  digits  = digits && is_digit(c);
+	  reals   = reals && (is_digit(c) || c == '.');
+	}
+
+      // Talen tolkas direkt i texten. Som med stold() ignoreras det som
+      // foljer efter ett giltigt tal, t.ex. "1.2.3". Heltal som inte ryms
+      // i int64_t blir Big_Integer, sa att de fortsatter att vara exakta.
+      const char* first = token.data();
+      const char* last = token.data() + token.size();
+      if (digits)
+	{
+	  int64_t value{ 0 };
+	  const std::errc error = std::from_chars(first, last, value).ec;
+	  if (error == std::errc{})
+	    return pool_.make_integer(value);
+	  if (error == std::errc::result_out_of_range)
+	    return pool_.make_integer(Big_Integer::parse(token));
+	}
+      if (digits || reals)
+	{
+	  long double value{ 0 };
+	  if (std::from_chars(first, last, value).ec == std::errc{})
+	    return pool_.make_real(value);
+	}
+      else if (letters)
+	{
+	  return pool_.make_variable(Symbol_Table::intern(token));
+	}
+      bad_operand_ = true;
+      return pool_.make_integer(0);
+    }
+
+    Expression_Tree* make_binary(char op, Expression_Tree* lhs, Expression_Tree* rhs)
+    {
+      switch (op)
+	{
+	case '^': return pool_.make_binary(Node_Kind::Power, lhs, rhs);
+	case '*': return pool_.make_binary(Node_Kind::Times, lhs, rhs);
+	case '/': return pool_.make_binary(Node_Kind::Divide, lhs, rhs);
+	case '+': return pool_.make_binary(Node_Kind::Plus, lhs, rhs);
+	case '-': return pool_.make_binary(Node_Kind::Minus, lhs, rhs);
+	default:  return pool_.make_binary(Node_Kind::Assign, lhs, rhs);
+	}
+    }
+  };
   // namespace
 }
 /*
  * make_expression()
  */
-Expression make_expression(const string& infix)
+Expression make_expression(std::string_view infix)
+{
+  return make_expression(infix, make_shared<Node_Pool>());
+}
+
+/*
+ * make_expression() med en pool skapar noderna i den, så att uttrycket
+ * delar deluttryck med andra uttryck i samma pool. Texten slås först upp
+ * i Parse_Cache::global(); vid träff kopieras det sparade trädet in i
+ * poolen, annars parsas texten och en kopia sparas. Felaktiga uttryck
+ * sparas inte.
+ */
+Expression make_expression(std::string_view infix,
+			   const std::shared_ptr<Node_Pool>& pool)
 {
-  return Expression(make_expression_tree(make_postfix(infix)));
+  Expression result;
+  result.pool_ = pool;
+
+  auto& cache = Parse_Cache::global();
+  if (cache.capacity() == 0)
+    return parse_expression(infix, pool);
+
+  string key{ normalize_infix(infix) };
+  if (auto cached = cache.find(key))
+    {
+      METRICS_TIME(Import);
+      auto lock = pool->lock();
+      result.root_ = pool->import(cached->root_);
+      return result;
+    }
+
+  auto parsed = make_shared<Expression>();
+  parsed->pool_ = make_shared<Node_Pool>();
+  {
+    METRICS_TIME(Parse);
+    parsed->root_ = Parser{ infix, *parsed->pool_ }.parse();
+  }
+  {
+    METRICS_TIME(Import);
+    auto lock = pool->lock();
+    result.root_ = pool->import(parsed->root_);
+  }
+  cache.insert(std::move(key), std::move(parsed));
+  return result;
+}
+
+/*
+ * load_expression()
+ */
+Expression load_expression(std::string_view archive)
+{
+  auto expressions = Expression_Archive::read(archive, make_shared<Node_Pool>());
+  if (expressions.size() != 1)
+    throw expression_error("Arkivet innehåller inte ett enda uttryck");
+  return std::move(expressions.front());
+}
+
+/*
+ * parse_expression() parsar infix direkt i pool utan att använda
+ * Parse_Cache, för texter som sannolikt bara förekommer en gång.
+ */
+Expression parse_expression(std::string_view infix,
+			    const std::shared_ptr<Node_Pool>& pool)
+{
+  METRICS_TIME(Parse);
+  Expression result;
+  auto lock = pool->lock();
+  result.root_ = Parser{ infix, *pool }.parse();
+  result.pool_ = pool;
+  return result;
+}
+
+string normalize_infix(std::string_view infix)
+{
+  METRICS_TIME(Normalize);
+  Lexer lexer{ infix };
+  string key;
+  key.reserve(infix.size());
+
+  bool operand{ false };
+  for (Token token = lexer.next(); token.kind != Token_Kind::End; token = lexer.next())
+    {
+      const bool next_operand = token.kind == Token_Kind::Operand ||
+	token.kind == Token_Kind::Invalid;
+      if (operand && next_operand)
+	key += ' ';
+      key.append(token.text);
+      operand = next_operand;
+    }
+  return key;
 }
@@ -3,9 +3,17 @@
  */
 #ifndef EXPRESSION_H
 #define EXPRESSION_H
+#include "Big_Integer.h"
+#include "Compiled_Expression.h"
+#include "Environment.h"
+#include <cstddef>
+#include <functional>
 #include <iosfwd>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <vector>
 
 /**
  * expression_error kastas om fel inträffar i en Expression-operation.
@@ -14,12 +22,45 @@
 
 /**
  * Expression är en klass för att representera ett enkelt aritmetiskt uttryck.
+ * Noderna ligger i en Node_Pool som kan delas med andra uttryck; lika
+ * deluttryck finns då bara en gång. Noderna ändras aldrig, så en kopia
+ * delar träd och pool med originalet.
  */
 class Expression
 {
  public:
   
-  friend Expression make_expression(const std::string &);
+  friend Expression make_expression(std::string_view);
+  friend Expression make_expression(std::string_view,
+                                    const std::shared_ptr<class Node_Pool>&);
+  friend Expression parse_expression(std::string_view,
+                                     const std::shared_ptr<class Node_Pool>&);
+  friend class Expression_Archive;
+  friend class Parallel_Expression;
+  friend Expression derive(const Expression&, const std::string&);
+
+  // Precision anger i vilken typ evaluate() räknar. Standard är long double.
+  enum class Precision { Float, Double, Long_Double };
+
+  // Tape är bandet som gradient() deriverar på, uttrycket som en
+  // Flat_Expression. Den som anropar äger bandet; med samma band för samma
+  // uttryck byggs det bara vid första anropet, och gradient() allokerar
+  // sedan inte. Används bandet för ett annat uttryck byggs det om.
+  class Tape
+  {
+   public:
+    Tape();
+    ~Tape();
+    Tape(Tape&&) noexcept;
+    Tape& operator=(Tape&&) noexcept;
+
+   private:
+    friend class Expression;
+
+    std::weak_ptr<class Node_Pool>         pool_;
+    const class Expression_Tree*           root_{ nullptr };
+    std::unique_ptr<class Flat_Expression> flat_;
+  };
 
   Expression() = default;
   ~Expression ();
@@ -29,24 +70,94 @@ class Expression
   Expression(const Expression & other);  
   Expression(Expression && other) noexcept;
   long double evaluate() const;
+  long double evaluate(Environment& environment) const;
+  long double evaluate_incremental(Environment& environment) const;
+  // evaluate<T>() räknar i typen T (float, double eller long double),
+  // oberoende av precision().
+  template <typename T> T evaluate() const;
+  template <typename T> T evaluate(Environment& environment) const;
+  // evaluate_exact() ger det exakta värdet av ett uttryck med bara heltal
+  // och +, -, * och ^, om det är ett heltal.
+  Big_Integer evaluate_exact() const;
+  // gradient() evaluerar uttrycket och lägger derivatan med avseende på
+  // varje variabel i partials, indexerad med slot, se
+  // Flat_Expression::gradient(). Returnerar värdet. Utan tape byggs ett
+  // nytt band vid varje anrop.
+  long double gradient(Environment& environment,
+                       std::vector<long double>& partials) const;
+  long double gradient(Environment& environment, std::vector<long double>& partials,
+                       Tape& tape) const;
+  Precision   precision() const;
+  void        set_precision(Precision precision);
+  Compiled_Expression compile() const;
+  // flatten() ger uttrycket som en Flat_Expression (Flat_Expression.h).
+  class Flat_Expression flatten() const;
+  Expression optimize() const;
+  // rebalance() omgrupperar långa kedjor av + och * till balanserade träd,
+  // så att de kan evalueras parallellt, se Parallel_Expression. Värdet kan
+  // avrundas annorlunda, eftersom flyttalsaddition och -multiplikation inte
+  // är associativa.
+  Expression rebalance() const;
 
   std::string get_postfix() const;
   std::string get_infix() const;
+  // write_postfix() och write_infix() lägger texten sist i out eller
+  // skriver den direkt till os, utan en sträng per nod.
+  void write_postfix(std::string& out) const;
+  void write_postfix(std::ostream& os) const;
+  void write_infix(std::string& out) const;
+  void write_infix(std::ostream& os) const;
+
+  std::size_t hash() const;
+  bool        equal(const Expression& other) const;
 
   bool empty() const;
+  bool pure() const;
   void clear() & noexcept;
   void print_tree(std::ostream& os ) const;
+  // save() skriver uttrycket binärt, se Expression_Archive.
+  void save(std::ostream& os) const;
   void swap(Expression& other) noexcept;
 
  private:
+  std::shared_ptr<class Node_Pool> pool_;
   class Expression_Tree * root_ {nullptr};
-  explicit Expression(class Expression_Tree* p) : root_(p) {}
+  Precision precision_{ Precision::Long_Double };
 
 };
 
 void swap(Expression& left, Expression& right) noexcept;
 
-Expression make_expression(const std::string& infix);
+bool operator==(const Expression& left, const Expression& right);
+bool operator!=(const Expression& left, const Expression& right);
+
+Expression make_expression(std::string_view infix);
+Expression make_expression(std::string_view infix,
+                           const std::shared_ptr<class Node_Pool>& pool);
+Expression parse_expression(std::string_view infix,
+                            const std::shared_ptr<class Node_Pool>& pool);
+// load_expression() läser ett uttryck som skrivits med save().
+Expression load_expression(std::string_view archive);
+// derive() ger derivatan av expression med avseende på variabeln variable,
+// förenklad medan den byggs. Den delar pool med expression och kan skrivas
+// med get_infix() och läsas in igen med make_expression().
+Expression derive(const Expression& expression, const std::string& variable);
+
+// normalize_infix() tar bort blanktecken som inte skiljer två operander åt,
+// och ersätter övriga med ett mellanslag. Används som nyckel i Parse_Cache.
+std::string normalize_infix(std::string_view infix);
+
+namespace std
+{
+  template <>
+  struct hash<Expression>
+  {
+    size_t operator()(const Expression& expression) const noexcept
+    {
+      return expression.hash();
+    }
+  };
+}
 
 
 #endif
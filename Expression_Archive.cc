@@ -0,0 +1,535 @@
+/*
+ * Expression_Archive.cc
+ */
+#include "Expression_Archive.h"
+#include "Environment.h"
+#include "Expression.h"
+#include "Expression_File.h"
+#include "Expression_Tree.h"
+#include "Node_Pool.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <unordered_map>
+using namespace std;
+
+namespace
+{
+  constexpr char          magic[4]{ 'K', 'A', 'L', 'K' };
+  constexpr size_t        header_size{ 20 };
+  constexpr std::uint8_t  reference_tag{ 15 };
+  constexpr std::uint8_t  negative_flag{ 0x80 };
+  constexpr std::uint8_t  special_flag{ 0x40 };
+
+  // Ett variabelnamn består av en eller flera gemena bokstäver a-z, som i
+  // parsern.
+  bool valid_name(string_view name)
+  {
+    return !name.empty() &&
+      all_of(name.begin(), name.end(), [](char c) { return c >= 'a' && c <= 'z'; });
+  }
+
+  uint32_t crc32(string_view bytes)
+  {
+    static const array<uint32_t, 256> table = []
+      {
+	array<uint32_t, 256> result{};
+	for (uint32_t i = 0; i < 256; ++i)
+	  {
+	    uint32_t c = i;
+	    for (int k = 0; k < 8; ++k)
+	      c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+	    result[i] = c;
+	  }
+	return result;
+      }();
+
+    uint32_t crc{ 0xFFFFFFFFu };
+    for (unsigned char b : bytes)
+      crc = table[(crc ^ b) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+  }
+
+  // Writer bygger upp hela arkivet i en sträng.
+  class Writer
+  {
+  public:
+    void u8(uint8_t value)   { bytes_.push_back(static_cast<char>(value)); }
+    void u16(uint16_t value) { little_endian(value, 2); }
+    void u32(uint32_t value) { little_endian(value, 4); }
+    void u64(uint64_t value) { little_endian(value, 8); }
+    void text(string_view value) { bytes_.append(value); }
+
+    // varint() skriver value med 7 bitar per byte, lägsta först (LEB128).
+    void varint(uint64_t value)
+    {
+      while (value >= 0x80)
+	{
+	  bytes_.push_back(static_cast<char>(value | 0x80));
+	  value >>= 7;
+	}
+      bytes_.push_back(static_cast<char>(value));
+    }
+
+    void          clear() { bytes_.clear(); }
+    size_t        size() const { return bytes_.size(); }
+    const string& bytes() const { return bytes_; }
+
+  private:
+    string bytes_;
+
+    void little_endian(uint64_t value, int count)
+    {
+      for (int i = 0; i < count; ++i)
+	bytes_.push_back(static_cast<char>(value >> (8 * i)));
+    }
+  };
+
+  // Reader läser arkivet och kastar archive_error om det tar slut.
+  class Reader
+  {
+  public:
+    explicit Reader(string_view bytes) : bytes_(bytes) {}
+
+    uint8_t  u8()  { return static_cast<uint8_t>(little_endian(1)); }
+    uint16_t u16() { return static_cast<uint16_t>(little_endian(2)); }
+    uint32_t u32() { return static_cast<uint32_t>(little_endian(4)); }
+    uint64_t u64() { return little_endian(8); }
+
+    uint64_t varint()
+    {
+      uint64_t value{ 0 };
+      for (int shift = 0; shift < 64; shift += 7)
+	{
+	  const uint8_t byte = u8();
+	  value |= uint64_t{ byte & 0x7Fu } << shift;
+	  if ((byte & 0x80) == 0)
+	    return value;
+	}
+      throw archive_error("Felaktigt tal i arkivet");
+    }
+
+    string_view text(size_t size)
+    {
+      require(size);
+      string_view result{ bytes_.substr(0, size) };
+      bytes_.remove_prefix(size);
+      return result;
+    }
+
+    bool empty() const { return bytes_.empty(); }
+
+    // count() kontrollerar att value element om minst size byte vardera
+    // ryms i resten av arkivet, så att inget allokeras efter ett falskt
+    // antal.
+    size_t count(uint64_t value, size_t size) const
+    {
+      if (value > bytes_.size() / size)
+	throw archive_error("Felaktigt antal i arkivet");
+      return static_cast<size_t>(value);
+    }
+
+  private:
+    string_view bytes_;
+
+    void require(size_t size) const
+    {
+      if (bytes_.size() < size)
+	throw archive_error("Arkivet är avkortat");
+    }
+
+    uint64_t little_endian(size_t count)
+    {
+      require(count);
+      uint64_t value{ 0 };
+      for (size_t i = 0; i < count; ++i)
+	value |= uint64_t{ static_cast<unsigned char>(bytes_[i]) } << (8 * i);
+      bytes_.remove_prefix(count);
+      return value;
+    }
+  };
+
+  // Encoder skriver ett uttrycks noder i preordning.
+  class Encoder
+  {
+  public:
+    Encoder(Writer& writer, unordered_map<size_t, uint32_t>& variables,
+	    vector<size_t>& slots)
+      : writer_(writer), variables_(variables), slots_(slots)
+    {}
+
+    // encode() går igenom trädet med en egen stack; höger barn läggs på
+    // stacken före vänster så att noderna skrivs i preordning.
+    void encode(const Expression_Tree* root)
+    {
+      vector<const Expression_Tree*> stack{ root };
+      while (!stack.empty())
+	{
+	  const Expression_Tree* node = stack.back();
+	  stack.pop_back();
+
+	  if (node->shared())
+	    {
+	      auto it = written_.find(node);
+	      if (it != written_.end())
+		{
+		  writer_.u8(reference_tag);
+		  writer_.varint(it->second);
+		  continue;
+		}
+	      written_.emplace(node, count_);
+	    }
+	  ++count_;
+
+	  const auto kind = static_cast<uint8_t>(node->kind());
+	  switch (node->kind())
+	    {
+	    case Node_Kind::Integer:
+	      if (const Big_Integer* big = static_cast<const Integer*>(node)->big_exact())
+		encode_big(kind, *big);
+	      else
+		{
+		  writer_.u8(kind);
+		  writer_.u64(static_cast<uint64_t>(static_cast<const Integer*>(node)->get_value()));
+		}
+	      break;
+	    case Node_Kind::Real:
+	      encode_real(kind, static_cast<const Real*>(node)->get_value());
+	      break;
+	    case Node_Kind::Variable:
+	      writer_.u8(kind);
+	      writer_.varint(variable(static_cast<const Variable*>(node)->get_slot()));
+	      break;
+	    default:
+	      {
+		auto binary = static_cast<const Binary_Operator*>(node);
+		writer_.u8(kind);
+		stack.push_back(binary->right());
+		stack.push_back(binary->left());
+	      }
+	      break;
+	    }
+	}
+    }
+
+    uint32_t count() const { return count_; }
+
+  private:
+    Writer&                                        writer_;
+    unordered_map<size_t, uint32_t>&               variables_;
+    vector<size_t>&                                slots_;
+    unordered_map<const Expression_Tree*, uint32_t> written_;
+    uint32_t                                       count_{ 0 };
+
+    uint32_t variable(size_t slot)
+    {
+      auto result = variables_.emplace(slot, static_cast<uint32_t>(slots_.size()));
+      if (result.second)
+	slots_.push_back(slot);
+      return result.first->second;
+    }
+
+    // Ett heltal som inte ryms i i64 skrivs med sina decimala siffror.
+    void encode_big(uint8_t kind, const Big_Integer& value)
+    {
+      const string text = value.str();
+      const string_view digits = value.negative() ? string_view{ text }.substr(1) : text;
+      writer_.u8(kind | special_flag | (value.negative() ? negative_flag : 0));
+      writer_.varint(digits.size());
+      writer_.text(digits);
+    }
+
+    // Mantissan är |value| / 2^exponent skalad till 64 bitar, vilket är
+    // exakt för long double med högst 64 bitars mantissa.
+    void encode_real(uint8_t kind, long double value)
+    {
+      uint8_t tag = kind;
+      if (signbit(value))
+	tag |= negative_flag;
+
+      uint64_t mantissa{ 0 };
+      int exponent{ 0 };
+      if (!isfinite(value))
+	{
+	  tag |= special_flag;
+	  mantissa = isnan(value) ? 1 : 0;
+	}
+      else if (value != 0)
+	{
+	  const long double fraction = frexp(fabs(value), &exponent);
+	  mantissa = static_cast<uint64_t>(ldexp(fraction, 64));
+	}
+
+      writer_.u8(tag);
+      writer_.u64(mantissa);
+      writer_.u16(static_cast<uint16_t>(static_cast<int16_t>(exponent)));
+    }
+  };
+
+  // Decoder bygger ett uttrycks noder i pool. Referenserna gäller inom
+  // uttrycket, så varje uttryck har en egen Decoder.
+  class Decoder
+  {
+  public:
+    Decoder(Reader& reader, Node_Pool& pool, const vector<size_t>& slots,
+	    uint16_t version)
+      : reader_(reader), pool_(pool), slots_(slots), version_(version)
+    {}
+
+    // decode() läser noderna i preordning. En operator väntar på stacken
+    // tills båda barnen är lästa. Finns referenser markeras de noder som
+    // nås flera gånger som delade, som när trädet skrevs.
+    Expression_Tree* decode()
+    {
+      struct Pending
+      {
+	size_t           index;
+	uint8_t          tag;
+	Expression_Tree* left;
+      };
+      vector<Pending> pending;
+      bool            referenced{ false };
+
+      for (;;)
+	{
+	  Expression_Tree* node{ nullptr };
+	  const uint8_t tag = reader_.u8();
+	  if (tag == reference_tag)
+	    {
+	      const uint64_t index = reader_.varint();
+	      if (index >= nodes_.size() || nodes_[index] == nullptr)
+		throw archive_error("Felaktig referens i arkivet");
+	      node = nodes_[index];
+	      referenced = true;
+	    }
+	  else
+	    {
+	      const size_t index = nodes_.size();
+	      nodes_.push_back(nullptr);
+
+	      switch (static_cast<Node_Kind>(tag & ~(negative_flag | special_flag)))
+		{
+		case Node_Kind::Integer:
+		  if ((tag & special_flag) != 0 && version_ >= 3)
+		    node = pool_.make_integer(decode_big(tag));
+		  else if (tag != static_cast<uint8_t>(Node_Kind::Integer))
+		    throw archive_error("Felaktig nod i arkivet");
+		  else if (version_ == 1)
+		    node = pool_.make_integer(static_cast<int32_t>(reader_.u32()));
+		  else
+		    node = pool_.make_integer(static_cast<int64_t>(reader_.u64()));
+		  break;
+		case Node_Kind::Real:
+		  node = pool_.make_real(decode_real(tag));
+		  break;
+		case Node_Kind::Variable:
+		  {
+		    const uint64_t variable = reader_.varint();
+		    if (variable >= slots_.size())
+		      throw archive_error("Felaktig variabel i arkivet");
+		    node = pool_.make_variable(slots_[variable]);
+		    break;
+		  }
+		case Node_Kind::Plus:   case Node_Kind::Minus: case Node_Kind::Times:
+		case Node_Kind::Divide: case Node_Kind::Power: case Node_Kind::Assign:
+		  if ((tag & (negative_flag | special_flag)) != 0)
+		    throw archive_error("Felaktig nod i arkivet");
+		  pending.push_back({ index, tag, nullptr });
+		  continue;
+		default:
+		  throw archive_error("Felaktig nod i arkivet");
+		}
+	      nodes_[index] = node;
+	    }
+
+	  // En färdig nod blir vänster eller höger barn till den översta
+	  // väntande operatorn, som då kan bli färdig i sin tur.
+	  for (;;)
+	    {
+	      if (pending.empty())
+		{
+		  if (referenced)
+		    pool_.mark_shared(node);
+		  return node;
+		}
+	      Pending& parent = pending.back();
+	      if (parent.left == nullptr)
+		{
+		  parent.left = node;
+		  break;
+		}
+	      node = pool_.make_binary(static_cast<Node_Kind>(parent.tag), parent.left, node);
+	      nodes_[parent.index] = node;
+	      pending.pop_back();
+	    }
+	}
+    }
+
+    size_t count() const { return nodes_.size(); }
+
+  private:
+    Reader&                  reader_;
+    Node_Pool&               pool_;
+    const vector<size_t>&    slots_;
+    const uint16_t           version_;
+    vector<Expression_Tree*> nodes_;
+
+    long double decode_real(uint8_t tag)
+    {
+      const uint64_t mantissa = reader_.u64();
+      const int exponent = static_cast<int16_t>(reader_.u16());
+      long double value;
+      if (tag & special_flag)
+	value = mantissa != 0 ? NAN : INFINITY;
+      else
+	value = ldexp(static_cast<long double>(mantissa), exponent - 64);
+      return (tag & negative_flag) ? -value : value;
+    }
+
+    Big_Integer decode_big(uint8_t tag)
+    {
+      const string_view digits = reader_.text(reader_.count(reader_.varint(), 1));
+      if (digits.empty() ||
+	  !all_of(digits.begin(), digits.end(), [](char c) { return c >= '0' && c <= '9'; }))
+	throw archive_error("Felaktigt heltal i arkivet");
+      const Big_Integer value = Big_Integer::parse(digits);
+      return (tag & negative_flag) ? Big_Integer{ 0 } - value : value;
+    }
+  };
+}
+
+/*
+ * write() kodar först alla uttryck och skriver sedan huvudet, med
+ * variabeltabellen, före dem.
+ */
+void Expression_Archive::write(ostream& os, const vector<Expression>& expressions)
+{
+  unordered_map<size_t, uint32_t> variables;
+  vector<size_t> slots;
+  Writer body;
+  Writer nodes;
+
+  for (const Expression& expression : expressions)
+    {
+      if (expression.empty())
+	{
+	  body.varint(0);
+	  continue;
+	}
+      nodes.clear();
+      Encoder encoder{ nodes, variables, slots };
+      encoder.encode(expression.root_);
+      body.varint(encoder.count());
+      body.text(nodes.bytes());
+    }
+
+  Writer archive;
+  archive.text({ magic, sizeof magic });
+  archive.u16(version);
+  archive.u16(0);
+  archive.u32(static_cast<uint32_t>(slots.size()));
+  archive.u64(expressions.size());
+  for (size_t slot : slots)
+    {
+      const string_view name{ Symbol_Table::name(slot) };
+      archive.u16(static_cast<uint16_t>(name.size()));
+      archive.text(name);
+    }
+  archive.text(body.bytes());
+  archive.u32(crc32(archive.bytes()));
+
+  os.write(archive.bytes().data(), static_cast<streamsize>(archive.size()));
+  if (!os)
+    throw archive_error("Kunde inte skriva arkivet");
+}
+
+void Expression_Archive::write(ostream& os, const Expression& expression)
+{
+  write(os, vector<Expression>{ expression });
+}
+
+void Expression_Archive::write_file(const string& path,
+				    const vector<Expression>& expressions)
+{
+  ofstream file{ path, ios::binary | ios::trunc };
+  if (!file)
+    throw archive_error("Kan inte öppna " + path);
+  write(file, expressions);
+}
+
+/*
+ * read() kontrollerar huvud och kontrollsumma och bygger sedan uttrycken
+ * i pool, eller i en ny pool per uttryck om pool är tom. Ett tomt uttryck
+ * lagras med 0 noder.
+ */
+vector<Expression> Expression_Archive::read(string_view archive,
+					    const shared_ptr<Node_Pool>& pool)
+{
+  if (archive.size() < header_size + 4 || memcmp(archive.data(), magic, sizeof magic) != 0)
+    throw archive_error("Inget uttrycksarkiv");
+
+  Reader trailer{ archive.substr(archive.size() - 4) };
+  const string_view contents{ archive.substr(0, archive.size() - 4) };
+  if (trailer.u32() != crc32(contents))
+    throw archive_error("Fel kontrollsumma, arkivet är skadat");
+
+  Reader reader{ contents.substr(sizeof magic) };
+  const uint16_t archive_version = reader.u16();
+  if (archive_version < 1 || archive_version > version)
+    throw archive_error("Okänd version av uttrycksarkivet");
+  reader.u16();
+
+  // Varje variabelnamn tar minst 2 byte och varje uttryck och nod minst 1.
+  vector<size_t> slots(reader.count(reader.u32(), 2));
+  const size_t count = reader.count(reader.u64(), 1);
+  for (size_t& slot : slots)
+    {
+      const string_view name{ reader.text(reader.u16()) };
+      if (!valid_name(name))
+	throw archive_error("Felaktigt variabelnamn i arkivet");
+      slot = Symbol_Table::intern(name);
+    }
+
+  vector<Expression> expressions;
+  expressions.reserve(count);
+  for (size_t i = 0; i < count; ++i)
+    {
+      const size_t nodes = reader.count(reader.varint(), 1);
+      Expression expression;
+      if (nodes > 0)
+	{
+	  const shared_ptr<Node_Pool> target = pool ? pool : make_shared<Node_Pool>();
+	  Decoder decoder{ reader, *target, slots, archive_version };
+	  auto lock = target->lock();
+	  expression.root_ = decoder.decode();
+	  expression.pool_ = target;
+	  if (decoder.count() != nodes)
+	    throw archive_error("Fel antal noder i arkivet");
+	}
+      expressions.push_back(std::move(expression));
+    }
+
+  if (!reader.empty())
+    throw archive_error("Okända data sist i arkivet");
+  return expressions;
+}
+
+vector<Expression> Expression_Archive::read(string_view archive)
+{
+  return read(archive, nullptr);
+}
+
+vector<Expression> Expression_Archive::read_file(const string& path,
+						 const shared_ptr<Node_Pool>& pool)
+{
+  const Mapped_File file{ path };
+  return read(file.text(), pool);
+}
+
+vector<Expression> Expression_Archive::read_file(const string& path)
+{
+  return read_file(path, nullptr);
+}
@@ -0,0 +1,79 @@
+/*
+ * Expression_Archive.h
+ */
+#ifndef EXPRESSION_ARCHIVE_H
+#define EXPRESSION_ARCHIVE_H
+#include "Metrics.h"
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Expression;
+class Node_Pool;
+
+/**
+ * Expression_Archive sparar uttryck i ett kompakt binärt format och läser
+ * tillbaka dem utan att tokenisera. Alla tal lagras little-endian:
+ *
+ *   "KALK", u16 version, u16 0, u32 antal variabler, u64 antal uttryck
+ *   variabeltabell: för varje variabel u16 längd och namnet
+ *   för varje uttryck: antal noder (varint), noderna i preordning
+ *   u32 CRC-32 av alla föregående byte
+ *
+ * En nod är en typbyte (Node_Kind) följd av Integer: i64, Real: u64
+ * mantissa och i16 exponent (värdet är mantissa * 2^(exponent - 64), bit 7
+ * i typbyten är tecknet och bit 6 anger inf/nan), Variable: index i
+ * variabeltabellen (varint). Ett Integer som inte ryms i i64 har bit 6
+ * satt, tecknet i bit 7 och antalet decimala siffror (varint) följt av
+ * siffrorna. Operatorer följs av sina två deltråd. Ett
+ * deltråd som redan skrivits i samma uttryck ersätts av typbyten 15 och
+ * nodens ordningsnummer (varint), så delade deltråd lagras en gång.
+ * En varint har 7 bitar per byte, lägsta först; hög bit betyder fler byte.
+ *
+ * Kontrollsumman kontrolleras innan något uttryck byggs, så en skadad fil
+ * avvisas efter en enda linjär genomläsning. Version 1, med Integer som
+ * i32, och version 2, utan stora heltal, kan fortfarande läsas.
+ */
+class Expression_Archive
+{
+ public:
+  Expression_Archive() = delete;
+
+  static constexpr std::uint16_t version{ 3 };
+
+  static void write(std::ostream& os, const std::vector<Expression>& expressions);
+  static void write(std::ostream& os, const Expression& expression);
+  static void write_file(const std::string& path,
+                         const std::vector<Expression>& expressions);
+
+  // read() och read_file() bygger uttrycken i pool, eller med en egen pool
+  // för varje uttryck, som frigörs med det, när ingen pool anges.
+  static std::vector<Expression> read(std::string_view archive,
+                                      const std::shared_ptr<Node_Pool>& pool);
+  static std::vector<Expression> read(std::string_view archive);
+  static std::vector<Expression> read_file(const std::string& path,
+                                           const std::shared_ptr<Node_Pool>& pool);
+  static std::vector<Expression> read_file(const std::string& path);
+};
+
+class archive_error : public std::runtime_error
+{
+ public:
+  explicit archive_error(const std::string& what_arg)
+    :   runtime_error(what_arg)
+  {
+    METRICS_COUNT(Exceptions);
+  }
+
+  explicit archive_error(const char* what_arg)
+    :   runtime_error(what_arg)
+  {
+    METRICS_COUNT(Exceptions);
+  }
+};
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * Expression_File.cc
+ */
+#include "Expression_File.h"
+#include "Expression.h"
+#include "Node_Pool.h"
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MMAP_AVAILABLE 1
+#endif
+using namespace std;
+
+/*
+ * Konstruktorn avbildar filen med mmap. Saknas mmap läses filen i stället
+ * in i en buffert i ett enda stycke.
+ */
+Mapped_File::Mapped_File(const string& path)
+{
+#ifdef MMAP_AVAILABLE
+  const int file = ::open(path.c_str(), O_RDONLY);
+  if (file < 0)
+    throw runtime_error("Kan inte öppna " + path);
+
+  struct stat status;
+  if (::fstat(file, &status) != 0)
+    {
+      ::close(file);
+      throw runtime_error("Kan inte läsa " + path);
+    }
+
+  size_ = static_cast<size_t>(status.st_size);
+  if (size_ > 0)
+    {
+      void* map = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, file, 0);
+      if (map == MAP_FAILED)
+	{
+	  ::close(file);
+	  throw runtime_error("Kan inte avbilda " + path);
+	}
+      ::madvise(map, size_, MADV_SEQUENTIAL);
+      data_ = static_cast<const char*>(map);
+    }
+  ::close(file);
+#else
+  ifstream file{ path, ios::binary | ios::ate };
+  if (!file)
+    throw runtime_error("Kan inte öppna " + path);
+  buffer_.resize(static_cast<size_t>(file.tellg()));
+  file.seekg(0);
+  file.read(buffer_.data(), static_cast<streamsize>(buffer_.size()));
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+#endif
+}
+
+Mapped_File::~Mapped_File()
+{
+#ifdef MMAP_AVAILABLE
+  if (data_ != nullptr)
+    ::munmap(const_cast<char*>(data_), size_);
+#endif
+}
+
+string_view Mapped_File::text() const
+{
+  return { data_, size_ };
+}
+
+double Load_Report::bytes_per_second() const
+{
+  return seconds > 0 ? bytes / seconds : 0;
+}
+
+double Load_Report::expressions_per_second() const
+{
+  return seconds > 0 ? expressions / seconds : 0;
+}
+
+Load_Report load_expressions(const string& path, vector<Expression>& expressions,
+			     const shared_ptr<Node_Pool>& pool)
+{
+  const auto start = chrono::steady_clock::now();
+  const Mapped_File file{ path };
+  string_view text{ file.text() };
+
+  Load_Report report;
+  report.bytes = text.size();
+
+  for (size_t number = 1; !text.empty(); ++number)
+    {
+      const char* end = static_cast<const char*>(memchr(text.data(), '\n', text.size()));
+      const size_t length = end != nullptr ? static_cast<size_t>(end - text.data()) : text.size();
+      string_view line{ text.substr(0, length) };
+      text.remove_prefix(end != nullptr ? length + 1 : length);
+
+      if (!line.empty() && line.back() == '\r')
+	line.remove_suffix(1);
+      if (line.find_first_not_of(" \t") == string_view::npos)
+	continue;
+
+      try
+	{
+	  expressions.push_back(parse_expression(line, pool ? pool : make_shared<Node_Pool>()));
+	  ++report.expressions;
+	}
+      catch (const exception& e)
+	{
+	  string message{ e.what() };
+	  if (!message.empty() && message.back() == '\n')
+	    message.pop_back();
+	  report.failures.emplace_back(number, std::move(message));
+	}
+    }
+
+  report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  return report;
+}
+
+Load_Report load_expressions(const string& path, vector<Expression>& expressions)
+{
+  return load_expressions(path, expressions, nullptr);
+}
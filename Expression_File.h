@@ -0,0 +1,65 @@
+/*
+ * Expression_File.h
+ */
+#ifndef EXPRESSION_FILE_H
+#define EXPRESSION_FILE_H
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+class Expression;
+class Node_Pool;
+
+/**
+ * Mapped_File avbildar en hel fil i minnet, endast för läsning. Innehållet
+ * nås som en string_view utan att kopieras.
+ */
+class Mapped_File
+{
+ public:
+  explicit Mapped_File(const std::string& path);
+  ~Mapped_File();
+
+  Mapped_File(const Mapped_File&) = delete;
+  Mapped_File& operator=(const Mapped_File&) = delete;
+
+  std::string_view text() const;
+
+ private:
+  const char* data_{ nullptr };
+  std::size_t size_{ 0 };
+  std::vector<char> buffer_;   // används där mmap saknas
+};
+
+/**
+ * Load_Report sammanfattar en inläsning med load_expressions(). failures
+ * innehåller radnummer och felmeddelande för rader som inte kunde parsas.
+ */
+struct Load_Report
+{
+  std::size_t bytes{ 0 };
+  std::size_t expressions{ 0 };
+  double      seconds{ 0 };
+  std::vector<std::pair<std::size_t, std::string>> failures;
+
+  double bytes_per_second() const;
+  double expressions_per_second() const;
+};
+
+/**
+ * load_expressions() läser en fil med ett infixuttryck per rad och lägger
+ * uttrycken sist i expressions, med noderna i pool, eller i en egen pool
+ * per uttryck när ingen pool anges. Filen avbildas i minnet och varje rad
+ * parsas direkt i den. Tomma rader hoppas över; rader som inte kan parsas
+ * hoppas över och rapporteras.
+ */
+Load_Report load_expressions(const std::string& path,
+                             std::vector<Expression>& expressions,
+                             const std::shared_ptr<Node_Pool>& pool);
+Load_Report load_expressions(const std::string& path,
+                             std::vector<Expression>& expressions);
+
+#endif
@@ -3,339 +3,1292 @@
  */
 #include <iostream>
 #include "Expression_Tree.h"
+#include "Node_Pool.h"
 #include <iomanip>
+#include <charconv>
 #include <cmath>
-#include <sstream>
 #include <string>
-#include <typeinfo>
+#include <string_view>
+#include <limits>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 using namespace std;
 
-std::string Binary_Operator::get_postfix() const
+namespace
 {
-  return operator_child_left_->get_postfix() + " " + operator_child_right_->get_postfix() + " " + str();
-}
+  // constant_value() ger vardet om noden ar en konstant: Integer, Real
+  // eller 0 - c, som make_constant() skriver negativa tal.
+  bool constant_value(const Expression_Tree* node, long double& value)
+  {
+    switch (node->kind())
+      {
+      case Node_Kind::Minus:
+	{
+	  auto minus = static_cast<const Binary_Operator*>(node);
+	  if (minus->left()->kind() != Node_Kind::Integer ||
+	      static_cast<const Integer*>(minus->left())->big_exact() != nullptr ||
+	      static_cast<const Integer*>(minus->left())->get_value() != 0 ||
+	      minus->right()->kind() >= Node_Kind::Variable ||
+	      !constant_value(minus->right(), value))
+	    return false;
+	  value = -value;
+	  return true;
+	}
+      case Node_Kind::Integer:
+	value = static_cast<const Integer*>(node)->big_exact() != nullptr
+	  ? static_cast<const Integer*>(node)->big_exact()->to_long_double()
+	  : static_cast<long double>(static_cast<const Integer*>(node)->get_value());
+	return true;
+      case Node_Kind::Real:
+	value = static_cast<const Real*>(node)->get_value();
+	return true;
+      default:
+	return false;
+      }
+  }
 
+  bool is_constant(const Expression_Tree* node, long double value)
+  {
+    long double v;
+    return constant_value(node, v) && v == value;
+  }
 
-string Binary_Operator::get_infix() const
-{
-  Binary_Operator * pointer_right;
-  Binary_Operator * pointer_left;
-  pointer_right = dynamic_cast<Binary_Operator*>(operator_child_right_);
-  pointer_left = dynamic_cast<Binary_Operator*>(operator_child_left_);
-  string str_operator_right = operator_child_right_->get_infix();
-  string str_operator_left = operator_child_left_->get_infix();
-  if(pointer_right)
+  // make_constant() skapar ett Integer-lov om vardet ar ett heltal som
+  // ryms i en int64_t, annars ett Real-lov. Ett negativt tal c blir 0 - |c|,
+  // sa att resultatet kan skrivas som infix och parsas igen.
+  Expression_Tree* make_constant(long double value, Node_Pool& pool)
+  {
+    if (value < 0)
+      return pool.make_binary(Node_Kind::Minus, pool.make_integer(0),
+			      make_constant(-value, pool));
+    constexpr long double limit = 9223372036854775808.0L;
+    if (value == std::trunc(value) && value >= -limit && value < limit)
+      return pool.make_integer(static_cast<int64_t>(value));
+    return pool.make_real(value);
+  }
+
+  // small_value() ger vardet av ett heltal eller av ett heltalsdeltrad vars
+  // exakta varde ryms i int64_t.
+  bool small_value(const Expression_Tree* node, int64_t& value)
+  {
+    if (node->kind() == Node_Kind::Integer)
+      {
+	value = static_cast<const Integer*>(node)->get_value();
+	return static_cast<const Integer*>(node)->big_exact() == nullptr;
+      }
+    return node->kind() >= Node_Kind::Plus &&
+      static_cast<const Binary_Operator*>(node)->small_exact(value);
+  }
+
+  // big_value() ger vardet av ett heltal eller ett heltalsdeltrad som inte
+  // ryms i int64_t men redan ar beraknat, annars nullptr.
+  const Big_Integer* big_value(const Expression_Tree* node)
+  {
+    if (node->kind() == Node_Kind::Integer)
+      return static_cast<const Integer*>(node)->big_exact();
+    if (node->kind() >= Node_Kind::Plus)
+      return static_cast<const Binary_Operator*>(node)->big_exact();
+    return nullptr;
+  }
+
+  // known_value() ger vardet om det redan ar kant, som int64_t eller
+  // Big_Integer.
+  bool known_value(const Expression_Tree* node, Big_Integer& value)
+  {
+    int64_t small;
+    if (small_value(node, small))
+      {
+	value = Big_Integer{ small };
+	return true;
+      }
+    if (const Big_Integer* big = big_value(node))
+      {
+	value = *big;
+	return true;
+      }
+    return false;
+  }
+
+  // Tier ar ett delresultat i ett heltalsdeltrad: exakt i value, eller
+  // approximativt i approx nar det inte blev ett heltal.
+  template <typename T>
+  struct Tier
+  {
+    Big_Integer value;
+    T           approx{};
+    bool        exact{ true };
+
+    T get() const { return exact ? static_cast<T>(value.to_long_double()) : approx; }
+  };
+
+  // Storre exakta varden an sa blir anda oandliga som long double.
+  constexpr size_t max_exact_bits{ 16448 };
+
+  // combine() beraknar left = left op right. Potenser med icke-negativ
+  // exponent beraknas med upprepad kvadrering.
+  template <typename T>
+  void combine(Node_Kind kind, Tier<T>& left, const Tier<T>& right)
+  {
+    if (left.exact && right.exact)
+      {
+	const size_t l = left.value.bit_length();
+	const size_t r = right.value.bit_length();
+	switch (kind)
+	  {
+	  case Node_Kind::Plus:
+	    if (max(l, r) < max_exact_bits)
+	      {
+		left.value = left.value + right.value;
+		return;
+	      }
+	    break;
+	  case Node_Kind::Minus:
+	    if (max(l, r) < max_exact_bits)
+	      {
+		left.value = left.value - right.value;
+		return;
+	      }
+	    break;
+	  case Node_Kind::Times:
+	    if (l + r <= max_exact_bits)
+	      {
+		left.value = left.value * right.value;
+		return;
+	      }
+	    break;
+	  default:
+	    if (!right.value.negative() && right.value.small() &&
+		(l <= 1 || static_cast<uint64_t>(right.value.to_int64()) <= max_exact_bits / l))
+	      {
+		left.value = Big_Integer::power(left.value,
+						static_cast<uint64_t>(right.value.to_int64()));
+		return;
+	      }
+	    break;
+	  }
+      }
+
+    const T l = left.get();
+    const T r = right.get();
+    switch (kind)
+      {
+      case Node_Kind::Plus:  left.approx = l + r; break;
+      case Node_Kind::Minus: left.approx = l - r; break;
+      case Node_Kind::Times: left.approx = l * r; break;
+      default:               left.approx = pow(l, r); break;
+      }
+    left.exact = false;
+  }
+
+  // evaluate_integral() gar igenom ett heltalsdeltrad i postordning med en
+  // egen stack, som Expression_Tree::walk(). Deltrad vars exakta varde
+  // redan ar beraknat behandlas som lov.
+  template <typename T>
+  Tier<T> evaluate_integral(const Expression_Tree* root)
+  {
+    struct Frame
     {
-      str_operator_right = '(' + str_operator_right + ')';
-    }
-  if(pointer_left)
+      const Binary_Operator* node;
+      bool                   right;
+    };
+    thread_local vector<Frame>   frames;
+    thread_local vector<Tier<T>> values;
+    frames.clear();
+    values.clear();
+
+    Tier<T> result;
+    const Expression_Tree* node = root;
+    for (;;)
+      {
+	while (!known_value(node, result.value))
+	  {
+	    auto binary = static_cast<const Binary_Operator*>(node);
+	    frames.push_back({ binary, false });
+	    node = binary->left();
+	  }
+	result.exact = true;
+
+	for (;;)
+	  {
+	    if (frames.empty())
+	      return result;
+
+	    Frame& frame = frames.back();
+	    if (!frame.right)
+	      {
+		frame.right = true;
+		values.push_back(std::move(result));
+		node = frame.node->right();
+		break;
+	      }
+
+	    combine(frame.node->kind(), values.back(), result);
+	    result = std::move(values.back());
+	    values.pop_back();
+	    frames.pop_back();
+	  }
+      }
+  }
+
+  // fold_integers() viker en heltalsoperator med tva heltal som barn. Ett
+  // exakt resultat som inte ryms i int64_t lamnas oviket, sa att det
+  // fortsatter att beraknas exakt, och likasa ett som inte blev ett heltal
+  // och inte ar andligt; andra blir Real. Negativa resultat blir 0 - |c|,
+  // som i make_constant().
+  bool fold_integers(Node_Kind kind, Expression_Tree* left, Expression_Tree* right,
+		     Node_Pool& pool, Expression_Tree*& result)
+  {
+    if (left->kind() != Node_Kind::Integer || right->kind() != Node_Kind::Integer)
+      return false;
+
+    Tier<long double> value;
+    known_value(left, value.value);
+    Tier<long double> other;
+    known_value(right, other.value);
+    combine(kind, value, other);
+
+    if (!value.exact)
+      result = isfinite(value.approx) ? make_constant(value.approx, pool)
+	                              : pool.make_binary(kind, left, right);
+    else if (!value.value.small())
+      result = pool.make_binary(kind, left, right);
+    else if (value.value.negative())
+      result = pool.make_binary(Node_Kind::Minus, pool.make_integer(0),
+				pool.make_integer(Big_Integer{ 0 } - value.value));
+    else
+      result = pool.make_integer(value.value.to_int64());
+    return true;
+  }
+
+  thread_local Evaluation_Scope* current_scope{ nullptr };
+
+  // String_Sink och Stream_Sink tar emot texten fran render().
+  struct String_Sink
+  {
+    string& out;
+    void operator()(char c) { out += c; }
+    void operator()(string_view text) { out.append(text); }
+  };
+
+  struct Stream_Sink
+  {
+    ostream& os;
+    void operator()(char c) { os.put(c); }
+    void operator()(string_view text) { os.write(text.data(), text.size()); }
+  };
+
+  // symbol() ar operatorns tecken, samma som str().
+  string_view symbol(Node_Kind kind)
+  {
+    static constexpr string_view symbols[]{ "+", "-", "*", "/", "^", "=" };
+    return symbols[static_cast<int>(kind) - static_cast<int>(Node_Kind::Plus)];
+  }
+
+  // write_leaf() skriver ett lov som str() men utan att skapa en strang,
+  // utom for reella tal som inte far plats i buffer.
+  template <typename Sink>
+  void write_leaf(const Expression_Tree* node, Sink& sink)
+  {
+    char buffer[64];
+    switch (node->kind())
+      {
+      case Node_Kind::Integer:
+	if (const Big_Integer* big = static_cast<const Integer*>(node)->big_exact())
+	  sink(big->str());
+	else
+	  {
+	    const auto end = to_chars(begin(buffer), std::end(buffer),
+				      static_cast<const Integer*>(node)->get_value()).ptr;
+	    sink(string_view(buffer, end - buffer));
+	  }
+	break;
+      case Node_Kind::Real:
+	{
+	  const long double value = static_cast<const Real*>(node)->get_value();
+	  const auto result = to_chars(begin(buffer), std::end(buffer), value,
+				       chars_format::fixed);
+	  if (result.ec == errc{})
+	    sink(string_view(buffer, result.ptr - buffer));
+	  else
+	    sink(Real::format(value));
+	}
+	break;
+      default:
+	sink(static_cast<const Variable*>(node)->get_name());
+	break;
+      }
+  }
+
+  // render() skriver deltradet root som postfix eller infix till sink.
+  // Varje operatornod pa stacken har ett steg: 0 fore vanster barn, 1
+  // mellan barnen och 2 efter hoger barn. Stacken ateranvands mellan
+  // anropen, sa inget allokeras per nod.
+  template <typename Sink>
+  void render(const Expression_Tree* root, bool infix, Sink& sink)
+  {
+    struct Frame
     {
-      str_operator_left = '(' + str_operator_left + ')';
-    }
-  return str_operator_left + ' ' +str() + ' ' + str_operator_right;
+      const Binary_Operator* node;
+      int                    step;
+    };
+    thread_local vector<Frame> frames;
+    frames.clear();
+
+    // Barnen till en tilldelning far inga parenteser.
+    auto parenthesize = [infix](const Binary_Operator* parent, const Expression_Tree* child)
+      {
+	return infix && parent->kind() != Node_Kind::Assign && child->kind() >= Node_Kind::Plus;
+      };
+    auto enter = [&](const Expression_Tree* node)
+      {
+	if (node->kind() < Node_Kind::Plus)
+	  write_leaf(node, sink);
+	else
+	  frames.push_back({ static_cast<const Binary_Operator*>(node), 0 });
+      };
+
+    enter(root);
+    while (!frames.empty())
+      {
+	const Binary_Operator* node = frames.back().node;
+	switch (frames.back().step++)
+	  {
+	  case 0:
+	    if (parenthesize(node, node->left()))
+	      sink('(');
+	    enter(node->left());
+	    break;
+	  case 1:
+	    if (parenthesize(node, node->left()))
+	      sink(')');
+	    sink(' ');
+	    if (infix)
+	      {
+		sink(symbol(node->kind()));
+		sink(' ');
+		if (parenthesize(node, node->right()))
+		  sink('(');
+	      }
+	    enter(node->right());
+	    break;
+	  default:
+	    if (!infix)
+	      {
+		sink(' ');
+		sink(symbol(node->kind()));
+	      }
+	    else if (parenthesize(node, node->right()))
+	      sink(')');
+	    frames.pop_back();
+	    break;
+	  }
+      }
+  }
 }
 
+Evaluation_Scope::Evaluation_Scope(Mode mode)
+  : mode_(mode), previous_(current_scope)
+{
+  current_scope = this;
+}
 
-void Binary_Operator::print(std::ostream &os, const unsigned width) const 
+Evaluation_Scope::~Evaluation_Scope()
 {
-  operator_child_right_-> print(os, width+3);
-  os  << setw(width+2) << '/'     << endl
-      << setw(width+1) << str()       << endl
-      << setw(width+2) << '\\'        << endl ;
-  operator_child_left_-> print(os, width+3);
+  current_scope = previous_;
 }
 
-string Operand::get_postfix() const
+template <typename T>
+T Binary_Operator::apply(T left, T right, Environment& environment) const
 {
-  return str();
+  switch (kind())
+    {
+    case Node_Kind::Plus:
+      return left + right;
+    case Node_Kind::Minus:
+      return left - right;
+    case Node_Kind::Times:
+      return left * right;
+    case Node_Kind::Divide:
+      if (right == 0)
+	throw expression_tree_error("Division med 0");
+      return left / right;
+    case Node_Kind::Power:
+      return pow(left, right);
+    default:
+      // En tilldelnings vansterled beraknas inte; bara dess slot anvands.
+      if (operator_child_left_->kind() != Node_Kind::Variable)
+	throw expression_tree_error(Assign::invalid_target);
+      environment.set(static_cast<const Variable*>(operator_child_left_)->get_slot(), right);
+      return right;
+    }
 }
 
-string Operand:: get_infix() const
+template float       Binary_Operator::apply<float>(float, float, Environment&) const;
+template double      Binary_Operator::apply<double>(double, double, Environment&) const;
+template long double Binary_Operator::apply<long double>(long double, long double,
+                                                         Environment&) const;
+
+void Expression_Tree::write_postfix(string& out) const
 {
-  return str();
+  String_Sink sink{ out };
+  render(this, false, sink);
 }
 
-void Operand::print(ostream &os, const unsigned width) const 
+void Expression_Tree::write_postfix(ostream& os) const
 {
-  os <<setw(width-1)<<right<<" "<< str() <<endl;
+  Stream_Sink sink{ os };
+  render(this, false, sink);
 }
 
-std::string Plus::str() const 
+void Expression_Tree::write_infix(string& out) const
 {
-  return "+";
+  String_Sink sink{ out };
+  render(this, true, sink);
 }
 
-Plus* Plus::clone() const 
+void Expression_Tree::write_infix(ostream& os) const
+{
+  Stream_Sink sink{ os };
+  render(this, true, sink);
+}
+
+/*
+ * walk() gar igenom deltradet i postordning med en explicit stack av
+ * operatornoder och en stack av varden. Lov och noder vars varde finns i
+ * scopet laggs direkt pa vardestacken. Sparade varden ar long double;
+ * nodernas cache anvands bara nar T ocksa ar det, eftersom ett varde
+ * beraknat med lagre precision annars skulle ateranvandas.
+ */
+template <typename T>
+T Expression_Tree::walk(Environment& environment, bool lookup_root) const
 {
-  try
+  using Mode = Evaluation_Scope::Mode;
+  Mode mode = current_scope == nullptr ? Mode::Direct : current_scope->mode_;
+  if (!is_same_v<T, long double> && mode == Mode::Incremental)
+    mode = Mode::Direct;
+
+  auto remember = [&](const Expression_Tree* node, T value)
     {
-      return new Plus(*this);
-    }
-  catch (const bad_alloc& e)
+      if (mode == Mode::Incremental && node->pure_)
+	static_cast<const Binary_Operator*>(node)->remember(environment, value);
+      else if (mode == Mode::Memoized && node->shared())
+	current_scope->values_.emplace(node, value);
+    };
+
+  // lookup() ger vardet om det ar kant utan att barnen besoks: lov,
+  // varden i scopet (om use_scope) och heltalsdeltrad, som beraknas exakt.
+  auto lookup = [&](const Expression_Tree* node, T& value, bool use_scope)
     {
-      throw expression_tree_error{e.what()};
+      switch (node->kind_)
+	{
+	case Node_Kind::Integer:
+	  value = static_cast<T>(static_cast<const Integer*>(node)->evaluate(environment));
+	  return true;
+	case Node_Kind::Real:
+	  value = static_cast<T>(static_cast<const Real*>(node)->get_value());
+	  return true;
+	case Node_Kind::Variable:
+	  value = static_cast<T>(environment.get(static_cast<const Variable*>(node)->get_slot()));
+	  return true;
+	default:
+	  break;
+	}
+      int64_t small;
+      if (static_cast<const Binary_Operator*>(node)->small_exact(small))
+	{
+	  value = static_cast<T>(small);
+	  return true;
+	}
+      long double saved;
+      if (use_scope && mode == Mode::Incremental && node->pure_ &&
+	  static_cast<const Binary_Operator*>(node)->cached(environment, saved))
+	{
+	  value = static_cast<T>(saved);
+	  return true;
+	}
+      if (use_scope && mode == Mode::Memoized && node->shared())
+	{
+	  auto it = current_scope->values_.find(node);
+	  if (it != current_scope->values_.end())
+	    {
+	      value = static_cast<T>(it->second);
+	      return true;
+	    }
+	}
+      if (node->integral_)
+	{
+	  value = node->exact_value<T>();
+	  if (use_scope)
+	    remember(node, value);
+	  return true;
+	}
+      return false;
+    };
+
+  T result;
+  if (kind_ < Node_Kind::Plus)
+    {
+      lookup(this, result, false);
+      return result;
     }
-  catch (...)
+
+  // Stacken har en post per operatornod under berakning, med vanster
+  // barns varde i values nar hoger barn beraknas.
+  struct Frame
+  {
+    const Binary_Operator* node;
+    bool                   right;
+  };
+  thread_local vector<Frame>       frames;
+  thread_local vector<T>           values;
+  frames.clear();
+  values.clear();
+
+  const Expression_Tree* node = this;
+  for (;;)
     {
-      throw expression_tree_error("Plus::clone() something went wrong here");
-    }       
+      // Ga nerat langs vanstra barn tills ett varde ar kant. En tilldelning
+      // kontrollerar sitt vansterled i stallet for att berakna det.
+      while (!lookup(node, result, node != this || lookup_root))
+	{
+	  auto binary = static_cast<const Binary_Operator*>(node);
+	  if (node->kind_ == Node_Kind::Assign)
+	    {
+	      if (binary->left()->kind() != Node_Kind::Variable)
+		throw expression_tree_error(Assign::invalid_target);
+	      values.push_back(0);
+	      frames.push_back({ binary, true });
+	      node = binary->right();
+	    }
+	  else
+	    {
+	      frames.push_back({ binary, false });
+	      node = binary->left();
+	    }
+	}
+
+      // Ga uppat och berakna noderna vars barn ar klara.
+      for (;;)
+	{
+	  if (frames.empty())
+	    return result;
+
+	  Frame& frame = frames.back();
+	  if (!frame.right)
+	    {
+	      frame.right = true;
+	      values.push_back(result);
+	      node = frame.node->right();
+	      break;
+	    }
+
+	  const Binary_Operator* binary = frame.node;
+	  // De vanligaste operatorerna beraknas direkt, ovriga med apply().
+	  const T left = values.back();
+	  switch (binary->kind_)
+	    {
+	    case Node_Kind::Plus:  result = left + result; break;
+	    case Node_Kind::Minus: result = left - result; break;
+	    case Node_Kind::Times: result = left * result; break;
+	    default:
+	      result = binary->apply(left, result, environment);
+	      break;
+	    }
+	  values.pop_back();
+	  frames.pop_back();
+	  if (binary != this || lookup_root)
+	    remember(binary, result);
+	}
+    }
 }
 
-long double Plus::evaluate() const
+template <typename T>
+T Expression_Tree::value(Environment& environment) const
 {
-  if (!operator_child_left_ || !operator_child_right_)
-    throw expression_tree_error("Plus::evaluate()   saknar operander");
+  return walk<T>(environment, true);
+}
+
+template float       Expression_Tree::value<float>(Environment&) const;
+template double      Expression_Tree::value<double>(Environment&) const;
+template long double Expression_Tree::value<long double>(Environment&) const;
 
-  return operator_child_right_->evaluate() + operator_child_left_-> evaluate();
+/*
+ * En tilldelning i roten sker efter allt annat. Andra tilldelningar kan
+ * andra en variabel mellan tva anvandningar av samma deltrad.
+ */
+bool Expression_Tree::reusable() const
+{
+  if (pure_)
+    return true;
+  return kind_ == Node_Kind::Assign &&
+    static_cast<const Binary_Operator*>(this)->right()->pure();
 }
 
-std::string Minus::str() const
+template <typename T>
+T Expression_Tree::exact_value() const
 {
-  return "-";
+  int64_t small;
+  if (small_value(this, small))
+    return static_cast<T>(small);
+  if (const Big_Integer* big = big_value(this))
+    return static_cast<T>(big->to_long_double());
+  return evaluate_integral<T>(this).get();
 }
 
-Minus* Minus::clone() const 
+template float       Expression_Tree::exact_value<float>() const;
+template double      Expression_Tree::exact_value<double>() const;
+template long double Expression_Tree::exact_value<long double>() const;
+
+bool Expression_Tree::exact(Big_Integer& result) const
 {
-  try
-    {
-      return new Minus(*this);
-    }
-  catch (const bad_alloc& e)
-    {
-      throw expression_tree_error{e.what()};
-    }
-  catch (...)
+  if (!integral_)
+    return false;
+  Tier<long double> value = evaluate_integral<long double>(this);
+  if (!value.exact)
+    return false;
+  result = std::move(value.value);
+  return true;
+}
+
+bool Binary_Operator::combine_small(Node_Kind kind, const Expression_Tree* left,
+                                    const Expression_Tree* right, int64_t& value)
+{
+  int64_t l, r;
+  if (!small_value(left, l) || !small_value(right, r))
+    return false;
+
+  switch (kind)
     {
-      throw expression_tree_error("Plus::clone() ngot gick fel hr!");
+    case Node_Kind::Plus:
+      return !__builtin_add_overflow(l, r, &value);
+    case Node_Kind::Minus:
+      return !__builtin_sub_overflow(l, r, &value);
+    case Node_Kind::Times:
+      return !__builtin_mul_overflow(l, r, &value);
+    default:
+      {
+	// Upprepad kvadrering. Om basen behover kvadreras igen anvands den
+	// ocksa, sa spill dar betyder att resultatet inte ryms.
+	if (r < 0)
+	  return false;
+	int64_t result{ 1 };
+	for (uint64_t exponent = static_cast<uint64_t>(r); exponent > 0; exponent >>= 1)
+	  {
+	    if ((exponent & 1) && __builtin_mul_overflow(result, l, &result))
+	      return false;
+	    if (exponent > 1 && __builtin_mul_overflow(l, l, &l))
+	      return false;
+	  }
+	value = result;
+	return true;
+      }
     }
 }
 
-long double Minus::evaluate() const
+/*
+ * Ett rent deltrad andrar inte miljon, sa klockan ar densamma fore och
+ * efter berakningen och kan anvandas som tidpunkt for vardet.
+ */
+bool Binary_Operator::cached(const Environment& environment, long double& value) const
 {
-  if(!operator_child_left_ || !operator_child_right_)
-    throw expression_tree_error("Minus::evaluate() saknar operand(er)");
-  return operator_child_right_->evaluate() - operator_child_left_->evaluate();
+  if (cache_environment_ != environment.id() ||
+      !environment.unchanged_since(cache_stamp_, dependencies()))
+    return false;
+  value = cache_value_;
+  return true;
 }
-std::string Times::str() const
+
+void Binary_Operator::remember(const Environment& environment, long double value) const
 {
-  return "*";
+  cache_value_ = value;
+  cache_environment_ = environment.id();
+  cache_stamp_ = environment.clock();
 }
 
-Times* Times::clone() const
+long double Binary_Operator::evaluate(Environment& environment) const
 {
-  try
-    {
-      return new Times(*this);
-    }
-  catch (const bad_alloc& e)
-    {
-      throw expression_tree_error{e.what()};
-    }
-  catch (...)
-    {
-      throw expression_tree_error("Times::clone() ngot gick fel hr");
-    }       
+  return walk<long double>(environment, false);
 }
 
-long double Times::evaluate() const
+void Binary_Operator::compile(Compiled_Expression& program) const
 {
-  if(!operator_child_left_ || !operator_child_right_)
-    throw expression_tree_error("Minus::evaluate() saknar operand(er)");
-  return operator_child_right_->evaluate() * operator_child_left_->evaluate();
+  program.emit_tree(this);
 }
 
-std::string Divide::str() const 
+std::string Binary_Operator::get_postfix() const
 {
-  return "/";
+  string result;
+  write_postfix(result);
+  return result;
 }
 
-Divide* Divide::clone() const
+
+string Binary_Operator::get_infix() const
 {
-  try
-    {
-      return new Divide(*this);
-    }
-  catch (const bad_alloc& e)
+  string result;
+  write_infix(result);
+  return result;
+}
+
+
+/*
+ * optimize() bygger en optimerad kopia av tradet i pool, nerifran och upp.
+ */
+Expression_Tree* Binary_Operator::optimize(Node_Pool& pool) const
+{
+  struct Frame
+  {
+    const Binary_Operator* node;
+    int                    step;
+  };
+  vector<Frame>            frames;
+  vector<Expression_Tree*> results;
+  // Delade noder optimeras bara en gang.
+  unordered_map<const Expression_Tree*, Expression_Tree*> optimized;
+
+  auto enter = [&](const Expression_Tree* node)
     {
-      throw expression_tree_error{e.what()};
-    }
-  catch(...)
+      if (node->kind() < Node_Kind::Plus)
+	{
+	  results.push_back(node->optimize(pool));
+	  return;
+	}
+      if (node->shared())
+	{
+	  auto it = optimized.find(node);
+	  if (it != optimized.end())
+	    {
+	      results.push_back(it->second);
+	      return;
+	    }
+	}
+      frames.push_back({ static_cast<const Binary_Operator*>(node), 0 });
+    };
+
+  frames.push_back({ this, 0 });
+  while (!frames.empty())
     {
-      throw expression_tree_error("Divide::clone() ngot gick fel hr");
+      const Binary_Operator* node = frames.back().node;
+      const int step = frames.back().step++;
+      if (step < 2)
+	{
+	  enter(step == 0 ? node->left() : node->right());
+	  continue;
+	}
+
+      Expression_Tree* right = results.back();
+      results.pop_back();
+      results.back() = simplify(node->kind(), results.back(), right, pool);
+      if (node->shared())
+	optimized.emplace(node, results.back());
+      frames.pop_back();
     }
+  return results.back();
 }
 
-long double Divide::evaluate()  const
+/*
+ * derive() bygger derivatan nerifran och upp med summa-, produkt-, kvot-
+ * och potensregeln. Varje ny nod forenklas med simplify() direkt, och ett
+ * deltrad utan variabeln far derivatan 0 utan att besokas, sa termer som
+ * ar noll aldrig byggs. Varje operatornod deriveras en gang, och lika
+ * deltrad ar samma nod i poolen, sa resultatet vaxer linjart med tradet.
+ * Potenser med variabeln i exponenten kraver en konstant positiv bas, och
+ * tilldelningar kan inte deriveras.
+ */
+Expression_Tree* Binary_Operator::derive(size_t slot, Node_Pool& pool) const
 {
+  Expression_Tree* const zero = pool.make_integer(0);
+  const uint64_t mask = Environment::mask(slot);
 
-  long double right = 0;
-  right = operator_child_right_ -> evaluate(); 
-  if(!operator_child_left_ || !operator_child_right_)
+  // make() ar simplify(), som skriver negativa konstanter som 0 - c, sa
+  // att resultatet kan skrivas som infix och parsas igen.
+  auto make = [&](Node_Kind kind, Expression_Tree* left, Expression_Tree* right)
     {
-      throw expression_tree_error("Divde::clone() saknar operand(er)");
-    }
-  else if (right == 0)
+      return simplify(kind, left, right, pool);
+    };
+
+  // rule() ger derivatan av node ur barnens derivator du och dv.
+  auto rule = [&](const Binary_Operator* node, Expression_Tree* du, Expression_Tree* dv)
     {
-      throw expression_tree_error("Division med 0");
-    }
-  else
+      Expression_Tree* const u = node->operator_child_left_;
+      Expression_Tree* const v = node->operator_child_right_;
+      const bool u_constant = is_constant(du, 0);
+      const bool v_constant = is_constant(dv, 0);
+      switch (node->kind())
+	{
+	case Node_Kind::Plus:
+	  return make(Node_Kind::Plus, du, dv);
+	case Node_Kind::Minus:
+	  return make(Node_Kind::Minus, du, dv);
+	case Node_Kind::Times:
+	  if (u_constant)
+	    return v_constant ? zero : make(Node_Kind::Times, u, dv);
+	  if (v_constant)
+	    return make(Node_Kind::Times, du, v);
+	  return make(Node_Kind::Plus, make(Node_Kind::Times, du, v),
+		      make(Node_Kind::Times, u, dv));
+	case Node_Kind::Divide:
+	  if (v_constant)
+	    return u_constant ? zero : make(Node_Kind::Divide, du, v);
+	  return make(Node_Kind::Divide,
+		      make(Node_Kind::Minus,
+			   u_constant ? zero : make(Node_Kind::Times, du, v),
+			   make(Node_Kind::Times, u, dv)),
+		      make(Node_Kind::Power, v, pool.make_integer(2)));
+	case Node_Kind::Power:
+	  if (v_constant)
+	    {
+	      if (u_constant)
+		return zero;
+	      Expression_Tree* const exponent =
+		make(Node_Kind::Minus, v, pool.make_integer(1));
+	      return make(Node_Kind::Times,
+			  make(Node_Kind::Times, v, make(Node_Kind::Power, u, exponent)),
+			  du);
+	    }
+	  {
+	    long double base;
+	    if (u->integral())
+	      base = u->exact_value<long double>();
+	    else if (!u_constant || !constant_value(u, base))
+	      throw expression_tree_error("Kan inte derivera en potens med variabel "
+					  "exponent och icke konstant bas");
+	    if (!(base > 0))
+	      throw expression_tree_error("Kan inte derivera en potens med "
+					  "variabel exponent och bas <= 0");
+	    if (base == 1)
+	      return zero;
+	    return make(Node_Kind::Times,
+			make(Node_Kind::Times, const_cast<Binary_Operator*>(node),
+			     make_constant(log(base), pool)),
+			dv);
+	  }
+	default:
+	  throw expression_tree_error("Kan inte derivera en tilldelning");
+	}
+    };
+
+  struct Frame
+  {
+    const Binary_Operator* node;
+    int                    step;
+  };
+  vector<Frame>            frames;
+  vector<Expression_Tree*> results;
+  unordered_map<const Expression_Tree*, Expression_Tree*> derived;
+
+  auto enter = [&](const Expression_Tree* node)
+    {
+      if ((node->dependencies() & mask) == 0 && node->pure())
+	{
+	  results.push_back(zero);
+	  return;
+	}
+      if (node->kind() < Node_Kind::Plus)
+	{
+	  results.push_back(node->derive(slot, pool));
+	  return;
+	}
+      auto it = derived.find(node);
+      if (it != derived.end())
+	{
+	  results.push_back(it->second);
+	  return;
+	}
+      frames.push_back({ static_cast<const Binary_Operator*>(node), 0 });
+    };
+
+  enter(this);
+  while (!frames.empty())
     {
-      return operator_child_left_->evaluate() / right; 
-    }       
+      const Binary_Operator* node = frames.back().node;
+      const int step = frames.back().step++;
+      if (step < 2)
+	{
+	  enter(step == 0 ? node->left() : node->right());
+	  continue;
+	}
+
+      Expression_Tree* const dv = results.back();
+      results.pop_back();
+      results.back() = rule(node, results.back(), dv);
+      derived.emplace(node, results.back());
+      frames.pop_back();
+    }
+  return results.back();
 }
 
-std::string Power::str() const
+/*
+ * rebalance() bygger tradet pa nytt i pool, nerifran och upp. En kedja ar
+ * rena noder av samma slag, + eller *, under varandra; den blir ett
+ * balanserat trad over kedjans operander i samma ordning, med djupet
+ * log2 av antalet operander. Delade noder inne i en kedja behalls som
+ * operander, sa att de fortfarande ar delade. Ovriga noder byggs om med
+ * sina omgrupperade barn, och heltalsdeltrad lamnas ororda.
+ */
+Expression_Tree* Binary_Operator::rebalance(Node_Pool& pool) const
 {
-  return "^";
+  // operands ar barnen, eller kedjans operander, och base var resultatens
+  // antal nar noden paborjades.
+  struct Frame
+  {
+    const Binary_Operator*         node;
+    vector<const Expression_Tree*> operands;
+    size_t                         next;
+    size_t                         base;
+  };
+  vector<Frame>            frames;
+  vector<Expression_Tree*> results;
+  unordered_map<const Expression_Tree*, Expression_Tree*> rebuilt;
+
+  auto enter = [&](const Expression_Tree* node)
+    {
+      if (node->kind() < Node_Kind::Plus || node->integral())
+	{
+	  results.push_back(const_cast<Expression_Tree*>(node));
+	  return;
+	}
+      if (node->shared())
+	{
+	  auto it = rebuilt.find(node);
+	  if (it != rebuilt.end())
+	    {
+	      results.push_back(it->second);
+	      return;
+	    }
+	}
+
+      auto binary = static_cast<const Binary_Operator*>(node);
+      Frame frame{ binary, {}, 0, results.size() };
+      const Node_Kind kind = node->kind();
+      if ((kind == Node_Kind::Plus || kind == Node_Kind::Times) && node->pure())
+	{
+	  vector<const Expression_Tree*> pending{ node };
+	  while (!pending.empty())
+	    {
+	      const Expression_Tree* member = pending.back();
+	      pending.pop_back();
+	      if (member->kind() == kind && !member->integral() &&
+		  (member == node || !member->shared()))
+		{
+		  auto inner = static_cast<const Binary_Operator*>(member);
+		  pending.push_back(inner->right());
+		  pending.push_back(inner->left());
+		}
+	      else
+		frame.operands.push_back(member);
+	    }
+	}
+      else
+	frame.operands = { binary->left(), binary->right() };
+      frames.push_back(std::move(frame));
+    };
+
+  enter(this);
+  while (!frames.empty())
+    {
+      Frame& frame = frames.back();
+      if (frame.next < frame.operands.size())
+	{
+	  enter(frame.operands[frame.next++]);
+	  continue;
+	}
+
+      // Operanderna slas ihop parvis, niva for niva.
+      const Node_Kind kind = frame.node->kind();
+      const size_t base = frame.base;
+      size_t count = results.size() - base;
+      while (count > 1)
+	{
+	  size_t out = base;
+	  for (size_t i = 0; i < count; i += 2)
+	    results[out++] = i + 1 < count
+	      ? pool.make_binary(kind, results[base + i], results[base + i + 1])
+	      : results[base + i];
+	  count = out - base;
+	}
+      results.resize(base + 1);
+      if (frame.node->shared())
+	rebuilt.emplace(frame.node, results.back());
+      frames.pop_back();
+    }
+  return results.back();
 }
 
-Power* Power::clone() const
+/*
+ * simplify() viker konstanter och tar bort triviala operationer. x * 0
+ * forenklas inte, eftersom x kan vara oandligt eller NaN, och division med
+ * konstanten 0 lamnas kvar sa att felet kommer vid evalueringen. (x ^ a) ^ b
+ * blir x ^ (a * b) bara for heltal a och b, da det galler for alla x, och
+ * x ^ 0 ar 1 aven for NaN, men bara ett rent x tas bort; en tilldelning
+ * i x maste fortfarande ske. Ett vansterled i en tilldelning som inte ar en
+ * variabel ger fortfarande fel vid evalueringen. Konstanter som inte blir
+ * andliga viks inte, eftersom inf och nan inte kan skrivas som infix.
+ */
+Expression_Tree* Binary_Operator::simplify(Node_Kind kind, Expression_Tree* left,
+                                           Expression_Tree* right, Node_Pool& pool)
 {
-  try
+  auto fold = [&](long double value)
     {
-      return new Power(*this);
-    }
-  catch (const bad_alloc& e)
+      return isfinite(value) ? make_constant(value, pool) : pool.make_binary(kind, left, right);
+    };
+
+  Expression_Tree* folded;
+  long double l, r;
+  switch (kind)
     {
-      throw expression_tree_error{e.what()};
+    case Node_Kind::Plus:
+      if (fold_integers(kind, left, right, pool, folded))
+	return folded;
+      if (constant_value(left, l) && constant_value(right, r))
+	return fold(l + r);
+      if (is_constant(right, 0))
+	return left;
+      if (is_constant(left, 0))
+	return right;
+      break;
+    case Node_Kind::Minus:
+      if (fold_integers(kind, left, right, pool, folded))
+	return folded;
+      if (constant_value(left, l) && constant_value(right, r))
+	return fold(l - r);
+      if (is_constant(right, 0))
+	return left;
+      break;
+    case Node_Kind::Times:
+      if (fold_integers(kind, left, right, pool, folded))
+	return folded;
+      if (constant_value(left, l) && constant_value(right, r))
+	return fold(l * r);
+      if (is_constant(right, 1))
+	return left;
+      if (is_constant(left, 1))
+	return right;
+      break;
+    case Node_Kind::Divide:
+      if (constant_value(left, l) && constant_value(right, r) && r != 0)
+	return fold(l / r);
+      if (is_constant(right, 1))
+	return left;
+      break;
+    case Node_Kind::Power:
+      {
+	if (fold_integers(kind, left, right, pool, folded))
+	  return folded;
+	const bool right_constant = constant_value(right, r);
+	if (constant_value(left, l) && right_constant)
+	  return fold(pow(l, r));
+	if (right_constant && r == 1)
+	  return left;
+	if (right_constant && r == 0 && left->pure())
+	  return make_constant(1, pool);
+
+	long double a;
+	if (left->kind() == Node_Kind::Power && right_constant && r == trunc(r))
+	  {
+	    auto inner = static_cast<Binary_Operator*>(left);
+	    if (constant_value(inner->operator_child_right_, a) && a == trunc(a))
+	      return simplify(kind, inner->operator_child_left_,
+			      make_constant(a * r, pool), pool);
+	  }
+      }
+      break;
+    default:
+      break;
     }
-  catch(...)
+  return pool.make_binary(kind, left, right);
+}
+
+/*
+ * print() skriver hoger deltrad overst, sedan operatorn och sist vanster
+ * deltrad, vart och ett tre steg langre in.
+ */
+void Binary_Operator::print(std::ostream &os, const unsigned width) const 
+{
+  struct Frame
+  {
+    const Expression_Tree* node;
+    unsigned               width;
+    bool                   right_done;
+  };
+  vector<Frame> frames{ { this, width, false } };
+
+  while (!frames.empty())
     {
-      throw expression_tree_error("Power::clone() ngot gick fel hr!");
+      Frame& frame = frames.back();
+      if (frame.node->kind() < Node_Kind::Plus)
+	{
+	  frame.node->print(os, frame.width);
+	  frames.pop_back();
+	  continue;
+	}
+
+      auto node = static_cast<const Binary_Operator*>(frame.node);
+      const unsigned w = frame.width;
+      if (!frame.right_done)
+	{
+	  frame.right_done = true;
+	  frames.push_back({ node->operator_child_right_, w + 3, false });
+	  continue;
+	}
+      os  << setw(w+2) << '/'     << endl
+	  << setw(w+1) << node->str()  << endl
+	  << setw(w+2) << '\\'        << endl ;
+      frames.pop_back();
+      frames.push_back({ node->operator_child_left_, w + 3, false });
     }
 }
 
-long double Power::evaluate()  const
+string Operand::get_postfix() const
+{
+  return str();
+}
+
+string Operand:: get_infix() const
 {
-  if(!operator_child_left_ || !operator_child_right_)
-    throw expression_tree_error("Power::evaluate()  saknar operander");
-  return pow(operator_child_left_->evaluate(), operator_child_right_->evaluate());
+  return str();
 }
 
-std::string Assign::str() const
+Expression_Tree* Operand::optimize(Node_Pool& pool) const
 {
-  return "=";
+  return pool.import(this);
 }
 
-Assign* Assign::clone() const
+Expression_Tree* Operand::derive(size_t slot, Node_Pool& pool) const
 {
-  try
-    {
-      return new Assign(*this);
-    }
-  catch (const bad_alloc& e)
-    {
-      throw expression_tree_error{e.what()};
-    }
-  catch(...)
-    {
-      throw expression_tree_error("Assign::clone() ngot gick fel hr!");
-    }
+  const bool variable = kind() == Node_Kind::Variable &&
+    static_cast<const Variable*>(this)->get_slot() == slot;
+  return pool.make_integer(variable ? 1 : 0);
+}
+
+Expression_Tree* Operand::rebalance(Node_Pool& pool) const
+{
+  return pool.import(this);
 }
 
-string Assign::get_infix() const
+void Operand::print(ostream &os, const unsigned width) const 
 {
-  return operator_child_left_->get_infix()+' '+ str()+' '+ operator_child_right_->get_infix();
+  os <<setw(width-1)<<right<<" "<< str() <<endl;
 }
 
-long double Assign::evaluate() const
-{       
-  Variable *pleft{dynamic_cast<Variable*>(operator_child_left_) };
-  if(pleft == nullptr)
-    throw expression_tree_error("Assign::evaluate() ngot gick fel hr!");
+std::string Plus::str() const 
+{
+  return "+";
+}
 
-  pleft->set_value(operator_child_right_->evaluate());
-  return pleft->get_value();
+std::string Minus::str() const
+{
+  return "-";
 }
 
+std::string Times::str() const
+{
+  return "*";
+}
+
+std::string Divide::str() const 
+{
+  return "/";
+}
+
+std::string Power::str() const
+{
+  return "^";
+}
+
+std::string Assign::str() const
+{
+  return "=";
+}
+
+const char* const Assign::invalid_target = "Assign::evaluate() ngot gick fel hr!";
+
 std::string Integer::str() const 
 {
-  return std::to_string(value_);
+  return big_ ? big_->str() : std::to_string(value_);
 }
 
-Integer* Integer::clone() const 
+
+long double Integer::evaluate(Environment&) const 
 {
-  try
-    {
-      return new Integer(*this);
-    }
-  catch ( const bad_alloc& e)
-    {
-      throw expression_tree_error{e.what()};
-    }
-  catch(...)
-    {
-      throw expression_tree_error("Integer::evaluate() ngot gick fel hr!");
-    }
+
+  return big_ ? big_->to_long_double() : static_cast <long double> (value_);
 }
 
-long double Integer::evaluate() const 
+void Integer::compile(Compiled_Expression& program) const
 {
+  program.emit_constant(big_ ? big_->to_long_double() : static_cast <long double> (value_));
+}
 
-  return static_cast <long double> (value_);
+int64_t Integer::get_value() const
+{
+  return value_;
 }
 
 std::string Real::str() const
 {  
-  stringstream remove_deci;
-  remove_deci << setprecision(2) << value_;
-  return remove_deci.str();        
+  return format(value_);
 }
 
-Real* Real::clone() const 
+/*
+ * format() skriver talet utan exponent, eftersom parsern inte lasar
+ * exponenter. De flesta tal far plats i buffer, som i write_leaf(); det
+ * storsta long double har nagot under 5000 siffror.
+ */
+std::string Real::format(long double value)
 {
-  try
-    {
-      return new Real(*this);
-    }
-  catch ( const bad_alloc& e)
-    {
-      throw expression_tree_error{e.what()};
-    }
-  catch(...)
-    {
-      throw expression_tree_error("Real::evaluate() ngot gick fel!");
-    }
+  char buffer[64];
+  const auto small = to_chars(begin(buffer), end(buffer), value, chars_format::fixed);
+  if (small.ec == errc{})
+    return string(buffer, small.ptr);
+
+  string result(5000, ' ');
+  const auto end = to_chars(result.data(), result.data() + result.size(), value,
+			    chars_format::fixed).ptr;
+  result.resize(end - result.data());
+  return result;
 }
 
-long double Real::evaluate() const
+
+long double Real::evaluate(Environment&) const
+{
+  return value_;
+}
+
+void Real::compile(Compiled_Expression& program) const
+{
+  program.emit_constant(value_);
+}
+
+long double Real::get_value() const
 {
   return value_;
 }
 
 std::string Variable::str() const 
 {
-  return variable_;
+  return std::string{ get_name() };
 }
 
-Variable* Variable::clone() const 
+
+long double Variable::evaluate(Environment& environment) const
 {
-  try
-    {
-      return new Variable(*this);
-    }
-  catch ( const bad_alloc& e)
-    {
-      throw expression_tree_error{e.what()};
-    }
-  catch(...)
-    {
-      throw expression_tree_error("Variable::evaluate() ngot gick fel!");
-    }
+  return environment.get(slot_);
 }
 
-long double Variable::evaluate() const
+void Variable::compile(Compiled_Expression& program) const
 {
-  return value_;
+  program.emit_load(slot_);
 }
 
-long double Variable::get_value() const
+size_t Variable::get_slot() const
 {
-  return value_;
+  return slot_;
 }
 
-void Variable::set_value(long double value)
+string_view Variable::get_name() const
 {
-  value_ = value;
+  return Symbol_Table::name(slot_);
 }
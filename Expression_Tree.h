@@ -3,10 +3,38 @@
  */
 #ifndef EXPRESSIONTREE_H
 #define EXPRESSIONTREE_H
+#include "Big_Integer.h"
+#include "Compiled_Expression.h"
+#include "Environment.h"
+#include "Metrics.h"
+#include "Node_Arena.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <iosfwd>
 #include <string>
+#include <string_view>
 #include <stdexcept>
 #include <iostream>
+#include <unordered_map>
+
+class Node_Pool;
+
+/*
+ * Alla noder skapas av en Node_Pool, som lagrar dem i en Node_Arena och ger
+ * strukturellt lika deltrad samma nod (hash-consing). Ett uttryck ar alltsa
+ * en riktad acyklisk graf dar delade deltrad bara finns en gang. Noderna
+ * destrueras inte en och en utan frigors nar poolen forstors.
+ *
+ * Ingen genomgang av tradet ar rekursiv: evaluering, utskrift, kompilering,
+ * optimering och kopiering anvander en egen stack pa heapen, sa djupet
+ * begransas bara av minnet.
+ */
+
+enum class Node_Kind : std::uint8_t
+{
+  Integer, Real, Variable, Plus, Minus, Times, Divide, Power, Assign
+};
 
 class Expression_Tree
 {
@@ -18,54 +46,190 @@ class Expression_Tree
   virtual std::string           get_postfix()   const = 0;
   virtual std::string           get_infix()     const = 0;    
   virtual std::string           str()           const = 0;  
-  virtual Expression_Tree *     clone()         const = 0;  
-  virtual long double           evaluate()      const = 0;        
+  virtual long double           evaluate(Environment&) const = 0;
+  virtual void                  compile(Compiled_Expression&) const = 0;
+  virtual Expression_Tree *     optimize(Node_Pool&) const = 0;
+  // derive() bygger derivatan med avseende pa variabeln i slot i pool.
+  virtual Expression_Tree *     derive(std::size_t slot, Node_Pool&) const = 0;
+  // rebalance() bygger tradet med kedjor av + och * som balanserade trad.
+  virtual Expression_Tree *     rebalance(Node_Pool&) const = 0;
 
   virtual void print(std::ostream& os, const unsigned width = 0) const = 0;   
 
+  // value() evaluerar noden i typen T (float, double eller long double).
+  // Under en Evaluation_Scope beraknas delade noder bara en gang, eller
+  // sparade delresultat ateranvands.
+  template <typename T = long double>
+  T value(Environment&) const;
+
+  // write_postfix() och write_infix() lagger texten sist i out eller
+  // skriver den direkt till os, i linjar tid.
+  void write_postfix(std::string& out) const;
+  void write_postfix(std::ostream& os) const;
+  void write_infix(std::string& out) const;
+  void write_infix(std::ostream& os) const;
+
+  Node_Kind     kind()         const { return kind_; }
+  std::size_t   hash()         const { return hash_; }
+  bool          shared()       const { return shared_.load(std::memory_order_relaxed); }
+  // dependencies() ar variablernas grupper (Environment::mask) i deltradet.
+  // Ett rent (pure) deltrad innehaller ingen tilldelning.
+  std::uint64_t dependencies() const { return dependencies_; }
+  bool          pure()         const { return pure_; }
+  // integral() ar sant om deltradet bara har heltal och +, -, * och ^.
+  bool          integral()     const { return integral_; }
+  // reusable() ar sant om delade deltrad kan beraknas en gang per
+  // evaluering, dvs om ingen tilldelning sker fore roten.
+  bool          reusable()     const;
+
+  // exact_value() beraknar ett heltalsdeltrad (integral()) med heltal:
+  // int64_t sa lange vardena ryms, annars Big_Integer. Delresultat som inte
+  // blir heltal, som vid negativ exponent, eller som blir orimligt stora
+  // beraknas i stallet i T ur barnens varden. exact() ger vardet om hela
+  // deltradet blev exakt.
+  template <typename T>
+  T    exact_value() const;
+  bool exact(Big_Integer& result) const;
+
+  static void* operator new(std::size_t size, Node_Arena& arena)
+    {
+      return arena.allocate(size, alignof(std::max_align_t));
+    }
+  static void operator delete(void*, Node_Arena&) noexcept {}
+
+  static void* operator new(std::size_t) = delete;
+  static void operator delete(void*) noexcept {}
 
  protected: 
-  Expression_Tree() = default;
+  // walk() evaluerar deltradet i typen T med en egen stack. Noderna
+  // beraknas fran vanster till hoger; lookup_root anger om roten far
+  // hamtas ur en Evaluation_Scope.
+  template <typename T>
+  T walk(Environment&, bool lookup_root) const;
+
+  explicit Expression_Tree(Node_Kind kind, std::uint64_t dependencies = 0,
+                           bool pure = true, bool integral = false)
+    : kind_(kind), pure_(pure), integral_(integral), dependencies_(dependencies) {}
   Expression_Tree & operator= ( const Expression_Tree & ) = delete;
   Expression_Tree ( const Expression_Tree & ) = default;
   Expression_Tree ( Expression_Tree && ) = default;
 
+ private:
+  friend class Node_Pool;
+
+  // shared_ satts av Node_Pool medan andra tradar kan evaluera noden.
+  const Node_Kind     kind_;
+  mutable std::atomic<bool> shared_{ false };
+  const bool          pure_;
+  const bool          integral_;
+  std::size_t         hash_{ 0 };
+  const std::uint64_t dependencies_;
+};
+
+/*
+ * Evaluation_Scope omger en evaluering och anger hur value() arbetar:
+ * Direct evaluerar varje nod, Memoized sparar vardet av varje delad nod
+ * forsta gangen den beraknas och Incremental ateranvander varje ren
+ * operatornods senaste varde sa lange dess variabler inte har andrats.
+ * Incremental skriver i noderna och far inte anvandas samtidigt i flera
+ * tradar for trad som delar noder.
+ */
+class Evaluation_Scope
+{
+ public:
+  enum class Mode { Direct, Memoized, Incremental };
+
+  explicit Evaluation_Scope(Mode mode);
+  ~Evaluation_Scope();
+
+  Evaluation_Scope(const Evaluation_Scope&) = delete;
+  Evaluation_Scope& operator=(const Evaluation_Scope&) = delete;
+
+ private:
+  friend class Expression_Tree;
+
+  std::unordered_map<const Expression_Tree*, long double> values_;
+  Mode              mode_;
+  Evaluation_Scope* previous_;
 };
 
 class Binary_Operator : public Expression_Tree
 {
  public:
-  ~Binary_Operator() 
-    {
-      delete operator_child_left_;
-      delete operator_child_right_;
-    }
+  ~Binary_Operator() = default;
 
   Binary_Operator & operator= ( const Binary_Operator & ) = delete;
+  Binary_Operator ( const Binary_Operator & ) = delete;
   Binary_Operator() = delete;
 
   std::string      get_postfix()  const override;
   std::string      get_infix() const override;   
+  long double      evaluate(Environment&) const override;
+  void             compile(Compiled_Expression&) const override;
+  Expression_Tree* optimize(Node_Pool&) const override;
+  Expression_Tree* derive(std::size_t slot, Node_Pool&) const override;
+  Expression_Tree* rebalance(Node_Pool&) const override;
   void             print(std::ostream &os, const unsigned width) const override;
 
+  const Expression_Tree* left()  const { return operator_child_left_; }
+  const Expression_Tree* right() const { return operator_child_right_; }
+
+  // apply() beraknar noden ur barnens varden i typen T. Operatorn valjs
+  // med kind(), sa koden specialiseras for varje typ vid kompileringen.
+  template <typename T>
+  T apply(T left, T right, Environment&) const;
+
+  // cached() ger nodens senaste varde i environment om ingen av dess
+  // variabler har andrats sedan dess; remember() sparar ett nytt varde.
+  bool cached(const Environment& environment, long double& value) const;
+  void remember(const Environment& environment, long double value) const;
+
+  // small_exact() ger ett heltalsdeltrads exakta varde om det ryms i
+  // int64_t. Vardet beraknas en gang, nar noden skapas.
+  bool small_exact(std::int64_t& value) const
+  {
+    value = small_value_;
+    return small_;
+  }
+
+  // big_exact() ger vardet av ett exakt heltalsdeltrad som inte ryms i
+  // int64_t, eller nullptr. Node_Pool beraknar det nar noden skapas.
+  const Big_Integer* big_exact() const { return big_; }
+
  protected:
 
- Binary_Operator(const Binary_Operator& b ) 
-   : operator_child_left_(b.operator_child_left_->clone()), operator_child_right_(b.operator_child_right_->clone()) { }
- Binary_Operator( Expression_Tree* left,  Expression_Tree* right)
-   :  operator_child_left_ ( left) , 
-    operator_child_right_( right) 
+  // simplify() skapar en nod av slaget kind for redan optimerade barn, med
+  // konstantvikning och algebraiska forenklingar dar de ar sakra.
+  static Expression_Tree* simplify(Node_Kind kind, Expression_Tree* left,
+                                   Expression_Tree* right, Node_Pool&);
+
+ Binary_Operator(Node_Kind kind, Expression_Tree* left,  Expression_Tree* right)
+   :  Expression_Tree(kind, left->dependencies() | right->dependencies(),
+                      kind != Node_Kind::Assign && left->pure() && right->pure(),
+                      kind != Node_Kind::Assign && kind != Node_Kind::Divide &&
+                      left->integral() && right->integral()),
+    operator_child_left_ ( left) , 
+    operator_child_right_( right) ,
+    small_(integral() && combine_small(kind, left, right, small_value_))
     {}
 
-// move konstruktor
-Binary_Operator(Binary_Operator&& other)
-{
-  std::swap(operator_child_left_, other.operator_child_left_);
-  std::swap(operator_child_right_, other.operator_child_right_);
-}
-
   Expression_Tree     * operator_child_left_;
   Expression_Tree     * operator_child_right_;  
+
+ private:
+  friend class Node_Pool;
+
+  // combine_small() beraknar left op right med int64_t och kontroll av
+  // spill; falskt om nagot barn eller resultatet inte ryms.
+  static bool combine_small(Node_Kind kind, const Expression_Tree* left,
+                            const Expression_Tree* right, std::int64_t& value);
+
+  mutable long double   cache_value_{ 0 };
+  mutable std::uint64_t cache_environment_{ 0 };
+  mutable std::uint64_t cache_stamp_{ 0 };
+  std::int64_t          small_value_{ 0 };
+  bool                  small_;
+  const Big_Integer*    big_{ nullptr };
   
 };
 
@@ -74,6 +238,9 @@ class Operand : public Expression_Tree
  public:
   std::string   get_postfix() const override;
   std::string   get_infix() const override;  
+  Expression_Tree* optimize(Node_Pool&) const override;
+  Expression_Tree* derive(std::size_t slot, Node_Pool&) const override;
+  Expression_Tree* rebalance(Node_Pool&) const override;
   void          print(std::ostream & os, const unsigned width) const override;
   ~ Operand () = default;
   Operand (Operand &&) = default;
@@ -81,7 +248,8 @@ class Operand : public Expression_Tree
 
 
  protected:
-  Operand() = default;
+  explicit Operand(Node_Kind kind, std::uint64_t dependencies = 0)
+    : Expression_Tree(kind, dependencies, true, kind == Node_Kind::Integer) {}
   Operand ( const Operand & ) = default;
 
 };
@@ -90,13 +258,23 @@ class Integer final: public Operand
 {
  public:
   ~Integer() = default;
-  explicit Integer(int value)
-    :   value_(value)
+  explicit Integer(std::int64_t value)
+    :   Operand(Node_Kind::Integer), value_(value)
+  {}
+  // Ett heltal som inte ryms i int64_t pekar pa sitt varde, som ags av
+  // poolen.
+  explicit Integer(const Big_Integer* value)
+    :   Operand(Node_Kind::Integer), value_(0), big_(value)
   {}
 
   std::string   str()       const override;
-  Integer *     clone()     const override;
-  long double   evaluate()  const override;
+  long double   evaluate(Environment&) const override;
+  void          compile(Compiled_Expression&) const override;
+
+  // get_value() ar vardet nar big_exact() ar nullptr, annars ger
+  // big_exact() det exakta vardet.
+  std::int64_t        get_value() const;
+  const Big_Integer*  big_exact() const { return big_; }
     
  private:
   Integer & operator=(const Integer & ) = delete;
@@ -105,7 +283,8 @@ class Integer final: public Operand
 
   Integer(const Integer & )             = default;
 
-  const int value_;
+  const std::int64_t       value_;
+  const Big_Integer* const big_{ nullptr };
 };
 
 class Real final: public Operand
@@ -113,12 +292,18 @@ class Real final: public Operand
  public:
   ~Real() = default;
   explicit Real(long double value)
-    :   value_(value)
+    :   Operand(Node_Kind::Real), value_(value)
   {}
 
   std::string   str()       const override;
-  Real *        clone()     const override;
-  long double   evaluate()  const  override;
+  long double   evaluate(Environment&) const override;
+  void          compile(Compiled_Expression&) const override;
+
+  long double   get_value() const;
+
+  // format() ger det kortaste decimaltal utan exponent som lases tillbaka
+  // till samma varde, sa att en utskrift kan parsas igen.
+  static std::string format(long double value);
 
  private:
   Real & operator=(const Real & ) = delete;
@@ -133,17 +318,17 @@ class Variable final: public Operand
 {
  public:
   ~Variable() = default;
-  explicit Variable(const std::string & variable, long double value = 0.0)
-    : variable_(variable), value_(value)
+  // Variabelns varde ligger i en Environment, pa platsen slot.
+  explicit Variable(std::size_t slot)
+    : Operand(Node_Kind::Variable, Environment::mask(slot)), slot_(slot)
   {}
 
   std::string   str()       const override;
-  Variable *    clone()     const override;
-  long double   evaluate()  const  override;
+  long double   evaluate(Environment&) const override;
+  void          compile(Compiled_Expression&) const override;
 
-  void        set_value(long double);
-  long double get_value() const;
-  std::string get_name()  const;
+  std::size_t      get_slot() const;
+  std::string_view get_name() const;
 
  private:
   Variable & operator=(const Variable & ) = delete;
@@ -151,8 +336,7 @@ class Variable final: public Operand
   Variable( Variable && )                 = default; 
   Variable(const Variable & )             = default;
 
-  const std::string variable_;
-  long double value_;
+  const std::size_t slot_;
 };
 
 class Plus final: public Binary_Operator
@@ -160,16 +344,10 @@ class Plus final: public Binary_Operator
  public:
   ~Plus() = default;
  Plus(Expression_Tree * left, Expression_Tree * right)
-   : Binary_Operator(left,right)
+   : Binary_Operator(Node_Kind::Plus, left, right)
     {} 
 
   std::string   str()       const override;
-  Plus*         clone()     const override;
-  long double   evaluate()  const override;
-
- protected:
- Plus(const Plus & other) : Binary_Operator(other) {}
- Plus(Plus &&other) : Binary_Operator(other){}
 };  
 
 class Minus final: public Binary_Operator 
@@ -177,16 +355,10 @@ class Minus final: public Binary_Operator
  public:
   ~Minus() = default;
  Minus(Expression_Tree * left, Expression_Tree * right)
-   : Binary_Operator(left,right)
+   : Binary_Operator(Node_Kind::Minus, left, right)
     {}
 
   std::string   str()       const override; 
-  Minus*        clone()     const override;
-  long double   evaluate()  const override;
-
- protected:
- Minus(const Minus & other) : Binary_Operator(other){}
- Minus(Minus &&other) : Binary_Operator(other){}
 };
 
 class Times final: public Binary_Operator
@@ -194,17 +366,10 @@ class Times final: public Binary_Operator
  public:
   ~Times() = default;
  Times(Expression_Tree * left, Expression_Tree * right)
-   : Binary_Operator(left,right)
+   : Binary_Operator(Node_Kind::Times, left, right)
     {}
 
   std::string   str()       const override; 
-  Times*        clone()     const override;
-  long double   evaluate()  const override; 
-
- protected:
- Times(const Times & other) : Binary_Operator(other){}
- Times(Times &&other) : Binary_Operator(other){}
-
 };
 
 class Divide final: public Binary_Operator
@@ -212,36 +377,25 @@ class Divide final: public Binary_Operator
  public:
   ~Divide() = default;
  Divide(Expression_Tree * left, Expression_Tree * right)
-   : Binary_Operator(left,right)
+   : Binary_Operator(Node_Kind::Divide, left, right)
     {}
 
   std::string   str()      const override;
-  Divide*       clone()    const override;
-  long double   evaluate() const override;
   Divide  & operator= ( const Divide  & ) = delete;
-
- protected:
- Divide(const Divide & other) : Binary_Operator(other){}
- Divide(Divide &&other) : Binary_Operator(other){}
- 
 };
 class Assign final: public Binary_Operator
 { 
  public:
   ~Assign() = default;
  Assign(Expression_Tree * left, Expression_Tree * right)
-   : Binary_Operator(left,right)
+   : Binary_Operator(Node_Kind::Assign, left, right)
     {}
 
   std::string   str()      const override;
-  std::string get_infix()const override;
-  Assign*       clone()    const override;
-  long double   evaluate() const override;
   Assign  &  operator= ( const Assign& ) = delete;
 
- protected:
- Assign(const Assign & other) : Binary_Operator(other){}
- Assign(Assign &&other) : Binary_Operator(other){}
+  // Felet nar vansterledet inte ar en variabel.
+  static const char* const invalid_target;
 };
 
 
@@ -250,16 +404,10 @@ class Power final: public Binary_Operator
  public:
   ~Power() = default;
  Power(Expression_Tree * left, Expression_Tree * right)
-   : Binary_Operator(left,right)
+   : Binary_Operator(Node_Kind::Power, left, right)
     {}
 
   std::string   str()      const override;
-  Power*        clone()    const override;
-  long double   evaluate() const override;
-
- protected:
- Power(const Power & other) : Binary_Operator(other){}
- Power(Power &&other) : Binary_Operator(other){}
 };
 
 
@@ -268,11 +416,15 @@ class expression_tree_error : public std::logic_error
  public:
   explicit expression_tree_error(const std::string& what_arg) noexcept
     :   logic_error(what_arg) 
-  {}
+  {
+    METRICS_COUNT(Exceptions);
+  }
 
   explicit expression_tree_error(const char* what_arg) noexcept
     :   logic_error(what_arg) 
-  {}
+  {
+    METRICS_COUNT(Exceptions);
+  }
 };
 
 #endif
@@ -0,0 +1,462 @@
+/*
+ * Flat_Expression.cc
+ */
+#include "Flat_Expression.h"
+#include "Environment.h"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+namespace
+{
+  int64_t integer(const Flat_Node& node)
+  {
+    return static_cast<int64_t>(uint64_t{ node.right } << 32 | node.left);
+  }
+
+  // symbol() är operatorns tecken, som i Expression_Tree::str().
+  char symbol(Node_Kind kind)
+  {
+    static constexpr char symbols[]{ '+', '-', '*', '/', '^', '=' };
+    return symbols[static_cast<int>(kind) - static_cast<int>(Node_Kind::Plus)];
+  }
+
+  void set_integer(Flat_Node& node, int64_t value)
+  {
+    node.left = static_cast<uint32_t>(value);
+    node.right = static_cast<uint32_t>(static_cast<uint64_t>(value) >> 32);
+  }
+}
+
+long double Flat_Expression::evaluate() const
+{
+  return evaluate(Environment::global());
+}
+
+/*
+ * evaluate() beräknar noderna i tur och ordning. Värdena sparas i en
+ * trådlokal vektor med en plats per nod, så barnens värden finns alltid
+ * när föräldern beräknas.
+ */
+long double Flat_Expression::evaluate(Environment& environment) const
+{
+  if (empty())
+    throw expression_tree_error("Kan inte evaluera ett tomt uttryck");
+
+  thread_local vector<long double> values;
+  if (values.size() < nodes_.size())
+    values.resize(nodes_.size());
+  return forward(environment, values.data());
+}
+
+/*
+ * gradient() är omvänd automatisk derivering med noderna som band: först
+ * evalueras alla noder framåt, sedan svepes de baklänges och varje nods
+ * derivata (adjoint) fördelas på barnen. En variabels derivata samlas i
+ * partials tills en tilldelning till den påträffas; den tillhör då
+ * tilldelningens högerled, eftersom läsningarna efter tilldelningen såg
+ * det värdet. Det som finns kvar i partials till sist är derivatorna med
+ * avseende på variablernas ursprungliga värden. Arbetsvektorerna är
+ * trådlokala och partials återanvänds, så upprepade anrop allokerar inte.
+ */
+long double Flat_Expression::gradient(Environment& environment,
+                                      vector<long double>& partials) const
+{
+  if (empty())
+    throw expression_tree_error("Kan inte derivera ett tomt uttryck");
+
+  thread_local vector<long double> values;
+  thread_local vector<long double> adjoints;
+  if (values.size() < nodes_.size())
+    {
+      values.resize(nodes_.size());
+      adjoints.resize(nodes_.size());
+    }
+  const long double result = forward(environment, values.data());
+
+  const long double* const value = values.data();
+  long double* const adjoint = adjoints.data();
+  fill_n(adjoint, nodes_.size() - 1, 0.0L);
+  adjoint[nodes_.size() - 1] = 1;
+  partials.assign(environment.size(), 0);
+
+  for (size_t i = nodes_.size(); i-- > 0;)
+    {
+      const Flat_Node& node = nodes_[i];
+      const long double d = adjoint[i];
+      // Noder som inte påverkar värdet hoppas över, så att till exempel
+      // 0 * inf inte ger NaN. En tilldelning för ändå vidare partials.
+      if (d == 0 && node.kind != Node_Kind::Assign)
+	continue;
+      switch (node.kind)
+	{
+	case Node_Kind::Integer:
+	case Node_Kind::Real:
+	  break;
+	case Node_Kind::Variable:
+	  partials[node.left] += d;
+	  break;
+	case Node_Kind::Plus:
+	  adjoint[node.left] += d;
+	  adjoint[node.right] += d;
+	  break;
+	case Node_Kind::Minus:
+	  adjoint[node.left] += d;
+	  adjoint[node.right] -= d;
+	  break;
+	case Node_Kind::Times:
+	  adjoint[node.left] += d * value[node.right];
+	  adjoint[node.right] += d * value[node.left];
+	  break;
+	case Node_Kind::Divide:
+	  adjoint[node.left] += d / value[node.right];
+	  adjoint[node.right] -= d * value[i] / value[node.right];
+	  break;
+	case Node_Kind::Power:
+	  // Derivatan med avseende på exponenten finns bara för positiv bas.
+	  adjoint[node.left] += d * value[node.right] *
+	    pow(value[node.left], value[node.right] - 1);
+	  if (value[node.left] > 0)
+	    adjoint[node.right] += d * value[i] * log(value[node.left]);
+	  break;
+	case Node_Kind::Assign:
+	  {
+	    const size_t slot = nodes_[node.left].left;
+	    adjoint[node.right] += d + partials[slot];
+	    partials[slot] = 0;
+	  }
+	  break;
+	}
+    }
+  return result;
+}
+
+/*
+ * forward() beräknar alla noder och lägger nod i:s värde i value[i].
+ */
+long double Flat_Expression::forward(Environment& environment, long double* value) const
+{
+  environment.resize(slots_);
+  for (size_t slot : stored_)
+    environment.touch(slot);
+  long double* const variables = environment.data();
+
+  for (size_t i = 0; i < nodes_.size(); ++i)
+    {
+      const Flat_Node& node = nodes_[i];
+      switch (node.kind)
+	{
+	case Node_Kind::Integer:
+	  value[i] = integer(node);
+	  break;
+	case Node_Kind::Real:
+	  value[i] = reals_[node.left];
+	  break;
+	case Node_Kind::Variable:
+	  value[i] = variables[node.left];
+	  break;
+	case Node_Kind::Plus:
+	  value[i] = value[node.left] + value[node.right];
+	  break;
+	case Node_Kind::Minus:
+	  value[i] = value[node.left] - value[node.right];
+	  break;
+	case Node_Kind::Times:
+	  value[i] = value[node.left] * value[node.right];
+	  break;
+	case Node_Kind::Divide:
+	  if (value[node.right] == 0)
+	    throw expression_tree_error("Division med 0");
+	  value[i] = value[node.left] / value[node.right];
+	  break;
+	case Node_Kind::Power:
+	  value[i] = pow(value[node.left], value[node.right]);
+	  break;
+	case Node_Kind::Assign:
+	  if (nodes_[node.left].kind != Node_Kind::Variable)
+	    throw expression_tree_error(Assign::invalid_target);
+	  value[i] = variables[nodes_[node.left].left] = value[node.right];
+	  break;
+	}
+    }
+  return value[nodes_.size() - 1];
+}
+
+string Flat_Expression::get_postfix() const
+{
+  if (empty())
+    throw expression_tree_error("Kan inte hämta postfix för ett tomt uttryck");
+
+  string text;
+  render(false, text);
+  return text;
+}
+
+string Flat_Expression::get_infix() const
+{
+  if (empty())
+    throw expression_tree_error("Kan inte hämta infix för ett tomt uttryck");
+
+  string text;
+  render(true, text);
+  return text;
+}
+
+/*
+ * render() skriver uttrycket som postfix eller infix sist i out, som
+ * render() i Expression_Tree.cc: med en egen stack där varje operator har
+ * ett steg, 0 före vänster barn, 1 mellan barnen och 2 efter höger barn.
+ * Texten skrivs direkt i out, utan en sträng per nod. Ett negativt löv,
+ * en vikt konstant, skrivs som 0 - c, som i trädet, eftersom parsern inte
+ * har något unärt minus; som operand får det parenteser som en operator.
+ */
+void Flat_Expression::render(bool infix, string& out) const
+{
+  struct Frame
+  {
+    uint32_t index;
+    int      step;
+  };
+  thread_local vector<Frame> frames;
+  frames.clear();
+
+  // Barnen till en tilldelning får inga parenteser.
+  auto parenthesize = [&](const Flat_Node& parent, uint32_t child)
+    {
+      return infix && parent.kind != Node_Kind::Assign &&
+	(nodes_[child].kind >= Node_Kind::Plus || negative(nodes_[child]));
+    };
+  auto enter = [&](uint32_t index)
+    {
+      if (nodes_[index].kind < Node_Kind::Plus)
+	write_leaf(nodes_[index], infix, out);
+      else
+	frames.push_back({ index, 0 });
+    };
+
+  enter(static_cast<uint32_t>(nodes_.size() - 1));
+  while (!frames.empty())
+    {
+      const Flat_Node& node = nodes_[frames.back().index];
+      switch (frames.back().step++)
+	{
+	case 0:
+	  if (parenthesize(node, node.left))
+	    out += '(';
+	  enter(node.left);
+	  break;
+	case 1:
+	  if (parenthesize(node, node.left))
+	    out += ')';
+	  out += ' ';
+	  if (infix)
+	    {
+	      out += symbol(node.kind);
+	      out += ' ';
+	      if (parenthesize(node, node.right))
+		out += '(';
+	    }
+	  enter(node.right);
+	  break;
+	default:
+	  if (!infix)
+	    {
+	      out += ' ';
+	      out += symbol(node.kind);
+	    }
+	  else if (parenthesize(node, node.right))
+	    out += ')';
+	  frames.pop_back();
+	  break;
+	}
+    }
+}
+
+bool Flat_Expression::negative(const Flat_Node& node) const
+{
+  return (node.kind == Node_Kind::Integer && integer(node) < 0) ||
+    (node.kind == Node_Kind::Real && signbit(reals_[node.left]));
+}
+
+/*
+ * write_leaf() skriver ett löv som Expression_Tree::str(), utan att skapa
+ * en sträng utom för reella tal som inte får plats i buffer. Ett negativt
+ * tal skrivs som 0 - c i infix och 0 c - i postfix.
+ */
+void Flat_Expression::write_leaf(const Flat_Node& node, bool infix, string& out) const
+{
+  const bool minus = negative(node);
+  if (minus)
+    out += infix ? "0 - " : "0 ";
+
+  char buffer[64];
+  switch (node.kind)
+    {
+    case Node_Kind::Integer:
+      {
+	// Beloppet som uint64_t, så att även det minsta int64_t går att skriva.
+	const int64_t value = integer(node);
+	const uint64_t magnitude = minus ? 0 - static_cast<uint64_t>(value)
+	                                 : static_cast<uint64_t>(value);
+	out.append(buffer, to_chars(begin(buffer), end(buffer), magnitude).ptr);
+      }
+      break;
+    case Node_Kind::Real:
+      {
+	const long double value = fabs(reals_[node.left]);
+	const auto result = to_chars(begin(buffer), end(buffer), value, chars_format::fixed);
+	if (result.ec == errc{})
+	  out.append(buffer, result.ptr);
+	else
+	  out += Real::format(value);
+      }
+      break;
+    default:
+      out += Symbol_Table::name(node.left);
+      break;
+    }
+  if (minus && !infix)
+    out += " -";
+}
+
+bool Flat_Expression::empty() const
+{
+  return nodes_.empty();
+}
+
+size_t Flat_Expression::size() const
+{
+  return nodes_.size();
+}
+
+size_t Flat_Expression::memory() const
+{
+  return nodes_.size() * sizeof(Flat_Node) + reals_.size() * sizeof(long double);
+}
+
+const vector<Flat_Node>& Flat_Expression::nodes() const
+{
+  return nodes_;
+}
+
+/*
+ * build() lägger noderna i postordning med en egen stack. Ett delat
+ * deluttryck läggs bara till en gång om delresultat får återanvändas.
+ */
+void Flat_Expression::build(const Expression_Tree* root)
+{
+  nodes_.clear();
+  reals_.clear();
+  stored_.clear();
+  slots_ = 0;
+
+  struct Frame
+  {
+    const Binary_Operator* node;
+    int                    step;
+  };
+  vector<Frame>    frames;
+  vector<uint32_t> indices;
+  unordered_map<const Expression_Tree*, uint32_t> added;
+  const bool reuse = root->reusable();
+
+  auto enter = [&](const Expression_Tree* node)
+    {
+      if (reuse && node->shared())
+	{
+	  auto it = added.find(node);
+	  if (it != added.end())
+	    {
+	      indices.push_back(it->second);
+	      return;
+	    }
+	}
+
+      Flat_Node flat{ node->kind(), 0, 0 };
+      switch (node->kind())
+	{
+	case Node_Kind::Integer:
+	  // Ett heltal som inte ryms i int64_t blir ett reellt tal.
+	  if (const Big_Integer* big = static_cast<const Integer*>(node)->big_exact())
+	    {
+	      flat.kind = Node_Kind::Real;
+	      flat.left = static_cast<uint32_t>(reals_.size());
+	      reals_.push_back(big->to_long_double());
+	    }
+	  else
+	    set_integer(flat, static_cast<const Integer*>(node)->get_value());
+	  break;
+	case Node_Kind::Real:
+	  flat.left = static_cast<uint32_t>(reals_.size());
+	  reals_.push_back(static_cast<const Real*>(node)->get_value());
+	  break;
+	case Node_Kind::Variable:
+	  {
+	    const size_t slot = static_cast<const Variable*>(node)->get_slot();
+	    flat.left = static_cast<uint32_t>(slot);
+	    slots_ = max(slots_, slot + 1);
+	  }
+	  break;
+	default:
+	  if (!node->integral())
+	    {
+	      frames.push_back({ static_cast<const Binary_Operator*>(node), 0 });
+	      return;
+	    }
+	  {
+	    // Ett heltalsdeltrad blir en konstant.
+	    const long double value = node->exact_value<long double>();
+	    if (value == trunc(value) && fabs(value) < 0x1p63L)
+	      {
+		flat.kind = Node_Kind::Integer;
+		set_integer(flat, static_cast<int64_t>(value));
+	      }
+	    else
+	      {
+		flat.kind = Node_Kind::Real;
+		flat.left = static_cast<uint32_t>(reals_.size());
+		reals_.push_back(value);
+	      }
+	  }
+	  indices.push_back(add(flat));
+	  if (reuse && node->shared())
+	    added.emplace(node, indices.back());
+	  return;
+	}
+      indices.push_back(add(flat));
+    };
+
+  enter(root);
+  while (!frames.empty())
+    {
+      const Binary_Operator* node = frames.back().node;
+      const int step = frames.back().step++;
+      if (step < 2)
+	{
+	  enter(step == 0 ? node->left() : node->right());
+	  continue;
+	}
+      frames.pop_back();
+
+      const uint32_t right = indices.back();
+      indices.pop_back();
+      indices.back() = add({ node->kind(), indices.back(), right });
+      if (node->kind() == Node_Kind::Assign && node->left()->kind() == Node_Kind::Variable)
+	stored_.push_back(static_cast<const Variable*>(node->left())->get_slot());
+      if (reuse && node->shared())
+	added.emplace(node, indices.back());
+    }
+}
+
+uint32_t Flat_Expression::add(const Flat_Node& node)
+{
+  if (nodes_.size() >= numeric_limits<uint32_t>::max())
+    throw expression_tree_error("Uttrycket har för många noder");
+  nodes_.push_back(node);
+  return static_cast<uint32_t>(nodes_.size() - 1);
+}
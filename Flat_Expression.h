@@ -0,0 +1,73 @@
+/*
+ * Flat_Expression.h
+ */
+#ifndef FLAT_EXPRESSION_H
+#define FLAT_EXPRESSION_H
+#include "Expression_Tree.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class Environment;
+
+/**
+ * Flat_Node är en nod i en Flat_Expression. Operatorer refererar till sina
+ * barn med index; löv har sitt värde direkt i noden: Integer värdet (låga
+ * 32 bitar i left, höga i right), Variable sin slot och Real ett index i
+ * tabellen med reella konstanter.
+ */
+struct Flat_Node
+{
+  Node_Kind     kind;
+  std::uint32_t left;
+  std::uint32_t right;
+};
+
+/**
+ * Flat_Expression är ett uttryck lagrat som en sammanhängande vektor av
+ * noder i postordning: barnen kommer före föräldern och roten sist. En
+ * evaluering är därför en enda slinga framåt utan rekursion och virtuella
+ * anrop, och en nod tar 12 byte. Delade deluttryck lagras en gång om
+ * inga tilldelningar kan ändra dem, se Expression_Tree::reusable().
+ * Deluttryck med bara heltal beräknas exakt i build() och lagras som en
+ * konstant.
+ */
+class Flat_Expression
+{
+ public:
+  Flat_Expression() = default;
+
+  long double evaluate() const;
+  long double evaluate(Environment& environment) const;
+  // gradient() evaluerar och lägger derivatan med avseende på varje
+  // variabel i partials, indexerad med slot. Returnerar värdet.
+  long double gradient(Environment& environment,
+                       std::vector<long double>& partials) const;
+
+  std::string get_postfix() const;
+  std::string get_infix() const;
+
+  bool        empty() const;
+  std::size_t size() const;
+  // memory() är antalet byte som noderna och konstanterna upptar.
+  std::size_t memory() const;
+  const std::vector<Flat_Node>& nodes() const;
+
+  // Används av Expression::flatten().
+  void build(const Expression_Tree* root);
+
+ private:
+  std::vector<Flat_Node>   nodes_;
+  std::vector<long double> reals_;
+  std::vector<std::size_t> stored_;
+  std::size_t              slots_{ 0 };
+
+  long double   forward(Environment& environment, long double* value) const;
+  void          render(bool infix, std::string& out) const;
+  bool          negative(const Flat_Node& node) const;
+  void          write_leaf(const Flat_Node& node, bool infix, std::string& out) const;
+  std::uint32_t add(const Flat_Node& node);
+};
+
+#endif
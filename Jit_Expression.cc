@@ -0,0 +1,346 @@
+/*
+ * Jit_Expression.cc
+ */
+#include "Jit_Expression.h"
+#include "Environment.h"
+#include "Expression.h"
+#include "Expression_Tree.h"
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#define JIT_AVAILABLE 1
+#endif
+using namespace std;
+
+namespace
+{
+#ifdef JIT_AVAILABLE
+  constexpr std::size_t max_native_depth{ 4096 };
+
+  // Code_Buffer samlar maskinkoden. Alla värden hanteras i x87-enheten i
+  // full long double-precision, så resultaten blir desamma som i trädet.
+  // Stackens topp ligger i st(0), övriga värden 16 byte vardera på
+  // maskinstacken, som därmed alltid är justerad för funktionsanrop.
+  class Code_Buffer
+  {
+  public:
+    void bytes(std::initializer_list<uint8_t> list)
+    {
+      code_.insert(code_.end(), list);
+    }
+
+    void imm32(uint32_t value)
+    {
+      for (int i = 0; i < 4; ++i)
+	code_.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+
+    void imm64(uint64_t value)
+    {
+      for (int i = 0; i < 8; ++i)
+	code_.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+
+    void prologue()
+    {
+      bytes({ 0x55 });                      // push rbp
+      bytes({ 0x48, 0x89, 0xE5 });          // mov rbp, rsp
+      bytes({ 0x53 });                      // push rbx
+      bytes({ 0x41, 0x54 });                // push r12
+      bytes({ 0x48, 0x89, 0xFB });          // mov rbx, rdi
+      bytes({ 0x49, 0x89, 0xF4 });          // mov r12, rsi
+    }
+
+    // Temporärerna ligger under de sparade registren: [rbp - 32 - 16 * t].
+    void reserve_temporaries(size_t count)
+    {
+      if (count == 0)
+	return;
+      bytes({ 0x48, 0x81, 0xEC });          // sub rsp, imm32
+      imm32(static_cast<uint32_t>(16 * count));
+    }
+
+    void load_temporary(size_t index)
+    {
+      bytes({ 0xDB, 0xAD });                // fld tbyte [rbp+disp32]
+      imm32(static_cast<uint32_t>(-static_cast<int32_t>(32 + 16 * index)));
+    }
+
+    void save_temporary(size_t index)
+    {
+      bytes({ 0xD9, 0xC0 });                // fld st(0)
+      bytes({ 0xDB, 0xBD });                // fstp tbyte [rbp+disp32]
+      imm32(static_cast<uint32_t>(-static_cast<int32_t>(32 + 16 * index)));
+    }
+
+    void epilogue()
+    {
+      epilogue_ = code_.size();
+      bytes({ 0x48, 0x8D, 0x65, 0xF0 });    // lea rsp, [rbp-16]
+      bytes({ 0x41, 0x5C });                // pop r12
+      bytes({ 0x5B });                      // pop rbx
+      bytes({ 0x5D });                      // pop rbp
+      bytes({ 0xC3 });                      // ret
+    }
+
+    void spill()
+    {
+      bytes({ 0x48, 0x83, 0xEC, 0x10 });    // sub rsp, 16
+      bytes({ 0xDB, 0x3C, 0x24 });          // fstp tbyte [rsp]
+    }
+
+    void pop_second()
+    {
+      bytes({ 0xDB, 0x2C, 0x24 });          // fld tbyte [rsp]
+      bytes({ 0x48, 0x83, 0xC4, 0x10 });    // add rsp, 16
+    }
+
+    void load_variable(size_t index)
+    {
+      bytes({ 0xDB, 0xAB });                // fld tbyte [rbx+disp32]
+      imm32(static_cast<uint32_t>(16 * index));
+    }
+
+    void store_variable(size_t index)
+    {
+      bytes({ 0xD9, 0xC0 });                // fld st(0)
+      bytes({ 0xDB, 0xBB });                // fstp tbyte [rbx+disp32]
+      imm32(static_cast<uint32_t>(16 * index));
+    }
+
+    // Konstanterna läggs efter koden; adressen fylls i av finish().
+    void load_constant(size_t index)
+    {
+      bytes({ 0xDB, 0x2D });                // fld tbyte [rip+disp32]
+      constant_fixups_.push_back({ code_.size(), index });
+      imm32(0);
+    }
+
+    // fail() sätter *error och hoppar till epilogen med ett värde i st(0).
+    void fail(uint32_t error, bool value_on_stack)
+    {
+      if (!value_on_stack)
+	bytes({ 0xD9, 0xEE });              // fldz
+      bytes({ 0x41, 0xC7, 0x04, 0x24 });    // mov dword [r12], imm32
+      imm32(error);
+      bytes({ 0xE9 });                      // jmp epilogue
+      epilogue_fixups_.push_back(code_.size());
+      imm32(0);
+    }
+
+    void check_divisor()
+    {
+      bytes({ 0xD9, 0xEE });                // fldz
+      bytes({ 0xDF, 0xE9 });                // fucomip st, st(1)
+      bytes({ 0x7A, 0x0F });                // jp ok
+      bytes({ 0x75, 0x0D });                // jne ok
+      fail(1, true);                        // 13 byte
+    }
+
+    void call_pow()
+    {
+      using pow_type = long double (*)(long double, long double);
+      const pow_type function{ ::powl };
+
+      bytes({ 0x48, 0x83, 0xEC, 0x10 });    // sub rsp, 16
+      bytes({ 0xDB, 0x6C, 0x24, 0x10 });    // fld tbyte [rsp+16]
+      bytes({ 0xDB, 0x3C, 0x24 });          // fstp tbyte [rsp]
+      bytes({ 0xDB, 0x7C, 0x24, 0x10 });    // fstp tbyte [rsp+16]
+      bytes({ 0x48, 0xB8 });                // mov rax, imm64
+      imm64(reinterpret_cast<uint64_t>(function));
+      bytes({ 0xFF, 0xD0 });                // call rax
+      bytes({ 0x48, 0x83, 0xC4, 0x20 });    // add rsp, 32
+    }
+
+    // finish() lägger konstanterna sist, 16-bytejusterade, och fyller i
+    // alla relativa adresser.
+    vector<uint8_t> finish(const vector<long double>& constants)
+    {
+      for (size_t at : epilogue_fixups_)
+	patch(at, static_cast<uint32_t>(epilogue_ - (at + 4)));
+
+      while (code_.size() % 16 != 0)
+	code_.push_back(0xCC);
+      const size_t base = code_.size();
+      code_.resize(base + 16 * constants.size());
+      for (size_t i = 0; i < constants.size(); ++i)
+	memcpy(&code_[base + 16 * i], &constants[i], sizeof(long double));
+
+      for (auto& fixup : constant_fixups_)
+	patch(fixup.first, static_cast<uint32_t>(base + 16 * fixup.second - (fixup.first + 4)));
+
+      return std::move(code_);
+    }
+
+  private:
+    vector<uint8_t>              code_;
+    vector<size_t>               epilogue_fixups_;
+    vector<pair<size_t, size_t>> constant_fixups_;
+    size_t                       epilogue_{ 0 };
+
+    void patch(size_t at, uint32_t value)
+    {
+      for (int i = 0; i < 4; ++i)
+	code_[at + i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+  };
+#endif
+}
+
+/*
+ * Konstruktorn kompilerar uttrycket till bytekod och, där det går, vidare
+ * till maskinkod. Misslyckas det används trädevalueringen i evaluate().
+ */
+Jit_Expression::Jit_Expression(const Expression& expression)
+  : expression_(expression), program_(expression.compile())
+{
+#ifdef JIT_AVAILABLE
+  // Värdena ligger på maskinstacken, så mycket djupa uttryck evalueras
+  // i stället med trädet.
+  if (program_.max_depth_ > max_native_depth)
+    return;
+
+  Code_Buffer buffer;
+  size_t depth{ 0 };
+
+  buffer.prologue();
+  buffer.reserve_temporaries(program_.temporaries_);
+  for (const Instruction& instruction : program_.code_)
+    {
+      switch (instruction.op)
+	{
+	case Opcode::Constant:
+	  if (depth++ > 0) buffer.spill();
+	  buffer.load_constant(instruction.arg);
+	  break;
+	case Opcode::Load:
+	  if (depth++ > 0) buffer.spill();
+	  buffer.load_variable(instruction.arg);
+	  break;
+	case Opcode::Store:
+	  buffer.store_variable(instruction.arg);
+	  break;
+	case Opcode::Add:
+	  buffer.pop_second();
+	  buffer.bytes({ 0xDE, 0xC1 });     // faddp st(1), st
+	  --depth;
+	  break;
+	case Opcode::Subtract:
+	  buffer.pop_second();
+	  buffer.bytes({ 0xDE, 0xE1 });     // fsubrp st(1), st
+	  --depth;
+	  break;
+	case Opcode::Multiply:
+	  buffer.pop_second();
+	  buffer.bytes({ 0xDE, 0xC9 });     // fmulp st(1), st
+	  --depth;
+	  break;
+	case Opcode::Divide:
+	  buffer.check_divisor();
+	  buffer.pop_second();
+	  buffer.bytes({ 0xDE, 0xF1 });     // fdivrp st(1), st
+	  --depth;
+	  break;
+	case Opcode::Power:
+	  buffer.call_pow();
+	  --depth;
+	  break;
+	case Opcode::Save:
+	  buffer.save_temporary(instruction.arg);
+	  break;
+	case Opcode::Recall:
+	  if (depth++ > 0) buffer.spill();
+	  buffer.load_temporary(instruction.arg);
+	  break;
+	case Opcode::Fail:
+	  buffer.fail(2 + instruction.arg, depth > 0);
+	  ++depth;
+	  break;
+	}
+    }
+  buffer.epilogue();
+
+  const vector<uint8_t> code = buffer.finish(program_.constants_);
+  void* page = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED)
+    return;
+
+  memcpy(page, code.data(), code.size());
+  if (mprotect(page, code.size(), PROT_READ | PROT_EXEC) != 0)
+    {
+      munmap(page, code.size());
+      return;
+    }
+  code_ = page;
+  code_size_ = code.size();
+#endif
+}
+
+Jit_Expression::~Jit_Expression()
+{
+#ifdef JIT_AVAILABLE
+  if (code_ != nullptr)
+    munmap(code_, code_size_);
+#endif
+}
+
+Jit_Expression::Jit_Expression(Jit_Expression&& other) noexcept
+{
+  swap(other);
+}
+
+Jit_Expression& Jit_Expression::operator=(Jit_Expression&& other) & noexcept
+{
+  swap(other);
+  return *this;
+}
+
+long double Jit_Expression::evaluate() const
+{
+  return evaluate(Environment::global());
+}
+
+/*
+ * evaluate() anropar maskinkoden direkt på miljöns värden. Utan maskinkod
+ * används trädevalueringen.
+ */
+long double Jit_Expression::evaluate(Environment& environment) const
+{
+  if (code_ == nullptr)
+    return expression_.evaluate(environment);
+
+  environment.resize(program_.slots_);
+  for (size_t slot : program_.stored_)
+    environment.touch(slot);
+  int error{ 0 };
+  const long double result = function()(environment.data(), &error);
+
+  if (error == 1)
+    throw expression_tree_error("Division med 0");
+  if (error > 1)
+    throw expression_tree_error(program_.errors_[error - 2]);
+  return result;
+}
+
+bool Jit_Expression::native() const
+{
+  return code_ != nullptr;
+}
+
+Jit_Expression::function_type Jit_Expression::function() const
+{
+  return reinterpret_cast<function_type>(code_);
+}
+
+void Jit_Expression::swap(Jit_Expression& other) noexcept
+{
+  std::swap(expression_, other.expression_);
+  std::swap(program_, other.program_);
+  std::swap(code_, other.code_);
+  std::swap(code_size_, other.code_size_);
+}
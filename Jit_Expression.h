@@ -0,0 +1,49 @@
+/*
+ * Jit_Expression.h
+ */
+#ifndef JIT_EXPRESSION_H
+#define JIT_EXPRESSION_H
+#include "Compiled_Expression.h"
+#include "Expression.h"
+#include <cstddef>
+
+class Environment;
+
+/**
+ * Jit_Expression översätter ett uttrycks bytekod till maskinkod för
+ * x86-64 (Linux) i en egen exekverbar minnessida. Där det inte går, på
+ * andra plattformar eller om sidan inte kan skapas, evalueras uttrycket
+ * i stället med trädevalueringen, på en egen kopia av uttrycket.
+ */
+class Jit_Expression
+{
+ public:
+  // Den genererade funktionen: variables är en Environments värden, indexerade
+  // med slot. Vid fel sätts *error till 1 för division med 0, annars till
+  // 2 + index för ett kompileringsfel.
+  using function_type = long double (*)(long double* variables, int* error);
+
+  explicit Jit_Expression(const Expression& expression);
+  ~Jit_Expression();
+
+  Jit_Expression(const Jit_Expression&) = delete;
+  Jit_Expression& operator=(const Jit_Expression&) = delete;
+
+  Jit_Expression(Jit_Expression&& other) noexcept;
+  Jit_Expression& operator=(Jit_Expression&& other) & noexcept;
+
+  long double   evaluate() const;
+  long double   evaluate(Environment& environment) const;
+  bool          native() const;
+  function_type function() const;
+
+  void swap(Jit_Expression& other) noexcept;
+
+ private:
+  Expression          expression_;
+  Compiled_Expression program_;
+  void*               code_{ nullptr };
+  std::size_t         code_size_{ 0 };
+};
+
+#endif
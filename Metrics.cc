@@ -0,0 +1,217 @@
+/*
+ * Metrics.cc
+ */
+#include "Metrics.h"
+#include "Parse_Cache.h"
+#include <array>
+#include <iomanip>
+#include <ostream>
+using namespace std;
+
+namespace
+{
+  constexpr size_t phases{ static_cast<size_t>(Metrics::Phase::Count) };
+  constexpr size_t counters{ static_cast<size_t>(Metrics::Counter::Count) };
+
+  const char* const phase_names[phases]{
+    "normalize", "parse", "import", "evaluate", "compile", "render"
+  };
+  const char* const counter_names[counters]{ "nodes_created", "exceptions" };
+
+  struct Phase_Data
+  {
+    atomic<uint64_t> calls{ 0 };
+    atomic<uint64_t> nanoseconds{ 0 };
+    atomic<uint64_t> maximum{ 0 };
+  };
+
+  struct Command_Data
+  {
+    atomic<uint64_t> calls{ 0 };
+    atomic<uint64_t> nanoseconds{ 0 };
+    array<atomic<uint64_t>, Metrics::buckets> buckets{};
+  };
+
+  struct Data
+  {
+    array<Phase_Data, phases>     phase;
+    array<atomic<uint64_t>, counters> counter{};
+    array<Command_Data, 128>      command;
+  };
+
+  Data& data()
+  {
+    static Data instance;
+    return instance;
+  }
+
+  // bucket() ger index för den minsta gränsen 2^k mikrosekunder >= tiden.
+  size_t bucket(uint64_t nanoseconds)
+  {
+    uint64_t limit{ 1000 };
+    size_t index{ 0 };
+    while (index + 1 < Metrics::buckets && nanoseconds > limit)
+      {
+	limit *= 2;
+	++index;
+      }
+    return index;
+  }
+
+  double bucket_limit(size_t index)
+  {
+    return 1e-6 * static_cast<double>(uint64_t{ 1 } << index);
+  }
+}
+
+bool Metrics::enabled()
+{
+#ifdef KALKYLATOR_METRICS
+  return true;
+#else
+  return false;
+#endif
+}
+
+void Metrics::add(Counter counter, uint64_t amount)
+{
+  data().counter[static_cast<size_t>(counter)].fetch_add(amount, memory_order_relaxed);
+}
+
+void Metrics::record(Phase phase, uint64_t nanoseconds)
+{
+  auto& p = data().phase[static_cast<size_t>(phase)];
+  p.calls.fetch_add(1, memory_order_relaxed);
+  p.nanoseconds.fetch_add(nanoseconds, memory_order_relaxed);
+  uint64_t maximum = p.maximum.load(memory_order_relaxed);
+  while (nanoseconds > maximum &&
+	 !p.maximum.compare_exchange_weak(maximum, nanoseconds, memory_order_relaxed))
+    ;
+}
+
+void Metrics::record_command(char command, uint64_t nanoseconds)
+{
+  auto& c = data().command[static_cast<unsigned char>(command) & 0x7F];
+  c.calls.fetch_add(1, memory_order_relaxed);
+  c.nanoseconds.fetch_add(nanoseconds, memory_order_relaxed);
+  c.buckets[bucket(nanoseconds)].fetch_add(1, memory_order_relaxed);
+}
+
+void Metrics::reset()
+{
+  Data& d = data();
+  for (auto& p : d.phase)
+    p.calls = p.nanoseconds = p.maximum = 0;
+  for (auto& c : d.counter)
+    c = 0;
+  for (auto& c : d.command)
+    {
+      c.calls = c.nanoseconds = 0;
+      for (auto& b : c.buckets)
+	b = 0;
+    }
+}
+
+void Metrics::report(ostream& os)
+{
+  if (!enabled())
+    {
+      os << "Mätningar är avstängda, kompilera med -DKALKYLATOR_METRICS\n";
+      return;
+    }
+
+  const Data& d = data();
+  os << left << setw(12) << "fas" << right << setw(12) << "anrop"
+     << setw(14) << "total ms" << setw(14) << "medel ns" << setw(14) << "max ns" << '\n';
+  for (size_t i = 0; i < phases; ++i)
+    {
+      const uint64_t calls = d.phase[i].calls;
+      const uint64_t total = d.phase[i].nanoseconds;
+      os << left << setw(12) << phase_names[i] << right << setw(12) << calls
+	 << setw(14) << fixed << setprecision(3) << total / 1e6
+	 << setw(14) << setprecision(0) << (calls ? double(total) / calls : 0.0)
+	 << setw(14) << d.phase[i].maximum.load() << '\n';
+    }
+  os.unsetf(ios::floatfield);
+  os << setprecision(6);
+
+  for (size_t i = 0; i < counters; ++i)
+    os << counter_names[i] << ": " << d.counter[i].load() << '\n';
+
+  const auto cache = Parse_Cache::global().statistics();
+  os << "parse_cache: " << cache.hits << " träffar, " << cache.misses << " missar, "
+     << cache.evictions << " utkastade\n";
+
+  // Histogrammet visar bara intervallen med kommandon i.
+  for (size_t c = 0; c < d.command.size(); ++c)
+    {
+      const uint64_t calls = d.command[c].calls;
+      if (calls == 0)
+	continue;
+      os << "kommando " << static_cast<char>(c) << ": " << calls << " st, medel "
+	 << d.command[c].nanoseconds / calls / 1000 << " us\n";
+      for (size_t b = 0; b < buckets; ++b)
+	if (uint64_t n = d.command[c].buckets[b])
+	  {
+	    os << "  ";
+	    if (b + 1 < buckets)
+	      os << "<= " << (uint64_t{ 1 } << b) << " us";
+	    else
+	      os << ">  " << (uint64_t{ 1 } << (b - 1)) << " us";
+	    os << ": " << n << '\n';
+	  }
+    }
+}
+
+void Metrics::write_prometheus(ostream& os)
+{
+  const Data& d = data();
+
+  os << "# HELP kalkylator_phase_seconds_total Tid i varje fas.\n"
+     << "# TYPE kalkylator_phase_seconds_total counter\n";
+  for (size_t i = 0; i < phases; ++i)
+    os << "kalkylator_phase_seconds_total{phase=\"" << phase_names[i] << "\"} "
+       << d.phase[i].nanoseconds / 1e9 << '\n';
+  os << "# HELP kalkylator_phase_calls_total Antal mätningar av varje fas.\n"
+     << "# TYPE kalkylator_phase_calls_total counter\n";
+  for (size_t i = 0; i < phases; ++i)
+    os << "kalkylator_phase_calls_total{phase=\"" << phase_names[i] << "\"} "
+       << d.phase[i].calls.load() << '\n';
+
+  for (size_t i = 0; i < counters; ++i)
+    os << "# TYPE kalkylator_" << counter_names[i] << "_total counter\n"
+       << "kalkylator_" << counter_names[i] << "_total " << d.counter[i].load() << '\n';
+
+  const auto cache = Parse_Cache::global().statistics();
+  os << "# TYPE kalkylator_parse_cache_hits_total counter\n"
+     << "kalkylator_parse_cache_hits_total " << cache.hits << '\n'
+     << "# TYPE kalkylator_parse_cache_misses_total counter\n"
+     << "kalkylator_parse_cache_misses_total " << cache.misses << '\n'
+     << "# TYPE kalkylator_parse_cache_evictions_total counter\n"
+     << "kalkylator_parse_cache_evictions_total " << cache.evictions << '\n';
+
+  os << "# HELP kalkylator_command_seconds Latens per kommando.\n"
+     << "# TYPE kalkylator_command_seconds histogram\n";
+  for (size_t c = 0; c < d.command.size(); ++c)
+    {
+      const uint64_t calls = d.command[c].calls;
+      if (calls == 0)
+	continue;
+      const char command = static_cast<char>(c);
+      uint64_t cumulative{ 0 };
+      for (size_t b = 0; b < buckets; ++b)
+	{
+	  cumulative += d.command[c].buckets[b];
+	  os << "kalkylator_command_seconds_bucket{command=\"" << command << "\",le=\"";
+	  if (b + 1 < buckets)
+	    os << bucket_limit(b);
+	  else
+	    os << "+Inf";
+	  os << "\"} " << cumulative << '\n';
+	}
+      os << "kalkylator_command_seconds_sum{command=\"" << command << "\"} "
+	 << d.command[c].nanoseconds / 1e9 << '\n'
+	 << "kalkylator_command_seconds_count{command=\"" << command << "\"} "
+	 << calls << '\n';
+    }
+}
@@ -0,0 +1,101 @@
+/*
+ * Metrics.h
+ */
+#ifndef METRICS_H
+#define METRICS_H
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+
+/**
+ * Metrics samlar tider per fas, räknare och en latenshistogram per
+ * kalkylatorkommando. Mätpunkterna i koden skrivs med makrona nedan och
+ * finns bara om programmet kompileras med -DKALKYLATOR_METRICS; annars
+ * expanderar makrona till ingenting och kostar inget. Alla räknare är
+ * atomära och kan uppdateras från flera trådar.
+ */
+class Metrics
+{
+ public:
+  Metrics() = delete;
+
+  enum class Phase { Normalize, Parse, Import, Evaluate, Compile, Render, Count };
+  enum class Counter { Nodes_Created, Exceptions, Count };
+
+  static constexpr std::size_t buckets{ 21 };   // 1 us, 2 us, ... 2^20 us, +Inf
+
+  static bool enabled();
+
+  static void add(Counter counter, std::uint64_t amount = 1);
+  static void record(Phase phase, std::uint64_t nanoseconds);
+  static void record_command(char command, std::uint64_t nanoseconds);
+  static void reset();
+
+  // report() skriver en läsbar sammanställning, write_prometheus() samma
+  // värden i Prometheus textformat.
+  static void report(std::ostream& os);
+  static void write_prometheus(std::ostream& os);
+
+  // Timer mäter tiden från konstruktion till destruktion.
+  class Timer
+  {
+   public:
+    explicit Timer(Phase phase) : phase_(phase), start_(clock::now()) {}
+    ~Timer() { record(phase_, elapsed()); }
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+   protected:
+    using clock = std::chrono::steady_clock;
+
+    std::uint64_t elapsed() const
+    {
+      return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start_).count());
+    }
+
+   private:
+    Phase             phase_;
+    clock::time_point start_;
+  };
+
+  class Command_Timer
+  {
+   public:
+    explicit Command_Timer(char command)
+      : command_(command), start_(std::chrono::steady_clock::now()) {}
+    ~Command_Timer()
+    {
+      record_command(command_, static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start_).count()));
+    }
+
+    Command_Timer(const Command_Timer&) = delete;
+    Command_Timer& operator=(const Command_Timer&) = delete;
+
+   private:
+    char                                  command_;
+    std::chrono::steady_clock::time_point start_;
+  };
+};
+
+#define METRICS_CONCAT_(a, b) a##b
+#define METRICS_CONCAT(a, b) METRICS_CONCAT_(a, b)
+
+#ifdef KALKYLATOR_METRICS
+#define METRICS_TIME(phase) \
+  Metrics::Timer METRICS_CONCAT(metrics_timer_, __LINE__){ Metrics::Phase::phase }
+#define METRICS_COMMAND(command) \
+  Metrics::Command_Timer METRICS_CONCAT(metrics_timer_, __LINE__){ command }
+#define METRICS_COUNT(counter) Metrics::add(Metrics::Counter::counter)
+#else
+#define METRICS_TIME(phase) ((void)0)
+#define METRICS_COMMAND(command) ((void)0)
+#define METRICS_COUNT(counter) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Node_Arena.cc
+ */
+#include "Node_Arena.h"
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+using namespace std;
+
+Node_Arena::Node_Arena(Node_Arena&& other) noexcept
+{
+  swap(other);
+}
+
+Node_Arena& Node_Arena::operator=(Node_Arena&& other) & noexcept
+{
+  clear();
+  swap(other);
+  return *this;
+}
+
+/*
+ * allocate() returnerar size byte justerade till alignment. Får inte
+ * nuvarande block plats tas ett nytt, med geometriskt växande storlek.
+ */
+void* Node_Arena::allocate(size_t size, size_t alignment)
+{
+  auto address = reinterpret_cast<uintptr_t>(next_);
+  auto aligned = (address + alignment - 1) & ~(uintptr_t{ alignment } - 1);
+
+  if (next_ == nullptr || aligned + size > reinterpret_cast<uintptr_t>(end_))
+    {
+      add_block(size + alignment);
+      address = reinterpret_cast<uintptr_t>(next_);
+      aligned = (address + alignment - 1) & ~(uintptr_t{ alignment } - 1);
+    }
+
+  char* result = reinterpret_cast<char*>(aligned);
+  used_ += (result + size) - next_;
+  next_ = result + size;
+  return result;
+}
+
+/*
+ * reserve() ser till att minst size byte kan allokeras utan nytt block.
+ */
+void Node_Arena::reserve(size_t size)
+{
+  if (next_ == nullptr || static_cast<size_t>(end_ - next_) < size)
+    add_block(size);
+}
+
+size_t Node_Arena::used() const
+{
+  return used_;
+}
+
+void Node_Arena::clear() noexcept
+{
+  blocks_.clear();
+  next_ = end_ = nullptr;
+  used_ = 0;
+  block_size_ = min_block_size_;
+}
+
+void Node_Arena::swap(Node_Arena& other) noexcept
+{
+  std::swap(blocks_, other.blocks_);
+  std::swap(next_, other.next_);
+  std::swap(end_, other.end_);
+  std::swap(used_, other.used_);
+  std::swap(block_size_, other.block_size_);
+}
+
+void Node_Arena::add_block(size_t size)
+{
+  size = max(size, block_size_);
+  blocks_.emplace_back(new char[size]);
+  next_ = blocks_.back().get();
+  end_ = next_ + size;
+  block_size_ = min(block_size_ * 2, max_block_size_);
+}
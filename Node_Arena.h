@@ -0,0 +1,48 @@
+/*
+ * Node_Arena.h
+ */
+#ifndef NODE_ARENA_H
+#define NODE_ARENA_H
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+/**
+ * Node_Arena är en enkel "bump"-allokator för noderna i ett uttrycksträd.
+ * Minnet tas i stora block och frigörs bara i sin helhet, när arenan
+ * töms eller förstörs. Noder som ligger i en arena destrueras aldrig en
+ * och en och får därför inte äga några egna resurser.
+ */
+class Node_Arena
+{
+ public:
+  Node_Arena() = default;
+  ~Node_Arena() = default;
+
+  Node_Arena(const Node_Arena&) = delete;
+  Node_Arena& operator=(const Node_Arena&) = delete;
+
+  Node_Arena(Node_Arena&& other) noexcept;
+  Node_Arena& operator=(Node_Arena&& other) & noexcept;
+
+  void* allocate(std::size_t size, std::size_t alignment);
+
+  void        reserve(std::size_t size);
+  std::size_t used() const;
+  void        clear() noexcept;
+  void        swap(Node_Arena& other) noexcept;
+
+ private:
+  static constexpr std::size_t min_block_size_{ 1024 };
+  static constexpr std::size_t max_block_size_{ 64 * 1024 };
+
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  char*       next_{ nullptr };
+  char*       end_{ nullptr };
+  std::size_t used_{ 0 };
+  std::size_t block_size_{ min_block_size_ };
+
+  void add_block(std::size_t size);
+};
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ * Node_Pool.cc
+ */
+#include "Node_Pool.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+using namespace std;
+
+namespace
+{
+  size_t combine(size_t seed, size_t value)
+  {
+    return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+  }
+
+  bool commutative(Node_Kind kind)
+  {
+    return kind == Node_Kind::Plus || kind == Node_Kind::Times;
+  }
+
+  bool equal_operands(const Expression_Tree* left, const Expression_Tree* right)
+  {
+    switch (left->kind())
+      {
+      case Node_Kind::Integer:
+	{
+	  auto l = static_cast<const Integer*>(left);
+	  auto r = static_cast<const Integer*>(right);
+	  if (l->big_exact() != nullptr || r->big_exact() != nullptr)
+	    return l->big_exact() != nullptr && r->big_exact() != nullptr &&
+	      *l->big_exact() == *r->big_exact();
+	  return l->get_value() == r->get_value();
+	}
+      case Node_Kind::Real:
+	return static_cast<const Real*>(left)->get_value() ==
+	  static_cast<const Real*>(right)->get_value();
+      default:
+	return static_cast<const Variable*>(left)->get_slot() ==
+	  static_cast<const Variable*>(right)->get_slot();
+      }
+  }
+
+  const Expression_Tree* left_of(const Expression_Tree* node)
+  {
+    return static_cast<const Binary_Operator*>(node)->left();
+  }
+
+  const Expression_Tree* right_of(const Expression_Tree* node)
+  {
+    return static_cast<const Binary_Operator*>(node)->right();
+  }
+}
+
+size_t Node_Pool::Key_Hash::operator()(const Key& key) const noexcept
+{
+  return combine(combine(static_cast<size_t>(key.kind), hash<uintptr_t>{}(key.first)),
+		 hash<uintptr_t>{}(key.second));
+}
+
+/*
+ * intern() returnerar noden för key, och skapar den med hash om den saknas.
+ * En nod som hittas igen markeras som delad. Ett nytt heltalsdeltråd vars
+ * exakta värde inte ryms i int64_t får värdet beräknat direkt; barnens
+ * värden är redan kända, så det kostar en operation.
+ */
+template <typename Node, typename... Args>
+Expression_Tree* Node_Pool::intern(const Key& key, size_t hash, Args... args)
+{
+  auto it = nodes_.find(key);
+  if (it != nodes_.end())
+    {
+      Expression_Tree* node = it->second;
+      if (node->kind() >= Node_Kind::Plus && !node->shared())
+	node->shared_.store(true, memory_order_relaxed);
+      return node;
+    }
+
+  Expression_Tree* node = new (arena_) Node{ args... };
+  node->hash_ = hash;
+  nodes_.emplace(key, node);
+  if (node->kind() >= Node_Kind::Plus && node->integral())
+    {
+      auto binary = static_cast<Binary_Operator*>(node);
+      int64_t small;
+      Big_Integer value;
+      if (!binary->small_exact(small) && binary->exact(value))
+	{
+	  integers_.push_back(std::move(value));
+	  binary->big_ = &integers_.back();
+	}
+    }
+  METRICS_COUNT(Nodes_Created);
+  return node;
+}
+
+Expression_Tree* Node_Pool::make_integer(int64_t value)
+{
+  const Key key{ Node_Kind::Integer, static_cast<uintptr_t>(value), 0 };
+  return intern<Integer>(key, Key_Hash{}(key), value);
+}
+
+/*
+ * Ett heltal som inte ryms i int64_t hittas efter sin text och får en hash
+ * av den.
+ */
+Expression_Tree* Node_Pool::make_integer(const Big_Integer& value)
+{
+  if (value.small())
+    return make_integer(value.to_int64());
+
+  string text = value.str();
+  auto it = big_integers_.find(text);
+  if (it != big_integers_.end())
+    return it->second;
+
+  integers_.push_back(value);
+  Expression_Tree* node = new (arena_) Integer{ &integers_.back() };
+  node->hash_ = combine(static_cast<size_t>(Node_Kind::Integer), hash<string>{}(text));
+  big_integers_.emplace(std::move(text), node);
+  METRICS_COUNT(Nodes_Created);
+  return node;
+}
+
+Expression_Tree* Node_Pool::make_real(long double value)
+{
+  // Nyckeln är de signifikanta byten i talets representation.
+  uintptr_t bits[2]{ 0, 0 };
+  memcpy(bits, &value, min(sizeof value, sizeof bits));
+  const Key key{ Node_Kind::Real, bits[0], bits[1] & 0xffff };
+  return intern<Real>(key, Key_Hash{}(key), value);
+}
+
+Expression_Tree* Node_Pool::make_variable(size_t slot)
+{
+  const Key key{ Node_Kind::Variable, slot, 0 };
+  return intern<Variable>(key, Key_Hash{}(key), slot);
+}
+
+Expression_Tree* Node_Pool::make_binary(Node_Kind kind, Expression_Tree* left,
+					Expression_Tree* right)
+{
+  size_t left_hash = left->hash();
+  size_t right_hash = right->hash();
+
+  // Operandernas ordning ingår i nyckeln, så noden skrivs ut som den
+  // skrevs in. Hashen tar bara hänsyn till ordningen när en tilldelning
+  // gör att den påverkar värdet.
+  if (commutative(kind) && left->pure() && right->pure() && left_hash > right_hash)
+    swap(left_hash, right_hash);
+
+  const Key key{ kind, reinterpret_cast<uintptr_t>(left), reinterpret_cast<uintptr_t>(right) };
+  const size_t hash = combine(combine(static_cast<size_t>(kind), left_hash), right_hash);
+
+  switch (kind)
+    {
+    case Node_Kind::Plus:   return intern<Plus>(key, hash, left, right);
+    case Node_Kind::Minus:  return intern<Minus>(key, hash, left, right);
+    case Node_Kind::Times:  return intern<Times>(key, hash, left, right);
+    case Node_Kind::Divide: return intern<Divide>(key, hash, left, right);
+    case Node_Kind::Power:  return intern<Power>(key, hash, left, right);
+    case Node_Kind::Assign: return intern<Assign>(key, hash, left, right);
+    default:
+      throw expression_tree_error("Node_Pool::make_binary() ingen binär operator");
+    }
+}
+
+/*
+ * import() kopierar ett träd från en annan pool i postordning med en egen
+ * stack. Delade noder kopieras en gång, så att en graf inte vecklas ut
+ * till ett träd, och kopian markeras som delad när den används igen.
+ */
+Expression_Tree* Node_Pool::import(const Expression_Tree* root)
+{
+  struct Frame
+  {
+    const Binary_Operator* node;
+    int                    step;
+  };
+  vector<Frame>            frames;
+  vector<Expression_Tree*> results;
+  unordered_map<const Expression_Tree*, Expression_Tree*> copied;
+
+  auto enter = [&](const Expression_Tree* node)
+    {
+      switch (node->kind())
+	{
+	case Node_Kind::Integer:
+	  if (const Big_Integer* big = static_cast<const Integer*>(node)->big_exact())
+	    results.push_back(make_integer(*big));
+	  else
+	    results.push_back(make_integer(static_cast<const Integer*>(node)->get_value()));
+	  return;
+	case Node_Kind::Real:
+	  results.push_back(make_real(static_cast<const Real*>(node)->get_value()));
+	  return;
+	case Node_Kind::Variable:
+	  results.push_back(make_variable(static_cast<const Variable*>(node)->get_slot()));
+	  return;
+	default:
+	  break;
+	}
+
+      if (node->shared())
+	{
+	  auto it = copied.find(node);
+	  if (it != copied.end())
+	    {
+	      it->second->shared_.store(true, memory_order_relaxed);
+	      results.push_back(it->second);
+	      return;
+	    }
+	}
+      frames.push_back({ static_cast<const Binary_Operator*>(node), 0 });
+    };
+
+  enter(root);
+  while (!frames.empty())
+    {
+      const Binary_Operator* node = frames.back().node;
+      const int step = frames.back().step++;
+      if (step < 2)
+	{
+	  enter(step == 0 ? node->left() : node->right());
+	  continue;
+	}
+
+      Expression_Tree* right = results.back();
+      results.pop_back();
+      results.back() = make_binary(node->kind(), results.back(), right);
+      if (node->shared())
+	copied.emplace(node, results.back());
+      frames.pop_back();
+    }
+  return results.back();
+}
+
+/*
+ * mark_shared() markerar varje operatornod som nås mer än en gång från
+ * root som delad. Noder som byggs en gång och sedan återanvänds ur en egen
+ * tabell, som i Expression_Tree::derive(), hittas aldrig igen i poolen och
+ * blir annars inte markerade.
+ */
+void Node_Pool::mark_shared(const Expression_Tree* root)
+{
+  vector<const Expression_Tree*>        stack{ root };
+  unordered_set<const Expression_Tree*> seen;
+  while (!stack.empty())
+    {
+      const Expression_Tree* node = stack.back();
+      stack.pop_back();
+      if (node->kind() < Node_Kind::Plus)
+	continue;
+      if (!seen.insert(node).second)
+	{
+	  node->shared_.store(true, memory_order_relaxed);
+	  continue;
+	}
+      auto binary = static_cast<const Binary_Operator*>(node);
+      stack.push_back(binary->right());
+      stack.push_back(binary->left());
+    }
+}
+
+/*
+ * lock() låser poolen. Uttryck som delar pool kan användas i olika trådar
+ * om den som skapar noder i poolen håller låset under hela operationen.
+ */
+unique_lock<mutex> Node_Pool::lock()
+{
+  return unique_lock<mutex>{ mutex_ };
+}
+
+/*
+ * reserve() förbereder poolen för att ta emot en kopia av other.
+ */
+void Node_Pool::reserve(const Node_Pool& other)
+{
+  arena_.reserve(other.used());
+  nodes_.reserve(other.size());
+}
+
+size_t Node_Pool::size() const
+{
+  return nodes_.size() + big_integers_.size();
+}
+
+size_t Node_Pool::used() const
+{
+  return arena_.used();
+}
+
+/*
+ * equivalent() avgör om två träd, möjligen från olika pooler, är
+ * strukturellt lika. Jämförelsen görs med en egen stack; för Plus och
+ * Times med rena barn prövas barnen i omvänd ordning om de inte är lika i
+ * samma ordning.
+ */
+bool Node_Pool::equivalent(const Expression_Tree* left, const Expression_Tree* right)
+{
+  // Steget anger vilken jämförelse av barnen som senast gjordes: 1 de
+  // vänstra, 2 de högra, 3 och 4 korsvis.
+  struct Frame
+  {
+    const Expression_Tree* left;
+    const Expression_Tree* right;
+    int                    step;
+  };
+  vector<Frame> frames{ { left, right, 0 } };
+  bool result{ false };
+
+  while (!frames.empty())
+    {
+      Frame& frame = frames.back();
+      const Expression_Tree* a = frame.left;
+      const Expression_Tree* b = frame.right;
+
+      switch (frame.step)
+	{
+	case 0:
+	  if (a == b)
+	    result = true;
+	  else if (a->hash() != b->hash() || a->kind() != b->kind())
+	    result = false;
+	  else if (a->kind() < Node_Kind::Plus)
+	    result = equal_operands(a, b);
+	  else
+	    {
+	      frame.step = 1;
+	      frames.push_back({ left_of(a), left_of(b), 0 });
+	      continue;
+	    }
+	  break;
+	case 1:
+	  if (result)
+	    {
+	      frame.step = 2;
+	      frames.push_back({ right_of(a), right_of(b), 0 });
+	      continue;
+	    }
+	  [[fallthrough]];
+	case 2:
+	  if (result)
+	    break;
+	  if (!commutative(a->kind()) || !a->pure())
+	    break;
+	  frame.step = 3;
+	  frames.push_back({ left_of(a), right_of(b), 0 });
+	  continue;
+	case 3:
+	  if (result)
+	    {
+	      frame.step = 4;
+	      frames.push_back({ right_of(a), left_of(b), 0 });
+	      continue;
+	    }
+	  break;
+	default:
+	  break;
+	}
+      frames.pop_back();
+    }
+  return result;
+}
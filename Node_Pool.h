@@ -0,0 +1,83 @@
+/*
+ * Node_Pool.h
+ */
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+#include "Expression_Tree.h"
+#include "Node_Arena.h"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * Node_Pool skapar och äger noderna i ett eller flera uttrycksträd. Varje
+ * nod finns bara en gång per pool: att skapa en nod som är strukturellt lik
+ * en befintlig ger den befintliga (hash-consing). a + b och b + a är
+ * olika noder, så att varje uttryck skrivs ut som det skrevs in, men när
+ * båda operanderna är rena har de samma strukturella hash och är
+ * equivalent().
+ * En pool är inte trådsäker; den som skapar noder i en pool som används
+ * av flera trådar ska hålla lock().
+ */
+class Node_Pool
+{
+ public:
+  Node_Pool() = default;
+  ~Node_Pool() = default;
+
+  Node_Pool(const Node_Pool&) = delete;
+  Node_Pool& operator=(const Node_Pool&) = delete;
+
+  Expression_Tree* make_integer(std::int64_t value);
+  Expression_Tree* make_integer(const Big_Integer& value);
+  Expression_Tree* make_real(long double value);
+  Expression_Tree* make_variable(std::size_t slot);
+  Expression_Tree* make_binary(Node_Kind kind, Expression_Tree* left,
+                               Expression_Tree* right);
+
+  Expression_Tree* import(const Expression_Tree* root);
+  void             mark_shared(const Expression_Tree* root);
+
+  std::unique_lock<std::mutex> lock();
+
+  void        reserve(const Node_Pool& other);
+  std::size_t size() const;
+  std::size_t used() const;
+
+  static bool equivalent(const Expression_Tree* left, const Expression_Tree* right);
+
+ private:
+  struct Key
+  {
+    Node_Kind      kind;
+    std::uintptr_t first;
+    std::uintptr_t second;
+
+    bool operator==(const Key& other) const
+    {
+      return kind == other.kind && first == other.first && second == other.second;
+    }
+  };
+
+  struct Key_Hash
+  {
+    std::size_t operator()(const Key& key) const noexcept;
+  };
+
+  // integers_ har de heltal som inte ryms i int64_t, både i Integer-löv
+  // och som exakta värden av heltalsdeltråd; big_integers_ hittar löven
+  // efter deras decimala text.
+  std::mutex                                         mutex_;
+  Node_Arena                                         arena_;
+  std::unordered_map<Key, Expression_Tree*, Key_Hash> nodes_;
+  std::deque<Big_Integer>                            integers_;
+  std::unordered_map<std::string, Expression_Tree*>  big_integers_;
+
+  template <typename Node, typename... Args>
+  Expression_Tree* intern(const Key& key, std::size_t hash, Args... args);
+};
+
+#endif
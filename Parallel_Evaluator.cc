@@ -0,0 +1,56 @@
+/*
+ * Parallel_Evaluator.cc
+ */
+#include "Parallel_Evaluator.h"
+#include "Environment.h"
+#include "Expression.h"
+#include "Thread_Pool.h"
+#include <exception>
+using namespace std;
+
+namespace
+{
+  // Antal uttryck per uppgift; miljön kopieras en gång per uppgift.
+  constexpr size_t grain{ 256 };
+}
+
+vector<Evaluation_Result> evaluate_all(const vector<Expression>& expressions,
+				       const Environment& environment,
+				       Thread_Pool& pool)
+{
+  vector<Evaluation_Result> results(expressions.size());
+
+  pool.parallel_for(expressions.size(), grain, [&](size_t first, size_t last)
+    {
+      Environment local{ environment };
+      for (size_t i = first; i < last; ++i)
+	{
+	  try
+	    {
+	      // En tilldelning får inte synas i nästa uttryck.
+	      if (expressions[i].pure())
+		results[i].value = expressions[i].evaluate(local);
+	      else
+		{
+		  Environment copy{ environment };
+		  results[i].value = expressions[i].evaluate(copy);
+		}
+	    }
+	  catch (const exception& e)
+	    {
+	      results[i].error = e.what();
+	    }
+	  catch (...)
+	    {
+	      results[i].error = "Ett okänt fel har inträffat.";
+	    }
+	}
+    });
+  return results;
+}
+
+vector<Evaluation_Result> evaluate_all(const vector<Expression>& expressions,
+				       const Environment& environment)
+{
+  return evaluate_all(expressions, environment, Thread_Pool::global());
+}
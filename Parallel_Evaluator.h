@@ -0,0 +1,39 @@
+/*
+ * Parallel_Evaluator.h
+ */
+#ifndef PARALLEL_EVALUATOR_H
+#define PARALLEL_EVALUATOR_H
+#include <cstddef>
+#include <string>
+#include <vector>
+
+class Environment;
+class Expression;
+class Thread_Pool;
+
+/**
+ * Evaluation_Result är resultatet av ett uttryck i evaluate_all(): värdet,
+ * eller felmeddelandet om evalueringen kastade ett undantag.
+ */
+struct Evaluation_Result
+{
+  long double value{ 0 };
+  std::string error;
+
+  bool ok() const { return error.empty(); }
+};
+
+/**
+ * evaluate_all() evaluerar alla uttryck parallellt i pool och returnerar
+ * resultaten i samma ordning som uttrycken. Varje uttryck evalueras mot en
+ * kopia av environment som hör till den tråd som utför det, så tilldelningar
+ * syns inte i environment eller i andra uttryck.
+ */
+std::vector<Evaluation_Result> evaluate_all(const std::vector<Expression>& expressions,
+                                            const Environment& environment,
+                                            Thread_Pool& pool);
+
+std::vector<Evaluation_Result> evaluate_all(const std::vector<Expression>& expressions,
+                                            const Environment& environment);
+
+#endif
@@ -0,0 +1,279 @@
+/*
+ * Parallel_Expression.cc
+ */
+#include "Parallel_Expression.h"
+#include "Environment.h"
+#include "Expression_Tree.h"
+#include "Metrics.h"
+#include "Thread_Pool.h"
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <unordered_map>
+#include <utility>
+using namespace std;
+
+namespace
+{
+  // sequential() evaluerar ett litet deltråd i den egna tråden.
+  long double sequential(const Expression_Tree* node, Environment& environment)
+  {
+    Evaluation_Scope scope{ Evaluation_Scope::Mode::Memoized };
+    return node->value<long double>(environment);
+  }
+}
+
+/*
+ * Konstruktorn räknar deltrådens storlek nerifrån och upp och lägger
+ * skelettnoderna i parts_, barn före förälder. Heltalsdeltråd räknas som
+ * löv, eftersom de beräknas exakt. Under en delad nod, utom roten, blir
+ * inget en skelettnod, så skelettet är ett träd; delade deltråd
+ * evalueras sekventiellt, med minne.
+ */
+Parallel_Expression::Parallel_Expression(const Expression& expression, bool rebalance,
+                                         size_t cutoff)
+  : expression_(rebalance && !expression.empty() ? expression.rebalance() : expression)
+{
+  cutoff = max<size_t>(cutoff, 2);
+  if (expression_.empty() ||
+      expression_.precision() != Expression::Precision::Long_Double ||
+      !expression_.root_->reusable())
+    return;
+
+  const Expression_Tree* top = expression_.root_;
+  if (top->kind() == Node_Kind::Assign)
+    {
+      auto assign = static_cast<const Binary_Operator*>(top);
+      if (assign->left()->kind() != Node_Kind::Variable)
+	return;
+      assign_ = true;
+      target_ = static_cast<const Variable*>(assign->left())->get_slot();
+      top = assign->right();
+    }
+
+  // mark är skelettets storlek när noden påbörjades; skelettnoderna i en
+  // delad nods deltråd ligger sist och tas bort igen.
+  struct Frame
+  {
+    const Expression_Tree* node;
+    size_t                 mark;
+    bool                   visited;
+  };
+  struct Size
+  {
+    size_t   size;
+    uint32_t part;
+  };
+  vector<Frame> frames{ { top, 0, false } };
+  vector<Size>  sizes;
+  unordered_map<const Expression_Tree*, size_t> shared_sizes;
+
+  while (!frames.empty())
+    {
+      const Frame frame = frames.back();
+      frames.pop_back();
+      const Expression_Tree* node = frame.node;
+      if (!frame.visited)
+	{
+	  if (node->kind() < Node_Kind::Plus || node->integral())
+	    {
+	      sizes.push_back({ 1, none });
+	      continue;
+	    }
+	  if (node->shared() && node != top)
+	    {
+	      auto it = shared_sizes.find(node);
+	      if (it != shared_sizes.end())
+		{
+		  sizes.push_back({ it->second, none });
+		  continue;
+		}
+	    }
+	  auto binary = static_cast<const Binary_Operator*>(node);
+	  frames.push_back({ node, parts_.size(), true });
+	  frames.push_back({ binary->right(), 0, false });
+	  frames.push_back({ binary->left(), 0, false });
+	  continue;
+	}
+
+      const Size right = sizes.back();
+      sizes.pop_back();
+      const Size left = sizes.back();
+      sizes.pop_back();
+      const size_t size = min(1 + left.size + right.size, SIZE_MAX / 2);
+      uint32_t part{ none };
+      if (node->shared() && node != top)
+	{
+	  parts_.resize(frame.mark);
+	  shared_sizes.emplace(node, size);
+	}
+      else if (parts_.size() < none - 3)
+	{
+	  // En nod med två stora barn delas; de blir skelettnoder utan barn
+	  // om de inte redan är det. Noder ovanför en delning hör också till
+	  // skelettet, men en kedja utan delning evalueras sekventiellt.
+	  auto binary = static_cast<const Binary_Operator*>(node);
+	  Part current{ binary, left.part, right.part };
+	  if (left.size >= cutoff && right.size >= cutoff)
+	    {
+	      if (current.left == none)
+		{
+		  current.left = static_cast<uint32_t>(parts_.size());
+		  parts_.push_back({ static_cast<const Binary_Operator*>(binary->left()), none, none });
+		}
+	      if (current.right == none)
+		{
+		  current.right = static_cast<uint32_t>(parts_.size());
+		  parts_.push_back({ static_cast<const Binary_Operator*>(binary->right()), none, none });
+		}
+	    }
+	  if (current.left != none || current.right != none)
+	    {
+	      part = static_cast<uint32_t>(parts_.size());
+	      parts_.push_back(current);
+	    }
+	}
+      sizes.push_back({ size, part });
+    }
+
+  if (sizes.back().part == none)
+    parts_.clear();
+  parts_.shrink_to_fit();
+}
+
+long double Parallel_Expression::evaluate() const
+{
+  return evaluate(Environment::global());
+}
+
+long double Parallel_Expression::evaluate(Environment& environment) const
+{
+  return evaluate(environment, Thread_Pool::global());
+}
+
+/*
+ * evaluate() evaluerar skelettet från roten, sist i parts_. Utan skelett
+ * evalueras uttrycket som vanligt.
+ */
+long double Parallel_Expression::evaluate(Environment& environment, Thread_Pool& pool) const
+{
+  if (parts_.empty())
+    return expression_.evaluate(environment);
+
+  METRICS_TIME(Evaluate);
+  const long double result = run(static_cast<uint32_t>(parts_.size() - 1), environment, pool);
+  if (assign_)
+    environment.set(target_, result);
+  return result;
+}
+
+size_t Parallel_Expression::parts() const
+{
+  return parts_.size();
+}
+
+/*
+ * run() går ner i skelettet från part. Har en skelettnod två stora barn
+ * läggs det vänstra ut som en uppgift och den egna tråden fortsätter till
+ * höger; annars fortsätter den till det stora barnet. På vägen upp väntas
+ * uppgifterna in, och under tiden utför tråden andra uppgifter. Små barn
+ * evalueras i samma ordning som utan parallellism, så även felen blir
+ * desamma när bara ett barn kan kasta.
+ */
+long double Parallel_Expression::run(uint32_t part, Environment& environment,
+                                     Thread_Pool& pool) const
+{
+  // value är vänster barns värde. frames är en deque så att uppgifterna
+  // kan skriva i sin Frame medan nya läggs till.
+  struct Frame
+  {
+    explicit Frame(uint32_t part) : part(part) {}
+
+    uint32_t       part;
+    long double    value{ 0 };
+    bool           fork{ false };
+    atomic<size_t> remaining{ 0 };
+    exception_ptr  error;
+  };
+  deque<Frame>  frames;
+  long double   result{ 0 };
+  exception_ptr error;
+
+  try
+    {
+      for (;;)
+	{
+	  const Part& current = parts_[part];
+	  if (current.left == none && current.right == none)
+	    {
+	      result = sequential(current.node, environment);
+	      break;
+	    }
+
+	  Frame& frame = frames.emplace_back(part);
+	  if (current.left == none)
+	    {
+	      frame.value = sequential(current.node->left(), environment);
+	      part = current.right;
+	    }
+	  else if (current.right == none)
+	    part = current.left;
+	  else
+	    {
+	      frame.fork = true;
+	      frame.remaining = 1;
+	      pool.submit([this, &frame, &environment, &pool, child = current.left]
+		{
+		  try
+		    {
+		      frame.value = run(child, environment, pool);
+		    }
+		  catch (...)
+		    {
+		      frame.error = current_exception();
+		    }
+		  frame.remaining = 0;
+		});
+	      part = current.right;
+	    }
+	}
+    }
+  catch (...)
+    {
+      error = current_exception();
+    }
+
+  // Alla uppgifter väntas in, även efter ett fel, eftersom de skriver i
+  // frames. Ett fel till vänster ersätter ett fel längre ner till höger.
+  for (size_t i = frames.size(); i-- > 0;)
+    {
+      Frame& frame = frames[i];
+      if (frame.fork)
+	{
+	  pool.run_until(frame.remaining);
+	  if (frame.error)
+	    error = frame.error;
+	}
+      if (error)
+	continue;
+
+      const Binary_Operator* node = parts_[frame.part].node;
+      try
+	{
+	  if (parts_[frame.part].right == none)
+	    result = node->apply<long double>(result, sequential(node->right(), environment),
+					      environment);
+	  else
+	    result = node->apply<long double>(frame.value, result, environment);
+	}
+      catch (...)
+	{
+	  error = current_exception();
+	}
+    }
+
+  if (error)
+    rethrow_exception(error);
+  return result;
+}
@@ -0,0 +1,63 @@
+/*
+ * Parallel_Expression.h
+ */
+#ifndef PARALLEL_EXPRESSION_H
+#define PARALLEL_EXPRESSION_H
+#include "Expression.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class Binary_Operator;
+class Environment;
+class Thread_Pool;
+
+/**
+ * Parallel_Expression evaluerar ett enda mycket stort uttryck med
+ * fork-join i en Thread_Pool. Konstruktorn går igenom trädet en gång och
+ * sparar skelettet av de operatornoder vars deltråd har minst cutoff
+ * noder. Vid evalueringen blir varje skelettnod med två stora barn en
+ * uppgift för vänster barn medan den egna tråden fortsätter till höger;
+ * deltråd under cutoff evalueras sekventiellt som vanligt.
+ *
+ * Långa kedjor av + och * ger ett skelett utan förgreningar och därmed
+ * ingen parallellism. Med rebalance omgrupperas de först till balanserade
+ * träd, se Expression::rebalance(); det ändrar avrundningen och är därför
+ * ett val. Uttryck med tilldelningar under roten, eller med en annan
+ * precision än long double, evalueras sekventiellt.
+ */
+class Parallel_Expression
+{
+ public:
+  static constexpr std::size_t default_cutoff{ 4096 };
+
+  explicit Parallel_Expression(const Expression& expression, bool rebalance = false,
+                               std::size_t cutoff = default_cutoff);
+
+  long double evaluate() const;
+  long double evaluate(Environment& environment) const;
+  long double evaluate(Environment& environment, Thread_Pool& pool) const;
+  // parts() är antalet noder i skelettet; 0 betyder sekventiell evaluering.
+  std::size_t parts() const;
+
+ private:
+  // Part är en skelettnod. left och right är index för barnens Part, eller
+  // none om barnet är litet.
+  struct Part
+  {
+    const Binary_Operator* node;
+    std::uint32_t          left;
+    std::uint32_t          right;
+  };
+  static constexpr std::uint32_t none{ UINT32_MAX };
+
+  Expression        expression_;
+  std::vector<Part> parts_;
+  // target_ är tilldelningens slot när roten är en tilldelning.
+  bool              assign_{ false };
+  std::size_t       target_{ 0 };
+
+  long double run(std::uint32_t part, Environment& environment, Thread_Pool& pool) const;
+};
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * Parse_Cache.cc
+ */
+#include "Parse_Cache.h"
+#include "Expression.h"
+#include <utility>
+using namespace std;
+
+/*
+ * entries_ är ordnad från senast till längst sedan använd. index_ pekar in
+ * i listan; nycklarna är vyer av strängarna i listan, som aldrig flyttas.
+ */
+Parse_Cache::Parse_Cache(size_t capacity)
+{
+  statistics_.capacity = capacity;
+}
+
+/*
+ * find() returnerar det sparade uttrycket för nyckeln, eller nullptr.
+ */
+shared_ptr<const Expression> Parse_Cache::find(const string& key)
+{
+  lock_guard<mutex> guard{ lock_ };
+
+  auto it = index_.find(key);
+  if (it == index_.end())
+    {
+      ++statistics_.misses;
+      return nullptr;
+    }
+
+  ++statistics_.hits;
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return it->second->second;
+}
+
+void Parse_Cache::insert(string key, shared_ptr<const Expression> expression)
+{
+  lock_guard<mutex> guard{ lock_ };
+
+  if (statistics_.capacity == 0 || index_.count(key) != 0)
+    return;
+
+  evict(statistics_.capacity - 1);
+  entries_.emplace_front(std::move(key), std::move(expression));
+  index_.emplace(entries_.front().first, entries_.begin());
+  statistics_.size = entries_.size();
+}
+
+size_t Parse_Cache::capacity() const
+{
+  lock_guard<mutex> guard{ lock_ };
+  return statistics_.capacity;
+}
+
+/*
+ * set_capacity() ändrar största antalet uttryck och kastar de överskjutande.
+ */
+void Parse_Cache::set_capacity(size_t capacity)
+{
+  lock_guard<mutex> guard{ lock_ };
+  statistics_.capacity = capacity;
+  evict(capacity);
+}
+
+void Parse_Cache::clear()
+{
+  lock_guard<mutex> guard{ lock_ };
+  index_.clear();
+  entries_.clear();
+  statistics_ = Statistics{ 0, 0, 0, 0, statistics_.capacity };
+}
+
+Parse_Cache::Statistics Parse_Cache::statistics() const
+{
+  lock_guard<mutex> guard{ lock_ };
+  return statistics_;
+}
+
+Parse_Cache& Parse_Cache::global()
+{
+  static Parse_Cache cache;
+  return cache;
+}
+
+// evict() kastar de längst sedan använda uttrycken tills högst size återstår.
+void Parse_Cache::evict(size_t size)
+{
+  while (entries_.size() > size)
+    {
+      index_.erase(entries_.back().first);
+      entries_.pop_back();
+      ++statistics_.evictions;
+    }
+  statistics_.size = entries_.size();
+}
@@ -0,0 +1,63 @@
+/*
+ * Parse_Cache.h
+ */
+#ifndef PARSE_CACHE_H
+#define PARSE_CACHE_H
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+class Expression;
+
+/**
+ * Parse_Cache sparar de senast parsade uttrycken, nycklade på normaliserad
+ * infixtext (se normalize_infix()). När cachen är full kastas det uttryck
+ * som använts längst tillbaka (LRU). Sparade uttryck ändras aldrig och
+ * delas ut som shared_ptr, så de lever kvar även om de kastas ur cachen.
+ * Operationerna är trådsäkra. Kapaciteten 0 stänger av cachen.
+ */
+class Parse_Cache
+{
+ public:
+  struct Statistics
+  {
+    std::size_t hits{ 0 };
+    std::size_t misses{ 0 };
+    std::size_t evictions{ 0 };
+    std::size_t size{ 0 };
+    std::size_t capacity{ 0 };
+  };
+
+  explicit Parse_Cache(std::size_t capacity = default_capacity);
+
+  Parse_Cache(const Parse_Cache&) = delete;
+  Parse_Cache& operator=(const Parse_Cache&) = delete;
+
+  std::shared_ptr<const Expression> find(const std::string& key);
+  void insert(std::string key, std::shared_ptr<const Expression> expression);
+
+  std::size_t capacity() const;
+  void        set_capacity(std::size_t capacity);
+  void        clear();
+  Statistics  statistics() const;
+
+  static Parse_Cache& global();
+
+  static constexpr std::size_t default_capacity{ 4096 };
+
+ private:
+  using Entry = std::pair<std::string, std::shared_ptr<const Expression>>;
+
+  mutable std::mutex    lock_;
+  std::list<Entry>      entries_;
+  std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+  Statistics            statistics_;
+
+  void evict(std::size_t size);
+};
+
+#endif
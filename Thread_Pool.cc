@@ -0,0 +1,204 @@
+/*
+ * Thread_Pool.cc
+ */
+#include "Thread_Pool.h"
+#include <algorithm>
+#include <exception>
+#include <utility>
+using namespace std;
+
+namespace
+{
+  // Poolen och köindex för den aktuella tråden, om den tillhör en pool.
+  thread_local const Thread_Pool* current_pool{ nullptr };
+  thread_local size_t             current_index{ 0 };
+
+  // Antal försök i run_until() innan tråden lägger sig att sova.
+  constexpr int spin_limit{ 64 };
+}
+
+Thread_Pool::Thread_Pool(size_t threads)
+{
+  threads = max<size_t>(threads, 1);
+  for (size_t i = 0; i < threads; ++i)
+    queues_.push_back(make_unique<Queue>());
+  for (size_t i = 0; i < threads; ++i)
+    threads_.emplace_back(&Thread_Pool::work, this, i);
+}
+
+Thread_Pool::~Thread_Pool()
+{
+  {
+    lock_guard<mutex> guard{ sleep_lock_ };
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (auto& thread : threads_)
+    thread.join();
+}
+
+size_t Thread_Pool::size() const
+{
+  return threads_.size();
+}
+
+void Thread_Pool::submit(Task task)
+{
+  const size_t index = current_pool == this
+    ? current_index
+    : next_.fetch_add(1, memory_order_relaxed) % queues_.size();
+  // queued_ räknas upp först, så att den aldrig blir mindre än antalet
+  // uppgifter i köerna.
+  queued_.fetch_add(1);
+  {
+    lock_guard<mutex> guard{ queues_[index]->lock };
+    queues_[index]->tasks.push_back(std::move(task));
+  }
+  {
+    lock_guard<mutex> guard{ sleep_lock_ };
+  }
+  wake_.notify_one();
+  notify_waiting();
+}
+
+/*
+ * notify_waiting() väcker trådarna i run_until(), om det finns några.
+ * Låset tas innan de väcks, så att ingen missar väckningen mellan sin
+ * kontroll och sin väntan.
+ */
+void Thread_Pool::notify_waiting()
+{
+  if (waiting_.load() == 0)
+    return;
+  {
+    lock_guard<mutex> guard{ sleep_lock_ };
+  }
+  done_.notify_all();
+}
+
+/*
+ * try_run() utför en uppgift, i första hand från kön self och annars stulen
+ * från någon annan kö. Den returnerar false om alla köer var tomma.
+ */
+bool Thread_Pool::try_run(size_t self)
+{
+  Task task;
+  const size_t count = queues_.size();
+
+  for (size_t i = 0; i < count && !task; ++i)
+    {
+      Queue& queue = *queues_[(self + i) % count];
+      lock_guard<mutex> guard{ queue.lock };
+      if (queue.tasks.empty())
+	continue;
+      if (i == 0)
+	{
+	  task = std::move(queue.tasks.back());
+	  queue.tasks.pop_back();
+	}
+      else
+	{
+	  task = std::move(queue.tasks.front());
+	  queue.tasks.pop_front();
+	}
+    }
+
+  if (!task)
+    return false;
+  queued_.fetch_sub(1);
+  task();
+  notify_waiting();
+  return true;
+}
+
+void Thread_Pool::work(size_t index)
+{
+  current_pool = this;
+  current_index = index;
+
+  for (;;)
+    {
+      if (try_run(index))
+	continue;
+
+      unique_lock<mutex> guard{ sleep_lock_ };
+      wake_.wait(guard, [this] { return stop_ || queued_.load() > 0; });
+      if (stop_)
+	return;
+    }
+}
+
+void Thread_Pool::run_until(const atomic<size_t>& remaining)
+{
+  const size_t self = current_pool == this ? current_index : 0;
+  int spins{ 0 };
+  while (remaining.load() != 0)
+    {
+      if (try_run(self))
+	{
+	  spins = 0;
+	  continue;
+	}
+      if (++spins < spin_limit)
+	{
+	  this_thread::yield();
+	  continue;
+	}
+
+      unique_lock<mutex> guard{ sleep_lock_ };
+      waiting_.fetch_add(1);
+      done_.wait(guard, [&] { return remaining.load() == 0 || queued_.load() > 0; });
+      waiting_.fetch_sub(1);
+      spins = 0;
+    }
+}
+
+void Thread_Pool::parallel_for(size_t count, size_t grain,
+			       const function<void(size_t, size_t)>& body)
+{
+  if (count == 0)
+    return;
+  grain = max<size_t>(grain, 1);
+
+  atomic<size_t> remaining{ (count + grain - 1) / grain };
+  exception_ptr error;
+  mutex error_lock;
+
+  // split() lägger andra halvan som en ny uppgift och fortsätter med den
+  // första, tills intervallet är högst grain stort.
+  function<void(size_t, size_t)> split = [&](size_t first, size_t last)
+    {
+      while (last - first > grain)
+	{
+	  const size_t middle = first + ((last - first) / grain + 1) / 2 * grain;
+	  submit([&split, middle, last] { split(middle, last); });
+	  last = middle;
+	}
+      try
+	{
+	  body(first, last);
+	}
+      catch (...)
+	{
+	  lock_guard<mutex> guard{ error_lock };
+	  if (!error)
+	    error = current_exception();
+	}
+      remaining.fetch_sub(1);
+    };
+
+  split(0, count);
+  run_until(remaining);
+
+  if (error)
+    rethrow_exception(error);
+}
+
+/*
+ * global() är en pool med en tråd per hårdvarutråd.
+ */
+Thread_Pool& Thread_Pool::global()
+{
+  static Thread_Pool instance;
+  return instance;
+}
@@ -0,0 +1,78 @@
+/*
+ * Thread_Pool.h
+ */
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Thread_Pool är en trådpool med arbetsstöld (work stealing). Varje tråd
+ * har en egen kö; den tar uppgifter från slutet av sin egen kö och stjäl
+ * från början av andras när den egna är tom. En uppgift som läggs till
+ * från en av poolens trådar hamnar i trådens egen kö, andra fördelas runt.
+ *
+ * En tråd som väntar i run() eller parallel_for() utför själv uppgifter
+ * under tiden, så uppgifter kan vänta på deluppgifter utan att låsa poolen.
+ */
+class Thread_Pool
+{
+ public:
+  using Task = std::function<void()>;
+
+  explicit Thread_Pool(std::size_t threads = std::thread::hardware_concurrency());
+  ~Thread_Pool();
+
+  Thread_Pool(const Thread_Pool&) = delete;
+  Thread_Pool& operator=(const Thread_Pool&) = delete;
+
+  std::size_t size() const;
+
+  void submit(Task task);
+
+  // run_until() utför uppgifter tills remaining har räknats ned till 0.
+  // remaining ska räknas ned av en uppgift i poolen. Finns inga uppgifter
+  // att utföra sover tråden efter en kort stund, tills en uppgift blir
+  // klar eller en ny läggs till.
+  void run_until(const std::atomic<std::size_t>& remaining);
+
+  // parallel_for() anropar body(first, last) för delintervall av
+  // [0, count) med högst grain element vardera och väntar tills alla är
+  // klara. Intervallet delas rekursivt, så att stulna uppgifter är stora.
+  // Kastar body ett undantag kastas det första vidare när alla är klara.
+  void parallel_for(std::size_t count, std::size_t grain,
+                    const std::function<void(std::size_t, std::size_t)>& body);
+
+  static Thread_Pool& global();
+
+ private:
+  struct Queue
+  {
+    std::mutex       lock;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread>            threads_;
+  std::atomic<std::size_t>            queued_{ 0 };
+  std::atomic<std::size_t>            next_{ 0 };
+  std::mutex                          sleep_lock_;
+  std::condition_variable             wake_;
+  // done_ väcker trådar i run_until(); waiting_ är antalet som sover där.
+  std::condition_variable             done_;
+  std::atomic<std::size_t>            waiting_{ 0 };
+  bool                                stop_{ false };
+
+  bool try_run(std::size_t self);
+  void notify_waiting();
+  void work(std::size_t index);
+};
+
+#endif
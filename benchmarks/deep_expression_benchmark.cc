@@ -0,0 +1,138 @@
+/*
+ * deep_expression_benchmark.cc
+ *
+ * Stresstest för mycket djupa uttryck. Varje trädform parsas, evalueras,
+ * kompileras, skrivs ut och förstörs en gång, och tiden för varje steg
+ * skrivs ut. Med rekursiva genomgångar skulle stacken ta slut långt före
+ * standarddjupet 10^7. Byggs från katalogen benchmarks med
+ *
+ *   g++ -std=c++17 -O2 -pthread -I.. ../[A-Z]*.cc deep_expression_benchmark.cc
+ *
+ * Användning: a.out [--depth n] [--shape namn]
+ * Formerna är left_chain, right_nested och power_chain. Utan --shape körs
+ * alla. Ett djup på 10^7 kräver några GB minne.
+ */
+#include "Compiled_Expression.h"
+#include "Environment.h"
+#include "Expression.h"
+#include "Node_Pool.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <sys/resource.h>
+using namespace std;
+
+namespace
+{
+  // Trädformerna har djupet depth.
+  string left_chain(size_t depth)
+  {
+    string text{ "x" };
+    text.reserve(2 * depth + 1);
+    for (size_t i = 0; i < depth; ++i)
+      text += "+1";
+    return text;
+  }
+
+  string right_nested(size_t depth)
+  {
+    string text;
+    text.reserve(4 * depth + 1);
+    for (size_t i = 0; i < depth; ++i)
+      text += "1+(";
+    text += "x";
+    text.append(depth, ')');
+    return text;
+  }
+
+  string power_chain(size_t depth)
+  {
+    string text;
+    text.reserve(2 * depth + 1);
+    for (size_t i = 0; i < depth; ++i)
+      text += "1^";
+    text += "x";
+    return text;
+  }
+
+  // peak_memory() ger processens största minnesanvändning i MB.
+  long peak_memory()
+  {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024;
+  }
+
+  // step() kör body en gång och skriver tiden.
+  void step(const string& shape, const string& operation, const function<void()>& body)
+  {
+    using clock = chrono::steady_clock;
+    const auto start = clock::now();
+    body();
+    const double seconds = chrono::duration<double>(clock::now() - start).count();
+    printf("%-14s %-20s %10.3f s %8ld MB\n", shape.c_str(), operation.c_str(),
+	   seconds, peak_memory());
+    fflush(stdout);
+  }
+
+  // Resultatet av varje steg skrivs hit så att det inte optimeras bort.
+  volatile long double sink;
+
+  void run_shape(const string& shape, const string& infix)
+  {
+    Environment environment;
+    environment.set("x", 1.0L);
+
+    auto expression = make_unique<Expression>();
+    step(shape, "parse_expression", [&]
+      {
+	*expression = parse_expression(infix, make_shared<Node_Pool>());
+      });
+    step(shape, "evaluate", [&] { sink = expression->evaluate(environment); });
+    step(shape, "evaluate_incremental", [&]
+      {
+	sink = expression->evaluate_incremental(environment);
+      });
+    step(shape, "compiled_evaluate", [&]
+      {
+	sink = expression->compile().evaluate(environment);
+      });
+    step(shape, "get_infix", [&] { sink = expression->get_infix().size(); });
+    step(shape, "get_postfix", [&] { sink = expression->get_postfix().size(); });
+    step(shape, "copy", [&] { Expression copy{ *expression }; sink = copy.empty(); });
+    step(shape, "destroy", [&] { expression.reset(); });
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  size_t depth{ 10000000 };
+  string shape;
+
+  for (int i = 1; i < argc; ++i)
+    {
+      if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc)
+	depth = max<size_t>(1, strtoul(argv[++i], nullptr, 10));
+      else if (strcmp(argv[i], "--shape") == 0 && i + 1 < argc)
+	shape = argv[++i];
+      else
+	{
+	  cerr << "Användning: " << argv[0] << " [--depth n] [--shape namn]\n";
+	  return 1;
+	}
+    }
+
+  printf("%-14s %-20s %12s %11s\n", "shape", "operation", "tid", "max minne");
+  if (shape.empty() || shape == "left_chain")
+    run_shape("left_chain", left_chain(depth));
+  if (shape.empty() || shape == "right_nested")
+    run_shape("right_nested", right_nested(depth));
+  if (shape.empty() || shape == "power_chain")
+    run_shape("power_chain", power_chain(depth));
+  return 0;
+}
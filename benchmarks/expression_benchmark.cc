@@ -0,0 +1,277 @@
+/*
+ * expression_benchmark.cc
+ *
+ * Mikrobenchmarks för parsning, evaluering, kopiering och utskrift av
+ * uttryck över olika trädformer. Byggs från katalogen benchmarks med
+ *
+ *   g++ -std=c++17 -O2 -pthread -I.. ../[A-Z]*.cc expression_benchmark.cc
+ *
+ * Användning: a.out [--size n] [--time sekunder] [--json fil]
+ * Resultaten skrivs som tabell och, med --json, som JSON till filen.
+ */
+#include "Compiled_Expression.h"
+#include "Environment.h"
+#include "Expression.h"
+#include "Flat_Expression.h"
+#include "Node_Pool.h"
+#include "Parse_Cache.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Alla allokeringar räknas, så att allokeringar per operation kan anges.
+namespace
+{
+  atomic<size_t> allocations{ 0 };
+}
+
+void* operator new(size_t size)
+{
+  allocations.fetch_add(1, memory_order_relaxed);
+  if (void* p = malloc(size == 0 ? 1 : size))
+    return p;
+  throw bad_alloc{};
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  free(p);
+}
+
+namespace
+{
+  struct Result
+  {
+    string shape;
+    string operation;
+    size_t nodes;
+    double ns_per_op;
+    double ops_per_second;
+    double allocations_per_op;
+  };
+
+  // name() ger ett variabelnamn av bokstäver för index i.
+  string name(size_t i)
+  {
+    string result;
+    do
+      {
+	result += static_cast<char>('a' + i % 26);
+	i /= 26;
+      }
+    while (i != 0);
+    return result;
+  }
+
+  // Trädformerna. Alla har ungefär size löv.
+  string left_chain(size_t size)
+  {
+    string text{ "x" };
+    for (size_t i = 1; i < size; ++i)
+      text += (i % 2 ? "+" : "*") + to_string(i % 7 + 1);
+    return text;
+  }
+
+  string right_chain(size_t size)
+  {
+    string text;
+    for (size_t i = 1; i < size; ++i)
+      text += to_string(i % 7 + 1) + (i % 2 ? "+(" : "*(");
+    text += "x";
+    text.append(size - 1, ')');
+    return text;
+  }
+
+  string balanced(size_t first, size_t last)
+  {
+    if (last - first == 1)
+      return first % 2 ? "x" : to_string(first % 7 + 1);
+    const size_t middle = first + (last - first) / 2;
+    return "(" + balanced(first, middle) + (middle % 2 ? "+" : "*") +
+      balanced(middle, last) + ")";
+  }
+
+  string wide(size_t size)
+  {
+    string text{ name(0) };
+    for (size_t i = 1; i < size; ++i)
+      text += "+" + name(i);
+    return text;
+  }
+
+  // measure() upprepar operation tills minst seconds sekunder har gått.
+  Result measure(const string& shape, const string& operation, size_t nodes,
+		 double seconds, const function<void()>& body)
+  {
+    body();   // uppvärmning
+
+    using clock = chrono::steady_clock;
+    size_t iterations{ 0 };
+    size_t batch{ 1 };
+    const size_t before = allocations.load();
+    const auto start = clock::now();
+    double elapsed{ 0 };
+
+    while (elapsed < seconds)
+      {
+	for (size_t i = 0; i < batch; ++i)
+	  body();
+	iterations += batch;
+	batch *= 2;
+	elapsed = chrono::duration<double>(clock::now() - start).count();
+      }
+
+    const size_t allocated = allocations.load() - before;
+    return { shape, operation, nodes, elapsed * 1e9 / iterations,
+	     iterations / elapsed, static_cast<double>(allocated) / iterations };
+  }
+
+  // Resultatet av varje operation skrivs hit så att den inte optimeras bort.
+  volatile long double sink;
+
+  void run_shape(const string& shape, const string& infix, double seconds,
+		 vector<Result>& results)
+  {
+    Environment environment;
+    for (size_t i = 0; i < 26 * 26; ++i)
+      environment.set(name(i), 1.0L + i % 3 * 0.5L);
+    environment.set("x", 1.5L);
+
+    Parse_Cache::global().set_capacity(Parse_Cache::default_capacity);
+    // nodes är antalet olika noder, efter hash-consing.
+    const auto pool = make_shared<Node_Pool>();
+    const Expression expression = parse_expression(infix, pool);
+    const Compiled_Expression program = expression.compile();
+    const Flat_Expression flat = expression.flatten();
+    const size_t nodes = pool->size();
+
+    auto add = [&](const string& operation, const function<void()>& body)
+      {
+	results.push_back(measure(shape, operation, nodes, seconds, body));
+      };
+
+    add("normalize_infix", [&] { sink = normalize_infix(infix).size(); });
+    add("parse_expression", [&]
+      {
+	sink = parse_expression(infix, make_shared<Node_Pool>()).empty();
+      });
+    add("make_expression_cached", [&] { sink = make_expression(infix).empty(); });
+    add("evaluate", [&] { sink = expression.evaluate(environment); });
+    add("evaluate_double", [&] { sink = expression.evaluate<double>(environment); });
+    add("evaluate_float", [&] { sink = expression.evaluate<float>(environment); });
+    add("evaluate_incremental", [&]
+      {
+	sink = expression.evaluate_incremental(environment);
+      });
+    add("compile", [&] { sink = expression.compile().size(); });
+    add("compiled_evaluate", [&] { sink = program.evaluate(environment); });
+    add("flatten", [&] { sink = expression.flatten().size(); });
+    add("flat_evaluate", [&] { sink = flat.evaluate(environment); });
+    vector<long double> partials;
+    Expression::Tape tape;
+    add("gradient", [&] { sink = expression.gradient(environment, partials, tape); });
+    add("derive", [&] { sink = derive(expression, "x").empty(); });
+    const Compiled_Expression derivative = derive(expression, "x").compile();
+    add("derivative_evaluate", [&] { sink = derivative.evaluate(environment); });
+    add("copy", [&] { Expression copy{ expression }; sink = copy.empty(); });
+    add("get_infix", [&] { sink = expression.get_infix().size(); });
+    add("get_postfix", [&] { sink = expression.get_postfix().size(); });
+    add("print_tree", [&]
+      {
+	ostringstream os;
+	expression.print_tree(os);
+	sink = os.tellp();
+      });
+  }
+
+  string json_escape(const string& text)
+  {
+    string result;
+    for (char c : text)
+      {
+	if (c == '"' || c == '\\')
+	  result += '\\';
+	result += c;
+      }
+    return result;
+  }
+
+  void write_json(ostream& os, size_t size, const vector<Result>& results)
+  {
+    os << "{\n  \"size\": " << size << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i)
+      {
+	const Result& r = results[i];
+	char line[512];
+	snprintf(line, sizeof line,
+		 "    {\"shape\": \"%s\", \"operation\": \"%s\", \"nodes\": %zu, \"ns_per_op\": %.1f, "
+		 "\"ops_per_second\": %.1f, \"allocations_per_op\": %.2f}%s\n",
+		 json_escape(r.shape).c_str(), json_escape(r.operation).c_str(),
+		 r.nodes, r.ns_per_op, r.ops_per_second, r.allocations_per_op,
+		 i + 1 < results.size() ? "," : "");
+	os << line;
+      }
+    os << "  ]\n}\n";
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  size_t size{ 1000 };
+  double seconds{ 0.2 };
+  string json;
+
+  for (int i = 1; i < argc; ++i)
+    {
+      if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+	size = max<size_t>(2, strtoul(argv[++i], nullptr, 10));
+      else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc)
+	seconds = strtod(argv[++i], nullptr);
+      else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+	json = argv[++i];
+      else
+	{
+	  cerr << "Användning: " << argv[0]
+	       << " [--size n] [--time sekunder] [--json fil]\n";
+	  return 1;
+	}
+    }
+
+  vector<Result> results;
+  run_shape("left_chain", left_chain(size), seconds, results);
+  run_shape("right_chain", right_chain(size), seconds, results);
+  run_shape("balanced", balanced(0, size), seconds, results);
+  run_shape("wide_variables", wide(size), seconds, results);
+
+  printf("%-16s %-24s %14s %14s %12s\n", "shape", "operation", "ns/op", "ops/s", "allocs/op");
+  for (const Result& r : results)
+    printf("%-16s %-24s %14.1f %14.1f %12.2f\n", r.shape.c_str(), r.operation.c_str(),
+	   r.ns_per_op, r.ops_per_second, r.allocations_per_op);
+
+  if (!json.empty())
+    {
+      ofstream file{ json };
+      write_json(file, size, results);
+      if (!file)
+	{
+	  cerr << "Kan inte skriva " << json << '\n';
+	  return 1;
+	}
+    }
+  return 0;
+}
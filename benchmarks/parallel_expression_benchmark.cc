@@ -0,0 +1,161 @@
+/*
+ * parallel_expression_benchmark.cc
+ *
+ * Mäter Parallel_Expression på ett enda stort uttryck mot antalet trådar.
+ * Varje form evalueras sekventiellt med Expression::evaluate() och sedan
+ * med 1, 2, 4, ... trådar, och tiden och uppsnabbningen mot den
+ * sekventiella evalueringen skrivs ut. Byggs från katalogen benchmarks med
+ *
+ *   g++ -std=c++17 -O2 -pthread -I.. ../[A-Z]*.cc parallel_expression_benchmark.cc
+ *
+ * Användning: a.out [--size n] [--threads max] [--cutoff n] [--repeat n]
+ * Formerna är balanced, ett balanserat träd, och left_chain, en lång kedja
+ * av + och *, som bara blir parallell med rebalance. Standard för --threads
+ * är antalet hårdvarutrådar.
+ */
+#include "Environment.h"
+#include "Expression.h"
+#include "Node_Pool.h"
+#include "Parallel_Expression.h"
+#include "Thread_Pool.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+using namespace std;
+
+namespace
+{
+  // term() ger det i:te lövet. Konstanterna är olika, så att inga deltråd
+  // blir delade noder, och variablerna gör att inget kan vikas bort.
+  string term(size_t i)
+  {
+    switch (i % 3)
+      {
+      case 0:  return "x";
+      case 1:  return to_string(i) + ".5";
+      default: return "y";
+      }
+  }
+
+  // balanced() ger ett balanserat träd med size löv och omväxlande + och *.
+  void balanced(string& text, size_t first, size_t size, unsigned depth)
+  {
+    if (size == 1)
+      {
+	text += term(first);
+	return;
+      }
+    text += '(';
+    balanced(text, first, size / 2, depth + 1);
+    text += depth % 2 == 0 ? '+' : '*';
+    balanced(text, first + size / 2, size - size / 2, depth + 1);
+    text += ')';
+  }
+
+  // left_chain() ger en summa av size produkter med två faktorer.
+  string left_chain(size_t size)
+  {
+    string text;
+    text.reserve(24 * size);
+    for (size_t i = 0; i < size; ++i)
+      {
+	if (i > 0)
+	  text += '+';
+	text += term(i);
+	text += '*';
+	text += term(i + 1);
+      }
+    return text;
+  }
+
+  // Resultatet av varje mätning skrivs hit så att det inte optimeras bort.
+  volatile long double sink;
+
+  // measure() ger den bästa tiden av repeat körningar av body.
+  double measure(unsigned repeat, const function<long double()>& body)
+  {
+    using clock = chrono::steady_clock;
+    double best{ 0 };
+    for (unsigned i = 0; i < repeat; ++i)
+      {
+	const auto start = clock::now();
+	sink = body();
+	const double seconds = chrono::duration<double>(clock::now() - start).count();
+	if (i == 0 || seconds < best)
+	  best = seconds;
+      }
+    return best;
+  }
+
+  // run_shape() jämför med den sekventiella evalueringen av samma träd,
+  // efter rebalance om den används.
+  void run_shape(const string& shape, const string& infix, bool rebalance,
+		 size_t max_threads, size_t cutoff, unsigned repeat)
+  {
+    Environment environment;
+    environment.set("x", 1.0001L);
+    environment.set("y", 0.9999L);
+
+    const Expression expression = parse_expression(infix, make_shared<Node_Pool>());
+    const Expression measured = rebalance ? expression.rebalance() : expression;
+    const double sequential = measure(repeat, [&] { return measured.evaluate(environment); });
+    printf("%-12s %-9s %7s %7s %10.3f ms %8s\n", shape.c_str(), rebalance ? "ja" : "nej",
+	   "sekv", "-", 1000 * sequential, "1.00");
+
+    const Parallel_Expression parallel{ expression, rebalance, cutoff };
+    for (size_t threads = 1;; threads = min(2 * threads, max_threads))
+      {
+	Thread_Pool pool{ threads };
+	const double seconds = measure(repeat, [&] { return parallel.evaluate(environment, pool); });
+	printf("%-12s %-9s %7zu %7zu %10.3f ms %8.2f\n", shape.c_str(), rebalance ? "ja" : "nej",
+	       threads, parallel.parts(), 1000 * seconds, sequential / seconds);
+	fflush(stdout);
+	if (threads == max_threads)
+	  break;
+      }
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  size_t size{ 1000000 };
+  size_t max_threads{ max(1u, thread::hardware_concurrency()) };
+  size_t cutoff{ Parallel_Expression::default_cutoff };
+  unsigned repeat{ 5 };
+
+  for (int i = 1; i < argc; ++i)
+    {
+      if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+	size = max<size_t>(2, strtoul(argv[++i], nullptr, 10));
+      else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+	max_threads = max<size_t>(1, strtoul(argv[++i], nullptr, 10));
+      else if (strcmp(argv[i], "--cutoff") == 0 && i + 1 < argc)
+	cutoff = strtoul(argv[++i], nullptr, 10);
+      else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+	repeat = max(1u, static_cast<unsigned>(strtoul(argv[++i], nullptr, 10)));
+      else
+	{
+	  cerr << "Användning: " << argv[0]
+	       << " [--size n] [--threads max] [--cutoff n] [--repeat n]\n";
+	  return 1;
+	}
+    }
+
+  string tree;
+  tree.reserve(24 * size);
+  balanced(tree, 0, size, 0);
+  const string chain = left_chain(size);
+
+  printf("%-12s %-9s %7s %7s %13s %8s\n", "shape", "rebalance", "trådar", "delar",
+	 "tid", "uppsnabbn");
+  run_shape("balanced", tree, false, max_threads, cutoff, repeat);
+  run_shape("left_chain", chain, false, max_threads, cutoff, repeat);
+  run_shape("left_chain", chain, true, max_threads, cutoff, repeat);
+  return 0;
+}
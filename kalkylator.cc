@@ -1,14 +1,68 @@
 #include "Calculator.h"
+#include <cstring>
+#include <fstream>
 #include <iostream>
 using namespace std;
 
-int main()
+/*
+ * Utan argument körs kalkylatorn interaktivt. Med --batch fil läses
+ * kommandon och uttryck från filen, eller från standard in om filen är -.
+ * --precision float, double eller long anger i vilken typ uttrycken
+ * evalueras; standard är long double.
+ */
+int main(int argc, char* argv[])
 {
   Calculator calc;
+  const char* batch{ nullptr };
+  bool usage{ false };
+
+  for (int i = 1; i < argc && !usage; ++i)
+    {
+      if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+	batch = argv[++i];
+      else if (strcmp(argv[i], "--precision") == 0 && i + 1 < argc)
+	{
+	  const char* name = argv[++i];
+	  if (strcmp(name, "float") == 0)
+	    calc.set_precision(Expression::Precision::Float);
+	  else if (strcmp(name, "double") == 0)
+	    calc.set_precision(Expression::Precision::Double);
+	  else if (strcmp(name, "long") == 0)
+	    calc.set_precision(Expression::Precision::Long_Double);
+	  else
+	    usage = true;
+	}
+      else
+	usage = true;
+    }
+
+  if (usage)
+    {
+      cerr << "Användning: " << argv[0]
+	   << " [--batch fil|-] [--precision float|double|long]\n";
+      return 1;
+    }
 
   try
     {
-      calc.run();
+      if (batch != nullptr)
+	{
+	  ios::sync_with_stdio(false);
+	  if (strcmp(batch, "-") == 0)
+	    calc.run_batch(cin, cout);
+	  else
+	    {
+	      ifstream file{ batch, ios::binary };
+	      if (!file)
+		{
+		  cerr << "Kan inte öppna " << batch << '\n';
+		  return 1;
+		}
+	      calc.run_batch(file, cout);
+	    }
+	}
+      else
+	calc.run();
     }
   catch (const exception& e) // ska inte kunna hända här egentligen
     {
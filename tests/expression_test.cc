@@ -0,0 +1,156 @@
+/*
+ * expression_test.cc
+ *
+ * Regressionstester för uttryck: varje test skriver ut sitt namn om det
+ * misslyckas, och programmet avslutas med 1 om något test misslyckades.
+ * Byggs och körs från katalogen tests med
+ *
+ *   g++ -std=c++17 -O2 -pthread -I.. ../[A-Z]*.cc expression_test.cc && ./a.out
+ */
+#include "Environment.h"
+#include "Expression.h"
+#include "Expression_Archive.h"
+#include "Flat_Expression.h"
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+namespace
+{
+  int failures{ 0 };
+
+  void check(const string& name, bool condition)
+  {
+    if (!condition)
+      {
+	cerr << "MISSLYCKADES: " << name << '\n';
+	++failures;
+      }
+  }
+
+  // Delade deltråd ska vara delade även efter save() och load_expression(),
+  // så att flatten() inte vecklar ut dem.
+  void archive_keeps_sharing()
+  {
+    const Expression expression = make_expression("(a+b)*(a+b)^c");
+    ostringstream os;
+    expression.save(os);
+    const Expression loaded = load_expression(os.str());
+    check("arkiv: samma infix", loaded.get_infix() == expression.get_infix());
+    check("arkiv: flatten() lika stor efter inläsning",
+	  loaded.flatten().size() == expression.flatten().size());
+  }
+
+  // optimize() får inte ta bort en tilldelning, även när värdet av
+  // deluttrycket inte behövs.
+  void optimize_keeps_assignments()
+  {
+    for (const char* infix : { "(x = 5) ^ 0", "(x = 5) ^ 1", "(x = 5) * 1", "0 + (x = 5)" })
+      {
+	const Expression optimized = make_expression(infix).optimize();
+	Environment environment;
+	environment.set("x", 0);
+	optimized.evaluate(environment);
+	check(string{ "optimize: tilldelningen i " } + infix + " sker",
+	      environment.get("x") == 5);
+      }
+  }
+
+  // crc32() som i arkivet, för att kunna ändra i ett sparat arkiv.
+  uint32_t crc32(const string& bytes)
+  {
+    uint32_t c = 0xFFFFFFFFu;
+    for (const unsigned char byte : bytes)
+      {
+	c ^= byte;
+	for (int k = 0; k < 8; ++k)
+	  c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      }
+    return ~c;
+  }
+
+  // Ett arkiv med ett variabelnamn som parsern inte kan läsa ska avvisas.
+  // Namnet i ett arkiv med bara a börjar efter huvudet och längden.
+  void archive_rejects_bad_names()
+  {
+    ostringstream os;
+    make_expression("a").save(os);
+    const string saved = os.str();
+    constexpr size_t length_offset{ 20 };
+    for (const string name : { "A", "_", "" })
+      {
+	string archive = saved.substr(0, saved.size() - 4);
+	archive.replace(length_offset + 2, 1, name);
+	archive[length_offset] = static_cast<char>(name.size());
+	const uint32_t crc = crc32(archive);
+	for (int i = 0; i < 4; ++i)
+	  archive += static_cast<char>(crc >> (8 * i));
+	bool rejected = false;
+	try
+	  {
+	    Expression_Archive::read(archive);
+	  }
+	catch (const archive_error&)
+	  {
+	    rejected = true;
+	  }
+	check("arkiv: variabelnamnet \"" + name + "\" avvisas", rejected);
+      }
+  }
+
+  // Ett band som används för ett annat uttryck byggs om.
+  void gradient_tape_follows_expression()
+  {
+    Environment environment;
+    environment.set("x", 3);
+    const size_t x = Symbol_Table::intern("x");
+    vector<long double> partials;
+    Expression::Tape tape;
+    make_expression("x * x").gradient(environment, partials, tape);
+    check("gradient: d(x * x)/dx", partials.at(x) == 6);
+    make_expression("x * x * x").gradient(environment, partials, tape);
+    check("gradient: d(x * x * x)/dx med samma band", partials.at(x) == 27);
+  }
+
+  // Ett deluttryck som viks till en negativ konstant ska kunna läsas
+  // tillbaka från get_infix() och skrivas i postfix som i trädet.
+  void flat_infix_round_trips()
+  {
+    for (const char* infix : { "x * (2 - 5)", "x - (1 - 4)", "x * (0.5 - 2.5)", "(2 - 5) ^ x" })
+      {
+	const Flat_Expression flat = make_expression(infix).flatten();
+	Environment environment;
+	environment.set("x", 3);
+	const Expression parsed = make_expression(flat.get_infix());
+	check(string{ "flatten: get_infix() för " } + infix + " läses tillbaka",
+	      parsed.evaluate(environment) == flat.evaluate(environment));
+	check(string{ "flatten: get_postfix() för " } + infix + " som trädets",
+	      parsed.get_postfix() == flat.get_postfix());
+      }
+  }
+}
+
+int main()
+{
+  try
+    {
+      archive_keeps_sharing();
+      archive_rejects_bad_names();
+      optimize_keeps_assignments();
+      gradient_tape_follows_expression();
+      flat_infix_round_trips();
+    }
+  catch (const exception& error)
+    {
+      cerr << "Oväntat undantag: " << error.what() << '\n';
+      ++failures;
+    }
+
+  if (failures == 0)
+    cout << "Alla tester lyckades\n";
+  return failures == 0 ? 0 : 1;
+}